@@ -0,0 +1,416 @@
+/* osgGeo - A collection of geoscientific extensions to OpenSceneGraph.
+Copyright 2011 dGB Beheer B.V.
+
+osgGeo is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+
+$Id$
+
+*/
+
+
+#include <osgGeo/LayeredTexture>
+#include <osgGeo/LayerProcess>
+#include <osg/ArgumentParser>
+#include <osg/ApplicationUsage>
+#include <osg/Timer>
+#include <OpenThreads/Thread>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <string.h>
+
+
+static unsigned char rampArray[1024];
+static osg::ref_ptr<osgGeo::ColorSequence> rampColSeq;
+
+static osgGeo::ColorSequence* rampColorSequence()
+{
+    if ( !rampColSeq )
+    {
+	for ( int idx=0; idx<256; idx++ )
+	{
+	    rampArray[4*idx+0] = idx;
+	    rampArray[4*idx+1] = 255-idx;
+	    rampArray[4*idx+2] = idx<128 ? 2*idx : 511-2*idx;
+	    rampArray[4*idx+3] = 255;
+	}
+
+	rampColSeq = new osgGeo::ColorSequence( rampArray );
+    }
+    return rampColSeq.get();
+}
+
+
+static osg::Image* createTestImage( int width, int height, int seed )
+{
+    osg::Image* image = new osg::Image;
+    image->allocateImage( width, height, 1, GL_LUMINANCE, GL_UNSIGNED_BYTE );
+
+    unsigned char* ptr = image->data();
+    for ( int t=0; t<height; t++ )
+    {
+	for ( int s=0; s<width; s++ )
+	    *ptr++ = (unsigned char) ((s*7 + t*13 + seed*31 + (s*t)%17) & 0xff);
+    }
+
+    return image;
+}
+
+
+static osgGeo::LayeredTexture* createTestTexture( int width, int height, int nrLayers )
+{
+    osgGeo::LayeredTexture* laytex = new osgGeo::LayeredTexture;
+    laytex->allowShaders( false );
+
+    for ( int idx=0; idx<nrLayers; idx++ )
+    {
+	const int id = laytex->addDataLayer();
+	osg::ref_ptr<osg::Image> image = createTestImage( width, height, idx );
+	laytex->setDataLayerImage( id, image.get() );
+
+	// Semi-transparent upper layers keep every process in the loop
+	osg::ref_ptr<osgGeo::ColTabLayerProcess> process = new osgGeo::ColTabLayerProcess( *laytex );
+	process->setDataLayerID( 0, id, 0 );
+	process->setColorSequence( rampColorSequence() );
+	process->setOpacity( idx ? 0.5f : 1.0f );
+	laytex->addProcess( process.get() );
+    }
+
+    return laytex;
+}
+
+
+static void benchmarkComposite( int width, int height, int nrLayers, int nrRuns )
+{
+    const int nrCores = OpenThreads::GetNumberOfProcessors();
+    double totalTime = 0.0;
+
+    for ( int run=0; run<nrRuns; run++ )
+    {
+	// A fresh texture per run, since the composite is cached otherwise
+	osg::ref_ptr<osgGeo::LayeredTexture> laytex = createTestTexture( width, height, nrLayers );
+
+	const osg::Timer_t start = osg::Timer::instance()->tick();
+	laytex->getCompositeTextureImage();
+	totalTime += osg::Timer::instance()->delta_s( start, osg::Timer::instance()->tick() );
+    }
+
+    const double nrPixels = double(width) * double(height) * nrRuns;
+    const double pixelsPerSec = totalTime>0.0 ? nrPixels/totalTime : 0.0;
+
+    std::cout << "Composite " << width << "x" << height << ", "
+	      << nrLayers << " layers, " << nrRuns << " runs: "
+	      << 1000.0*totalTime/nrRuns << " ms/run, "
+	      << pixelsPerSec*1e-6 << " Mpixels/s, "
+	      << pixelsPerSec*1e-6/(nrCores>0 ? nrCores : 1)
+	      << " Mpixels/s/core (" << nrCores << " cores)" << std::endl;
+}
+
+
+static const char* dataOrderName( osgGeo::ImageDataOrder order )
+{
+    const char* names[] = { "STR", "SRT", "TRS", "TSR", "RST", "RTS" };
+    return names[order];
+}
+
+
+static void benchmarkTileCopy( int width, int height, int nrRuns )
+{
+    // Float data with a few slices, as used for seismic volumes
+    const int depth = 8;
+    const int tileSize = 256;
+
+    osg::ref_ptr<osg::Image> image = new osg::Image;
+    image->allocateImage( width, height, depth, GL_LUMINANCE, GL_FLOAT );
+    memset( image->data(), 0, image->getTotalSizeInBytes() );
+
+    for ( int order=osgGeo::STR; order<=osgGeo::RTS; order++ )
+    {
+	const osgGeo::ImageDataOrder dataOrder = (osgGeo::ImageDataOrder) order;
+
+	// Same dimension permutation as done by LayeredTexture
+	const int dims[3] = { width, height, depth };
+	const int perms[6][3] = { {0,1,2}, {0,2,1}, {1,2,0}, {1,0,2}, {2,0,1}, {2,1,0} };
+
+	osg::ref_ptr<osg::Image> permuted = new osg::Image;
+	permuted->setImage( dims[perms[order][0]], dims[perms[order][1]], dims[perms[order][2]], image->getInternalTextureFormat(), image->getPixelFormat(), image->getDataType(), image->data(), osg::Image::NO_DELETE, image->getPacking() );
+
+	// Tiles from the middle slice
+	const int sliceNr = permuted->r()/2;
+
+	double nrBytes = 0.0;
+	int nrViews = 0;
+	const osg::Timer_t start = osg::Timer::instance()->tick();
+
+	for ( int run=0; run<nrRuns; run++ )
+	{
+	    for ( int y=0; y<permuted->t(); y+=tileSize )
+	    {
+		for ( int x=0; x<permuted->s(); x+=tileSize )
+		{
+		    const osgGeo::Vec2i origin( x, y );
+		    const osgGeo::Vec2i size( std::min(tileSize,permuted->s()-x), std::min(tileSize,permuted->t()-y) );
+
+		    osg::ref_ptr<osg::Image> tile = new osg::Image;
+		    if ( osgGeo::LayeredTexture::setImageTileView(*permuted,*tile,origin,size,sliceNr,dataOrder) )
+			nrViews++;
+		    else
+		    {
+			osgGeo::LayeredTexture::copyImageTile( *permuted, *tile, origin, size, sliceNr, dataOrder );
+			nrBytes += tile->getTotalSizeInBytes();
+		    }
+		}
+	    }
+	}
+
+	const double time = osg::Timer::instance()->delta_s( start, osg::Timer::instance()->tick() );
+
+	std::cout << "Tile copy " << dataOrderName(dataOrder) << " "
+		  << permuted->s() << "x" << permuted->t() << "x" << permuted->r()
+		  << ", " << nrRuns << " runs: " << 1000.0*time/nrRuns << " ms/run, ";
+
+	if ( nrBytes>0.0 )
+	    std::cout << (time>0.0 ? nrBytes/time*1e-6 : 0.0) << " MB/s copied";
+	else
+	    std::cout << nrViews/nrRuns << " zero-copy views";
+
+	std::cout << std::endl;
+    }
+}
+
+
+static osg::Image* createReorderImage( int width, int height, int depth )
+{
+    osg::Image* image = new osg::Image;
+    image->allocateImage( width, height, depth, GL_LUMINANCE, GL_FLOAT );
+
+    float* ptr = (float*) image->data();
+    const int nrPixels = width*height*depth;
+    for ( int idx=0; idx<nrPixels; idx++ )
+	*ptr++ = float( idx%1009 );
+
+    return image;
+}
+
+
+// Plain per-pixel gather, as done by strided tile access without reordering
+static void naiveReorder( osg::Image& image, osgGeo::ImageDataOrder dataOrder )
+{
+    const int dims[3] = { image.s(), image.t(), image.r() };
+    const int perms[6][3] = { {0,1,2}, {0,2,1}, {1,2,0}, {1,0,2}, {2,0,1}, {2,1,0} };
+
+    // Byte steps of the source dimensions s, t and r
+    const size_t pixelSize = image.getPixelSizeInBits()/8;
+    const size_t srcSteps[3] = { pixelSize, pixelSize*dims[0], pixelSize*dims[0]*dims[1] };
+
+    const int* perm = perms[dataOrder];
+    unsigned char* newData = new unsigned char[image.getTotalSizeInBytes()];
+    unsigned char* dstPtr = newData;
+
+    for ( int z=0; z<dims[perm[2]]; z++ )
+    {
+	for ( int y=0; y<dims[perm[1]]; y++ )
+	{
+	    for ( int x=0; x<dims[perm[0]]; x++ )
+	    {
+		const unsigned char* srcPtr = image.data() + x*srcSteps[perm[0]] + y*srcSteps[perm[1]] + z*srcSteps[perm[2]];
+		memcpy( dstPtr, srcPtr, pixelSize );
+		dstPtr += pixelSize;
+	    }
+	}
+    }
+
+    image.setImage( dims[perm[0]], dims[perm[1]], dims[perm[2]], image.getInternalTextureFormat(), image.getPixelFormat(), image.getDataType(), newData, osg::Image::USE_NEW_DELETE, image.getPacking() );
+}
+
+
+static void benchmarkReorder( int width, int height, int nrRuns )
+{
+    const int depth = 8;
+    const char* methods[] = { "naive", "out-of-place", "in-place" };
+
+    for ( int order=osgGeo::SRT; order<=osgGeo::RTS; order++ )
+    {
+	const osgGeo::ImageDataOrder dataOrder = (osgGeo::ImageDataOrder) order;
+
+	for ( int method=0; method<3; method++ )
+	{
+	    double totalTime = 0.0;
+	    double nrBytes = 0.0;
+
+	    for ( int run=0; run<nrRuns; run++ )
+	    {
+		osg::ref_ptr<osg::Image> image = createReorderImage( width, height, depth );
+		nrBytes += image->getTotalSizeInBytes();
+
+		const osg::Timer_t start = osg::Timer::instance()->tick();
+
+		if ( method==0 )
+		    naiveReorder( *image, dataOrder );
+		else
+		    osgGeo::LayeredTexture::reorderImageData( *image, dataOrder, method==2 );
+
+		totalTime += osg::Timer::instance()->delta_s( start, osg::Timer::instance()->tick() );
+	    }
+
+	    std::cout << "Reorder " << dataOrderName(dataOrder) << " "
+		      << width << "x" << height << "x" << depth << " "
+		      << methods[method] << ", " << nrRuns << " runs: "
+		      << 1000.0*totalTime/nrRuns << " ms/run, "
+		      << (totalTime>0.0 ? nrBytes/totalTime*1e-6 : 0.0)
+		      << " MB/s" << std::endl;
+	}
+    }
+}
+
+
+static void benchmarkResample( int width, int height, int nrRuns )
+{
+    // Non-power-of-2 sections, as scaled up by the PowerOf2 size policy
+    const int srcWidth = width*3/4 + 1;
+    const int srcHeight = height*3/4 + 1;
+    const int dstWidth = osgGeo::LayeredTexture::powerOf2Ceil( srcWidth );
+    const int dstHeight = osgGeo::LayeredTexture::powerOf2Ceil( srcHeight );
+
+    const GLenum dataTypes[] = { GL_UNSIGNED_BYTE, GL_FLOAT };
+    const char* typeNames[] = { "byte", "float" };
+    const char* methods[] = { "scaleImage", "box", "triangle", "lanczos" };
+
+    for ( int type=0; type<2; type++ )
+    {
+	osg::ref_ptr<osg::Image> image = new osg::Image;
+	image->allocateImage( srcWidth, srcHeight, 1, GL_LUMINANCE, dataTypes[type] );
+	memset( image->data(), 0, image->getTotalSizeInBytes() );
+
+	for ( int method=0; method<4; method++ )
+	{
+	    double totalTime = 0.0;
+
+	    for ( int run=0; run<nrRuns; run++ )
+	    {
+		osg::ref_ptr<osg::Image> scaled = new osg::Image;
+		const osg::Timer_t start = osg::Timer::instance()->tick();
+
+		if ( method==0 )
+		{
+		    // Previous implementation: copy, then osg::Image::scaleImage
+		    osgGeo::LayeredTexture::copyImageTile( *image, *scaled, osgGeo::Vec2i(0,0), osgGeo::Vec2i(srcWidth,srcHeight) );
+		    scaled->scaleImage( dstWidth, dstHeight, 1 );
+		}
+		else
+		{
+		    const osgGeo::LayeredTexture::ResampleFilter filter = (osgGeo::LayeredTexture::ResampleFilter) (method-1);
+		    osgGeo::LayeredTexture::resampleImage( *image, *scaled, dstWidth, dstHeight, 0, osgGeo::STR, filter );
+		}
+
+		totalTime += osg::Timer::instance()->delta_s( start, osg::Timer::instance()->tick() );
+	    }
+
+	    const double nrPixels = double(dstWidth) * double(dstHeight) * nrRuns;
+
+	    std::cout << "Resample " << typeNames[type] << " "
+		      << srcWidth << "x" << srcHeight << " -> "
+		      << dstWidth << "x" << dstHeight << " " << methods[method]
+		      << ", " << nrRuns << " runs: " << 1000.0*totalTime/nrRuns
+		      << " ms/run, "
+		      << (totalTime>0.0 ? nrPixels/totalTime*1e-6 : 0.0)
+		      << " Mpixels/s" << std::endl;
+	}
+    }
+}
+
+
+int main( int argc, char** argv )
+{
+    osg::ArgumentParser args( &argc, argv );
+
+    osg::ApplicationUsage* usage = args.getApplicationUsage();
+    usage->setCommandLineUsage( "texturebenchmark [options]" );
+    usage->setDescription( "Timing of CPU-side layered texture operations" );
+    usage->addCommandLineOption( "--size <w> <h>", "Layer image size [1,->]" );
+    usage->addCommandLineOption( "--layers <n>", "Number of data layers [1,->]" );
+    usage->addCommandLineOption( "--runs <n>", "Number of timed runs [1,->]" );
+    usage->addCommandLineOption( "--only <name>", "Run one benchmark only: composite|tilecopy|reorder|resample" );
+    usage->addCommandLineOption( "--help | --usage", "Command line info" );
+
+    if ( args.read("--help") || args.read("--usage") )
+    {
+	std::cout << std::endl << usage->getDescription() << std::endl << std::endl;
+	usage->write( std::cout );
+	return 1;
+    }
+
+    int width = 4096;
+    int height = 2048;
+    while ( args.read("--size", width, height) )
+    {
+	if ( width<1 || height<1 )
+	{
+	    args.reportError( "Image size must be at least 1x1" );
+	    width = height = 1;
+	}
+    }
+
+    int nrLayers = 3;
+    while ( args.read("--layers", nrLayers) )
+    {
+	if ( nrLayers<1 )
+	{
+	    args.reportError( "Number of layers must be at least 1" );
+	    nrLayers = 1;
+	}
+    }
+
+    int nrRuns = 5;
+    while ( args.read("--runs", nrRuns) )
+    {
+	if ( nrRuns<1 )
+	{
+	    args.reportError( "Number of runs must be at least 1" );
+	    nrRuns = 1;
+	}
+    }
+
+    std::string only;
+    while ( args.read("--only", only) )
+    {
+	if ( only!="composite" && only!="tilecopy" && only!="reorder" &&
+	     only!="resample" )
+	{
+	    args.reportError( "Unknown benchmark: " + only );
+	    only.clear();
+	}
+    }
+
+    args.reportRemainingOptionsAsUnrecognized();
+    if ( args.errors() )
+    {
+	args.writeErrorMessages( std::cerr );
+	return 1;
+    }
+
+    if ( only.empty() || only=="composite" )
+	benchmarkComposite( width, height, nrLayers, nrRuns );
+
+    if ( only.empty() || only=="tilecopy" )
+	benchmarkTileCopy( width, height, nrRuns );
+
+    if ( only.empty() || only=="reorder" )
+	benchmarkReorder( width, height, nrRuns );
+
+    if ( only.empty() || only=="resample" )
+	benchmarkResample( width, height, nrRuns );
+
+    return 0;
+}
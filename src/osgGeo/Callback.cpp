@@ -78,6 +78,7 @@ void CallbackObject::triggerFunc() \
 TRIGGER_CALLBACK( triggerRedrawRequest, requestRedraw );
 TRIGGER_CALLBACK( triggerStartWorkInProgress, startWorkInProgress );
 TRIGGER_CALLBACK( triggerStopWorkInProgress, stopWorkInProgress );
+TRIGGER_CALLBACK( triggerCancelBackgroundWork, cancelBackgroundWork );
 
 
 }; // namespace osgGeo
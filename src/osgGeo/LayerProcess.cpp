@@ -20,8 +20,12 @@ $Id$
 
 #include <osgGeo/LayerProcess>
 #include <osgGeo/LayeredTexture>
+#include <osg/StateSet>
+#include <osg/Uniform>
 #include <osg/Vec2f>
+#include <algorithm>
 #include <cstdio>
+#include <string.h>
 
 #if defined _MSC_VER && __cplusplus < 201103L
 # define snprintf( a, n, ... ) _snprintf_s( a, n, _TRUNCATE, __VA_ARGS__ )
@@ -37,7 +41,43 @@ TransparencyType getTransparencyTypeBytewise( const unsigned char* start, const
     bool foundOpaquePixel = false;
     bool foundTransparentPixel = false;
 
-    for ( const unsigned char* ptr=start; ptr<=stop; ptr+=step )
+    const unsigned char* ptr = start;
+    const int wordSize = sizeof(size_t);
+
+    if ( step>0 && wordSize%step==0 )
+    {
+	/* Tests a machine word of bytes at once, with the bytes of other
+	   channels masked to zero. A byte is 0 or 255 if all its bits equal
+	   their lower neighbour. */
+	unsigned char maskBytes[sizeof(size_t)];
+	for ( int idx=0; idx<wordSize; idx++ )
+	    maskBytes[idx] = idx%step ? 0 : 255;
+
+	size_t mask;
+	memcpy( &mask, maskBytes, wordSize );
+	const size_t bitMask = ~(size_t(-1)/255);
+
+	size_t opaqueBits = 0;
+	size_t transparentBits = 0;
+
+	for ( ; ptr+wordSize-1<=stop; ptr+=wordSize )
+	{
+	    size_t word;
+	    memcpy( &word, ptr, wordSize );
+	    word &= mask;
+
+	    if ( (word^(word<<1)) & bitMask )
+		return HasTransparencies;
+
+	    opaqueBits |= word;
+	    transparentBits |= ~word & mask;
+	}
+
+	foundOpaquePixel = opaqueBits!=0;
+	foundTransparentPixel = transparentBits!=0;
+    }
+
+    for ( ; ptr<=stop; ptr+=step )
     {
 	if ( *ptr==0 )
 	    foundTransparentPixel = true;
@@ -133,6 +173,22 @@ TransparencyType ColorSequence::getTransparencyType() const
 //============================================================================
 
 
+LayerSpan::LayerSpan( int nrPixels )
+    : _nrPixels( nrPixels )
+    , _y( 0.0f )
+    , _x( 0 )
+    , _stackUdf( 0 )
+    , _skip( 0 )
+    , _buffers( sNrBuffers*nrPixels )
+{
+    for ( int idx=0; idx<4; idx++ )
+	_color[idx] = 0;
+}
+
+
+//============================================================================
+
+
 LayerProcess::LayerProcess( LayeredTexture& layTex )
     : _layTex( layTex )
     , _colSeqPtr( 0 )
@@ -147,6 +203,10 @@ const unsigned char* LayerProcess::getColorSequencePtr() const
 { return _colSeqPtr; }
 
 
+void LayerProcess::cancelCompositeJob()
+{ _layTex.cancelCompositeJob(); }
+
+
 void LayerProcess::setColorSequenceTextureSampling( float start, float step )
 {
     _colSeqTexSamplingStart = start;
@@ -182,6 +242,32 @@ const osg::Vec4f& LayerProcess::getNewUndefColor() const
 { return _newUndefColor; }
 
 
+void LayerProcess::addShaderUniforms( osg::StateSet& stateset, int stage ) const
+{
+    char name[30];
+    snprintf( name, 30, "opacity%d", stage );
+    stateset.addUniform( new osg::Uniform(name,_opacity) );
+    snprintf( name, 30, "newudfcol%d", stage );
+    stateset.addUniform( new osg::Uniform(name,_newUndefColor) );
+
+    const osg::Vec2f sampling( _colSeqTexSamplingStart, _colSeqTexSamplingStep );
+    snprintf( name, 30, "colseqsampling%d", stage );
+    stateset.addUniform( new osg::Uniform(name,sampling) );
+}
+
+
+void LayerProcess::getShaderUniformCode( std::string& code, int stage )
+{
+    char line[100];
+    snprintf( line, 100, "uniform float opacity%d;\n", stage );
+    code += line;
+    snprintf( line, 100, "uniform vec4 newudfcol%d;\n", stage );
+    code += line;
+    snprintf( line, 100, "uniform vec2 colseqsampling%d;\n", stage );
+    code += line;
+}
+
+
 void LayerProcess::assignOrgCol3IfNeeded( std::string& code, int toIdx ) const
 {
     if ( toIdx!=-1 && toIdx!=3 )
@@ -198,7 +284,7 @@ void LayerProcess::assignOrgCol3IfNeeded( std::string& code, int toIdx ) const
 } 
 
 
-void LayerProcess::getHeaderCode( std::string& code, int& nrUdf, int id, int toIdx, int fromIdx ) const
+void LayerProcess::getHeaderCode( std::string& code, int& nrUdf, int stage, int id, int toIdx, int fromIdx ) const
 {
     const int unit = _layTex.getDataLayerTextureUnit(id);
     const int nrDims = _layTex.getTextureUnitNrDims(unit);
@@ -262,7 +348,7 @@ void LayerProcess::getHeaderCode( std::string& code, int& nrUdf, int id, int toI
 		if ( ext.size()>4 )
 		    ext.clear();
 
-		snprintf( line, 100, "            udfcol = vec4(%.6f,%.6f,%.6f,%.6f);\n", udfColor[0], udfColor[1], udfColor[2], udfColor[3] );
+		snprintf( line, 100, "            udfcol = udfcolor%d;\n", unit );
 		code += line;
 		code += "            if ( udf > 0.0 )\n";
 		snprintf( line, 100, "                col%s = (col%s - udf*udfcol%s) / (1.0-udf);\n", ext.data(), ext.data(), ext.data() );
@@ -272,7 +358,7 @@ void LayerProcess::getHeaderCode( std::string& code, int& nrUdf, int id, int toI
 	else if ( udfColor[fromIdx]>=0.0f )
 	{
 	    code += "            if ( udf > 0.0 )\n";
-	    snprintf( line, 100, "                col%s = (col%s - %.6f*udf) / (1.0-udf);\n", to, to, udfColor[fromIdx] );
+	    snprintf( line, 100, "                col%s = (col%s - udfcolor%d[%d]*udf) / (1.0-udf);\n", to, to, unit, fromIdx );
 	    code += line;
 	}
 
@@ -300,11 +386,11 @@ void LayerProcess::getHeaderCode( std::string& code, int& nrUdf, int id, int toI
 		const bool resultIsOpaque = _newUndefColor[3]>=1.0f && getTransparencyType(true)==Opaque;
 		if ( toIdx==3 || resultIsOpaque )
 		{
-		    snprintf( line, 100, "            col%s = mix( col%s, %.6f, udf );\n", to, to, _newUndefColor[toIdx] );
+		    snprintf( line, 100, "            col%s = mix( col%s, newudfcol%d[%d], udf );\n", to, to, stage, toIdx );
 		}
 		else
 		{
-		    snprintf( line, 100, "            col%s = mix(orgcol3*col%s, %.6f, udf) / col[3];\n", to, to, _newUndefColor[3]*_newUndefColor[toIdx] );
+		    snprintf( line, 100, "            col%s = mix(orgcol3*col%s, newudfcol%d[3]*newudfcol%d[%d], udf) / col[3];\n", to, to, stage, stage, toIdx );
 		}
 
 		code += line;
@@ -334,7 +420,7 @@ void LayerProcess::getFooterCode( std::string& code, int& nrUdf, int stage ) con
 
     if ( nrUdf )
     {
-	snprintf( line, 100, "    udfcol = vec4(%.6f,%.6f,%.6f,%.6f);\n", _newUndefColor[0], _newUndefColor[1], _newUndefColor[2], _newUndefColor[3] );
+	snprintf( line, 100, "    udfcol = newudfcol%d;\n", stage );
 	code += line;
 
 	code += "\n"
@@ -364,11 +450,8 @@ void LayerProcess::getFooterCode( std::string& code, int& nrUdf, int stage ) con
 	nrUdf = 0;
     }
 
-    if ( _opacity<1.0 )
-    {
-	snprintf( line, 100, "    col.a *= %.6f;\n", _opacity );
-	code += line;
-    }
+    snprintf( line, 100, "    col.a *= opacity%d;\n", stage );
+    code += line;
 
     if ( stage )
     {
@@ -383,28 +466,97 @@ void LayerProcess::getFooterCode( std::string& code, int& nrUdf, int stage ) con
 }
 
 
-void LayerProcess::processHeader( osg::Vec4f& col, float& udf, float stackUdf, const osg::Vec2f& coord, int id, int toIdx, int fromIdx, float* orgCol3 ) const
+//============================================================================
+
+
+/* Layer ids and undef settings read by processHeader(.), resolved once per
+   pixel or once per span. */
+
+struct HeaderSource
 {
-    if ( udf>=1.0f )
-	return;
+			HeaderSource(const LayeredTexture& lt,int id)
+			    : _id( id )
+			    , _udfId( lt.getDataLayerUndefLayerID(id) )
+			    , _hasUdfLayer( lt.isDataLayerOK(_udfId) )
+			    , _udfChannel( lt.getDataLayerUndefChannel(id) )
+			    , _udfInverted( lt.areUndefLayersInverted() )
+			    , _udfColor( lt.getDataLayerImageUndefColor(id) )
+			{}
+
+    int			_id;
+    int			_udfId;
+    bool		_hasUdfLayer;
+    int			_udfChannel;
+    bool		_udfInverted;
+    osg::Vec4f		_udfColor;
+};
 
-    const int udfId = _layTex.getDataLayerUndefLayerID(id);
 
-    if ( _layTex.isDataLayerOK(udfId) )
+// Texture access of one pixel through the layered texture
+
+struct PixelFetch
+{
+			PixelFetch(const LayeredTexture& lt,
+				   const osg::Vec2f& coord)
+			    : _lt( lt ), _coord( coord )
+			{}
+
+    float		udf(const HeaderSource& src) const
+			{ return _lt.getDataLayerTextureVec(src._udfId,_coord)[src._udfChannel]; }
+    osg::Vec4f		vec(const HeaderSource& src) const
+			{ return _lt.getDataLayerTextureVec(src._id,_coord); }
+    float		value(const HeaderSource& src,int channel) const
+			{ return vec(src)[channel]; }
+
+    const LayeredTexture&	_lt;
+    const osg::Vec2f&		_coord;
+};
+
+
+// Texture access of one pixel in span buffers sampled beforehand
+
+struct SpanFetch
+{
+			SpanFetch(const float* udfValues,
+				  float* const* channels,int idx)
+			    : _udfValues( udfValues ), _channels( channels )
+			    , _idx( idx )
+			{}
+
+    float		udf(const HeaderSource&) const
+			{ return _udfValues[_idx]; }
+    osg::Vec4f		vec(const HeaderSource&) const
+			{
+			    return osg::Vec4f( _channels[0][_idx],
+				_channels[1][_idx], _channels[2][_idx],
+				_channels[3][_idx] );
+			}
+    float		value(const HeaderSource&,int channel) const
+			{ return _channels[channel][_idx]; }
+
+    const float*	_udfValues;
+    float* const*	_channels;
+    int			_idx;
+};
+
+
+template <class Fetch>
+static void applyHeader( const HeaderSource& src, const Fetch& fetch, const osg::Vec4f& newUdfColor, bool udfPerChannel, osg::Vec4f& col, float& udf, float stackUdf, int toIdx, int fromIdx, float* orgCol3 )
+{
+    if ( src._hasUdfLayer )
     {
 	const float oldUdf = udf;
-	const int udfChannel = _layTex.getDataLayerUndefChannel(id);
-	udf = _layTex.getDataLayerTextureVec(udfId,coord)[udfChannel];
-	if ( _layTex.areUndefLayersInverted() )
+	udf = fetch.udf( src );
+	if ( src._udfInverted )
 	    udf = 1.0-udf;
 
 	if ( udf<1.0f )
 	{
-	    const osg::Vec4f& udfCol = _layTex.getDataLayerImageUndefColor(id);
+	    const osg::Vec4f& udfCol = src._udfColor;
 
 	    if ( toIdx<0 )
 	    {
-		col = _layTex.getDataLayerTextureVec( id, coord );
+		col = fetch.vec( src );
 		for ( int idx=0; idx<4; idx++ )
 		{
 		    if ( udf>0.0f && udfCol[idx]>=0.0f )
@@ -413,7 +565,7 @@ void LayerProcess::processHeader( osg::Vec4f& col, float& udf, float stackUdf, c
 	    }
 	    else
 	    {
-		col[toIdx] = _layTex.getDataLayerTextureVec(id,coord)[fromIdx];
+		col[toIdx] = fetch.value( src, fromIdx );
 		if ( udf>0.0f && udfCol[fromIdx]>=0.0f )
 		    col[toIdx] = (col[toIdx]-udfCol[fromIdx]*udf) / (1.0f-udf);
 	    }
@@ -421,25 +573,25 @@ void LayerProcess::processHeader( osg::Vec4f& col, float& udf, float stackUdf, c
 	    udf = udf>stackUdf ? (udf-stackUdf)/(1.0f-stackUdf) : 0.0f;
 	}
 
-	if ( isUndefPerChannel() && orgCol3 )
+	if ( udfPerChannel && orgCol3 )
 	{
 	    if ( toIdx==3 )
 		*orgCol3 = col[3];
 
 	    if ( udf>0.0f )
 	    {
-		if ( _newUndefColor[3]>0.0f )
+		if ( newUdfColor[3]>0.0f )
 		{
-		    const bool resultIsOpaque = _newUndefColor[3]>=1.0f && col[3]>=1.0f;
+		    const bool resultIsOpaque = newUdfColor[3]>=1.0f && col[3]>=1.0f;
 		    if ( toIdx==3 || resultIsOpaque )
 		    {
-			col[toIdx] = col[toIdx]*(1.0f-udf) + _newUndefColor[toIdx]*udf;
+			col[toIdx] = col[toIdx]*(1.0f-udf) + newUdfColor[toIdx]*udf;
 		    }
 		    else
 		    {
 			const float a = (*orgCol3) * (1.0f-udf);
-			const float b = _newUndefColor[3] * udf;
-			col[toIdx] = (col[toIdx]*a + _newUndefColor[toIdx]*b) / col[3];
+			const float b = newUdfColor[3] * udf;
+			col[toIdx] = (col[toIdx]*a + newUdfColor[toIdx]*b) / col[3];
 		    }
 		}
 		else if (  toIdx==3 )
@@ -453,12 +605,22 @@ void LayerProcess::processHeader( osg::Vec4f& col, float& udf, float stackUdf, c
     }
     else if ( toIdx>=0 )
     {
-	col[toIdx] = _layTex.getDataLayerTextureVec(id,coord)[fromIdx];
+	col[toIdx] = fetch.value( src, fromIdx );
 	if ( orgCol3 && toIdx==3 )
 	    *orgCol3 = col[3];
     }
     else
-	col = _layTex.getDataLayerTextureVec( id, coord );
+	col = fetch.vec( src );
+}
+
+
+void LayerProcess::processHeader( osg::Vec4f& col, float& udf, float stackUdf, const osg::Vec2f& coord, int id, int toIdx, int fromIdx, float* orgCol3 ) const
+{
+    if ( udf>=1.0f )
+	return;
+
+    const HeaderSource src( _layTex, id );
+    applyHeader( src, PixelFetch(_layTex,coord), _newUndefColor, isUndefPerChannel(), col, udf, stackUdf, toIdx, fromIdx, orgCol3 );
 }
 
 
@@ -505,6 +667,103 @@ void LayerProcess::processFooter( osg::Vec4f& fragColor, osg::Vec4f col, float u
 }
 
 
+void LayerProcess::processSpanHeader( LayerSpan& span, float* col[4], float* udf, int id, int toIdx, int fromIdx, float* orgCol3 ) const
+{
+    const HeaderSource src( _layTex, id );
+    const int nrPixels = span._nrPixels;
+
+    float* channels[4] = { 0, 0, 0, 0 };
+    for ( int idx=0; idx<4; idx++ )
+    {
+	if ( toIdx<0 || idx==fromIdx )
+	    channels[idx] = span.getBuffer( LayerSpan::sNrProcessBuffers+idx );
+    }
+
+    _layTex.getDataLayerTextureSpan( id, span._y, span._x, nrPixels, channels );
+
+    float* udfValues = 0;
+    if ( src._hasUdfLayer )
+    {
+	udfValues = span.getBuffer( LayerSpan::sNrProcessBuffers+4 );
+	float* udfChannels[4] = { 0, 0, 0, 0 };
+	udfChannels[src._udfChannel] = udfValues;
+	_layTex.getDataLayerTextureSpan( src._udfId, span._y, span._x, nrPixels, udfChannels );
+    }
+
+    const bool udfPerChannel = isUndefPerChannel();
+
+    for ( int idx=0; idx<nrPixels; idx++ )
+    {
+	if ( span._skip[idx] || udf[idx]>=1.0f )
+	    continue;
+
+	osg::Vec4f pixCol( col[0][idx], col[1][idx], col[2][idx], col[3][idx] );
+	float pixOrgCol3 = orgCol3 ? orgCol3[idx] : 0.0f;
+
+	applyHeader( src, SpanFetch(udfValues,channels,idx), _newUndefColor, udfPerChannel, pixCol, udf[idx], span._stackUdf[idx], toIdx, fromIdx, orgCol3 ? &pixOrgCol3 : 0 );
+
+	for ( int ch=0; ch<4; ch++ )
+	    col[ch][idx] = pixCol[ch];
+
+	if ( orgCol3 )
+	    orgCol3[idx] = pixOrgCol3;
+    }
+}
+
+
+void LayerProcess::processSpanFooter( LayerSpan& span, float* col[4], const float* udf ) const
+{
+    for ( int idx=0; idx<span._nrPixels; idx++ )
+    {
+	if ( span._skip[idx] )
+	    continue;
+
+	osg::Vec4f fragColor( span._color[0][idx], span._color[1][idx], span._color[2][idx], span._color[3][idx] );
+	processFooter( fragColor, osg::Vec4f(col[0][idx],col[1][idx],col[2][idx],col[3][idx]), udf[idx] );
+
+	for ( int ch=0; ch<4; ch++ )
+	    span._color[ch][idx] = fragColor[ch];
+    }
+}
+
+
+void LayerProcess::doProcessSpan( LayerSpan& span )
+{
+    for ( int idx=0; idx<span._nrPixels; idx++ )
+    {
+	if ( span._skip[idx] )
+	    continue;
+
+	osg::Vec4f fragColor( span._color[0][idx], span._color[1][idx], span._color[2][idx], span._color[3][idx] );
+	doProcess( fragColor, span._stackUdf[idx], osg::Vec2f(span._x[idx],span._y) );
+
+	for ( int ch=0; ch<4; ch++ )
+	    span._color[ch][idx] = fragColor[ch];
+    }
+}
+
+
+/* Span buffers holding the process's composite color, undef and original
+   alpha values */
+
+static void initSpanBuffers( LayerSpan& span, float* col[4], float*& udf, float*& orgCol3, const osg::Vec4f& initColor )
+{
+    const int nrPixels = span._nrPixels;
+
+    for ( int ch=0; ch<4; ch++ )
+    {
+	col[ch] = span.getBuffer( ch );
+	std::fill( col[ch], col[ch]+nrPixels, initColor[ch] );
+    }
+
+    udf = span.getBuffer( 4 );
+    std::fill( udf, udf+nrPixels, 0.0f );
+
+    orgCol3 = span.getBuffer( 5 );
+    std::fill( orgCol3, orgCol3+nrPixels, initColor[3] );
+}
+
+
 //============================================================================
 
 
@@ -589,6 +848,8 @@ void ColTabLayerProcess::checkForModifiedColorSequence()
 
 void ColTabLayerProcess::setColorSequence( ColorSequence* colSeq )
 {
+    cancelCompositeJob();
+
     if ( _colorSequence )
     {
 	_colorSequence->removeCallback( _colSeqCallbackHandler );
@@ -632,7 +893,7 @@ void ColTabLayerProcess::getShaderCode( std::string& code, int stage ) const
 
     for ( int idx=nrChannels-1; idx>=0; idx-- )
     {
-	getHeaderCode( code, nrUdf, _id[idx], idx, _textureChannel[idx] );
+	getHeaderCode( code, nrUdf, stage, _id[idx], idx, _textureChannel[idx] );
 	code += "\n";
     }
 
@@ -669,10 +930,10 @@ void ColTabLayerProcess::getShaderCode( std::string& code, int stage ) const
     code += "\n    texcrd.st = vec2( 0.996093*col[0]+0.001953, ";
     if ( nrChannels>1 )
     {
-	 snprintf( line, 100, "%.6f*scale+", _colSeqTexSamplingStep );
+	 snprintf( line, 100, "colseqsampling%d.y*scale+", stage );
 	 code += line;
     }
-    snprintf( line, 100, "%.6f );\n", _colSeqTexSamplingStart );
+    snprintf( line, 100, "colseqsampling%d.x );\n", stage );
     code += line;
 
     code += "    col = texture2D( texture0, texcrd.st );\n"
@@ -721,6 +982,39 @@ void ColTabLayerProcess::doProcess( osg::Vec4f& fragColor, float stackUdf, const
 }
 
 
+void ColTabLayerProcess::doProcessSpan( LayerSpan& span )
+{
+    if ( !_colorSequence || !_layTex.isDataLayerOK(_id[0]) )
+	return;
+
+    float* col[4];
+    float* udf;
+    float* orgCol3;
+    initSpanBuffers( span, col, udf, orgCol3, osg::Vec4f(0.0f,0.0f,0.0f,0.0f) );
+
+    processSpanHeader( span, col, udf, _id[0], 0, _textureChannel[0] );
+
+    float lut[1024];
+    const unsigned char* rgba = _colorSequence->getRGBAValues();
+    for ( int idx=0; idx<1024; idx++ )
+	lut[idx] = float(rgba[idx]) / 255.0f;
+
+    for ( int idx=0; idx<span._nrPixels; idx++ )
+    {
+	// Same as clamping floor(255*c+0.5) to [0,255], without floor()
+	const double val = 255.0f*col[0][idx] + 0.5;
+	const int offset = val>=1.0 ? (val<255.0 ? 4*int(val) : 1020) : 0;
+
+	col[0][idx] = lut[offset];
+	col[1][idx] = lut[offset+1];
+	col[2][idx] = lut[offset+2];
+	col[3][idx] = lut[offset+3];
+    }
+
+    processSpanFooter( span, col, udf );
+}
+
+
 //============================================================================
 
 
@@ -796,7 +1090,7 @@ void RGBALayerProcess::getShaderCode( std::string& code, int stage ) const
     {
 	if ( _isOn[idx] && _layTex.isDataLayerOK(_id[idx]) )
 	{
-	    getHeaderCode( code, nrUdf, _id[idx], idx, _textureChannel[idx] );
+	    getHeaderCode( code, nrUdf, stage, _id[idx], idx, _textureChannel[idx] );
 	    code += "\n";
 	}
     }
@@ -857,6 +1151,23 @@ void RGBALayerProcess::doProcess( osg::Vec4f& fragColor, float stackUdf, const o
 }	
 
 
+void RGBALayerProcess::doProcessSpan( LayerSpan& span )
+{
+    float* col[4];
+    float* udf;
+    float* orgCol3;
+    initSpanBuffers( span, col, udf, orgCol3, osg::Vec4f(0.0f,0.0f,0.0f,1.0f) );
+
+    for ( int idx=3; idx>=0; idx-- )
+    {
+	if ( _isOn[idx] && _layTex.isDataLayerOK(_id[idx]) )
+	    processSpanHeader( span, col, udf, _id[idx], idx, _textureChannel[idx], orgCol3 );
+    }
+
+    processSpanFooter( span, col, udf );
+}
+
+
 //============================================================================
 
 
@@ -876,7 +1187,7 @@ void IdentityLayerProcess::getShaderCode( std::string& code, int stage ) const
 	return;
 
     int nrUdf = 0;
-    getHeaderCode( code, nrUdf, _id );
+    getHeaderCode( code, nrUdf, stage, _id );
 
     code += "\n";
     getFooterCode( code, nrUdf, stage );
@@ -912,4 +1223,19 @@ void IdentityLayerProcess::doProcess( osg::Vec4f& fragColor, float stackUdf, con
 }
 
 
+void IdentityLayerProcess::doProcessSpan( LayerSpan& span )
+{
+    if ( !_layTex.isDataLayerOK(_id) )
+	return;
+
+    float* col[4];
+    float* udf;
+    float* orgCol3;
+    initSpanBuffers( span, col, udf, orgCol3, osg::Vec4f(0.0f,0.0f,0.0f,0.0f) );
+
+    processSpanHeader( span, col, udf, _id );
+    processSpanFooter( span, col, udf );
+}
+
+
 } //namespace
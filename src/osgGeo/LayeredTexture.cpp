@@ -19,6 +19,7 @@ $Id$
 */
 
 #include <osgGeo/LayeredTexture>
+#include <osgGeo/MappedImage>
 #include <osg/BlendFunc>
 #include <osg/GLExtensions>
 #include <osg/FragmentProgram>
@@ -28,12 +29,20 @@ $Id$
 #include <osg/Texture3D>
 #include <osg/Version>
 #include <osg/VertexProgram>
+#include <osg/observer_ptr>
 #include <osgUtil/CullVisitor>
 #include <osgGeo/Vec2i>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
 
 #include <string.h>
+#include <algorithm>
+#include <cfloat>
 #include <iostream>
 #include <cstdio>
+#include <list>
+#include <map>
+#include <vector>
 
 
 #if OSG_MIN_VERSION_REQUIRED(3,1,0)
@@ -184,7 +193,73 @@ static int texture2ImageChannel( int channel, GLenum format )
 }
 
 
-static TransparencyType getImageTransparencyType( const osg::Image* image, int textureChannel=3 )
+static TransparencyType getTransparencyTypeFloatwise( const float* start, const float* stop, int step )
+{
+    bool foundOpaquePixel = false;
+    bool foundTransparentPixel = false;
+
+    // Branch-free tests per group of four, like the byte version per word
+    const float* ptr = start;
+    for ( ; ptr+3*step<=stop; ptr+=4*step )
+    {
+	const float v0 = ptr[0];
+	const float v1 = ptr[step];
+	const float v2 = ptr[2*step];
+	const float v3 = ptr[3*step];
+
+	const bool transparent0 = v0<=0.0f; const bool opaque0 = v0>=1.0f;
+	const bool transparent1 = v1<=0.0f; const bool opaque1 = v1>=1.0f;
+	const bool transparent2 = v2<=0.0f; const bool opaque2 = v2>=1.0f;
+	const bool transparent3 = v3<=0.0f; const bool opaque3 = v3>=1.0f;
+
+	if ( !((transparent0|opaque0) & (transparent1|opaque1) &
+	       (transparent2|opaque2) & (transparent3|opaque3)) )
+	    return HasTransparencies;
+
+	foundTransparentPixel |= transparent0 | transparent1 | transparent2 | transparent3;
+	foundOpaquePixel |= opaque0 | opaque1 | opaque2 | opaque3;
+    }
+
+    for ( ; ptr<=stop; ptr+=step )
+    {
+	if ( *ptr<=0.0f )
+	    foundTransparentPixel = true;
+	else if ( *ptr>=1.0f )
+	    foundOpaquePixel = true;
+	else
+	    return HasTransparencies;
+    }
+
+    if ( foundTransparentPixel )
+	return foundOpaquePixel ? OnlyFullTransparencies : FullyTransparent;
+
+    return Opaque;
+}
+
+
+#define GET_COLOR_WITHOUT_OVERFLOW( color, image, idx ) \
+			  /* OSG multiplies idx by number of BITS per pixel */ \
+    if ( idx < 33554432 ) /* (2^32)/128 (upper bound for GL_RGBA+GL_DOUBLE) */ \
+	color = image->getColor( idx ); \
+    else if ( image->t() > image->r() ) \
+    { \
+	const unsigned int pixBytes = image->getPixelSizeInBits()/8; \
+	const unsigned int size = image->getRowStepInBytes() / pixBytes; \
+	const unsigned int blocks = (unsigned int) (idx/size); \
+	color = image->getColor( (unsigned int) (idx-blocks*size), blocks ); \
+    } \
+    else \
+    { \
+	const unsigned int pixBytes = image->getPixelSizeInBits()/8; \
+	const unsigned int size = image->getImageSizeInBytes() / pixBytes; \
+	const unsigned int blocks = (unsigned int) (idx/size); \
+	color = image->getColor( (unsigned int)(idx-blocks*size), 0, blocks ); \
+    }
+
+/* Transparency of a texture channel over nrPixels consecutive pixels in
+   memory, starting at pixel firstPixel. */
+
+static TransparencyType getImageTransparencyType( const osg::Image* image, int textureChannel, pixel_int firstPixel, pixel_int nrPixels )
 {                                                                               
     if ( !image )
 	return FullyTransparent;
@@ -196,33 +271,42 @@ static TransparencyType getImageTransparencyType( const osg::Image* image, int t
 	return FullyTransparent;
     if ( imageChannel==ONE_CHANNEL )
 	return Opaque;
+    if ( nrPixels<1 )
+	return Opaque;
+
+    const int pixelSize = image->getPixelSizeInBits()/8;
 
     if ( image->getDataType()==GL_UNSIGNED_BYTE && imageChannel>=0 )
     {
-	const int step = image->getPixelSizeInBits()/8;
-	const unsigned char* start = image->data()+imageChannel;
-	const unsigned char* stop = start+image->getTotalSizeInBytes()-step;
-	return getTransparencyTypeBytewise( start, stop, step ); 
+	const unsigned char* start = image->data() + firstPixel*pixelSize + imageChannel;
+	const unsigned char* stop = start + (nrPixels-1)*pixelSize;
+	return getTransparencyTypeBytewise( start, stop, pixelSize ); 
+    }
+
+    if ( image->getDataType()==GL_FLOAT && imageChannel>=0 && pixelSize%sizeof(float)==0 && !(image->getPixelSizeInBits()%8) )
+    {
+	const int step = pixelSize / sizeof(float);
+	const float* start = reinterpret_cast<const float*>( image->data()+firstPixel*pixelSize ) + imageChannel;
+	const float* stop = start + (nrPixels-1)*step;
+	return getTransparencyTypeFloatwise( start, stop, step );
     }
 
     bool foundOpaquePixel = false;
     bool foundTransparentPixel = false;
 
-    for ( int r=image->r()-1; r>=0; r-- )
+    for ( pixel_int idx=firstPixel; idx<firstPixel+nrPixels; idx++ )
     {
-	for ( int t=image->t()-1; t>=0; t-- )
-	{
-	    for ( int s=image->s()-1; s>=0; s-- )
-	    {
-		const float val = image->getColor(s,t,r)[imageChannel];
-		if ( val<=0.0f )
-		    foundTransparentPixel = true;
-		else if ( val>=1.0f )
-		    foundOpaquePixel = true;
-		else
-		    return HasTransparencies;
-	    }
-	}
+	osg::Vec4f color;
+	GET_COLOR_WITHOUT_OVERFLOW( color, image, idx );
+
+	// osg::Image::getColor(.) returns texture channel order
+	const float val = color[textureChannel];
+	if ( val<=0.0f )
+	    foundTransparentPixel = true;
+	else if ( val>=1.0f )
+	    foundOpaquePixel = true;
+	else
+	    return HasTransparencies;
     }
 
     if ( foundTransparentPixel )
@@ -232,438 +316,2071 @@ static TransparencyType getImageTransparencyType( const osg::Image* image, int t
 }
 
 
-static void copyImageTile( const osg::Image& srcImage, osg::Image& tileImage, const Vec2i& tileOrigin, const Vec2i& tileSize, int sliceNr=0, ImageDataOrder dataOrder=osgGeo::STR )
+static void getImageSteps( const osg::Image& image, ImageDataOrder dataOrder, pixel_int& xStep, pixel_int& yStep, pixel_int& zStep )
 {
-    const int xSize = tileSize.x();
-    const int ySize = tileSize.y();
+    // Byte steps to the next pixel along the x-, y- and z-dimension
+    const pixel_int pixelSize = image.getPixelSizeInBits()/8;
+    const pixel_int s = image.s();
+    const pixel_int t = image.t();
+    const pixel_int r = image.r();
 
-    tileImage.allocateImage( xSize, ySize, 1, srcImage.getPixelFormat(), srcImage.getDataType(), srcImage.getPacking() );
-
-    const int pixelSize = srcImage.getPixelSizeInBits()/8;
-    int xStep = pixelSize; int yStep = pixelSize; int zStep = pixelSize;
+    xStep = pixelSize; yStep = pixelSize; zStep = pixelSize;
 
     if ( dataOrder==osgGeo::STR )
     {
-	yStep *= srcImage.s(); zStep *= srcImage.s()*srcImage.t();
+	yStep *= s; zStep *= s*t;
     }
     else if ( dataOrder==osgGeo::SRT )
     {
-	zStep *= srcImage.s(); yStep *= srcImage.s()*srcImage.r();
+	zStep *= s; yStep *= s*r;
     }
     else if ( dataOrder==osgGeo::TRS )
     {
-	xStep *= srcImage.r(); yStep *= srcImage.r()*srcImage.s();
+	xStep *= r; yStep *= r*s;
     }
     else if ( dataOrder==osgGeo::TSR )
     {
-	xStep *= srcImage.t(); zStep *= srcImage.t()*srcImage.s();
+	xStep *= t; zStep *= t*s;
     }
     else if ( dataOrder==osgGeo::RST )
     {
-	zStep *= srcImage.t(); xStep *= srcImage.t()*srcImage.r();
+	zStep *= t; xStep *= t*r;
     }
     else if ( dataOrder==osgGeo::RTS )
     {
-	yStep *= srcImage.r(); xStep *= srcImage.r()*srcImage.t();
+	yStep *= r; xStep *= r*t;
     }
+}
 
-    unsigned char* tilePtr = tileImage.data();
-    const unsigned char* imagePtr = srcImage.data();
-    imagePtr += tileOrigin.x()*xStep + tileOrigin.y()*yStep + sliceNr*zStep;
-    yStep -= xSize * xStep;
-    xStep -= pixelSize;
 
-    for ( int yCount=0; yCount<ySize; yCount++ )
+template<int PixelSize>
+static void gatherPixelBlocks( const unsigned char* src, pixel_int xStep, pixel_int yStep, unsigned char* dst, pixel_int dstRowStep, int xSize, int ySize )
+{
+    /* Square blocks keep the source cache lines of strided pixels in use
+       for the next rows. Fixed-size memcpy compiles to plain moves. */
+    const int blockSize = 32;
+
+    for ( int y0=0; y0<ySize; y0+=blockSize )
     {
-	for ( int xCount=0; xCount<xSize; xCount++ )
+	const int y1 = y0+blockSize<ySize ? y0+blockSize : ySize;
+
+	for ( int x0=0; x0<xSize; x0+=blockSize )
 	{
-	    for ( int pCount=0; pCount<pixelSize; pCount++ )
-		*tilePtr++ = *imagePtr++;
+	    const int x1 = x0+blockSize<xSize ? x0+blockSize : xSize;
+
+	    for ( int y=y0; y<y1; y++ )
+	    {
+		const unsigned char* srcPtr = src + y*yStep + x0*xStep;
+		unsigned char* dstPtr = dst + y*dstRowStep + x0*PixelSize;
 
-	    imagePtr += xStep;
+		for ( int x=x0; x<x1; x++ )
+		{
+		    memcpy( dstPtr, srcPtr, PixelSize );
+		    dstPtr += PixelSize;
+		    srcPtr += xStep;
+		}
+	    }
 	}
-	imagePtr += yStep;
     }
 }
 
 
-//============================================================================
-
-
-struct LayeredTextureData : public osg::Referenced
+static void gatherPixels( const unsigned char* src, pixel_int xStep, pixel_int yStep, unsigned char* dst, pixel_int dstRowStep, int xSize, int ySize, int pixelSize )
 {
-			LayeredTextureData(int id)
-			    : _id( id )
-			    , _origin( 0.0f, 0.0f )
-			    , _scale( 1.0f, 1.0f )
-			    , _image( 0 )
-			    , _imageSource( 0 )
-			    , _imageScale( 1.0f, 1.0f )
-			    , _imageDataOrder( STR )
-			    , _sliceNr( 0 )
-			    , _vertex2TextureTrans( 0 )
-			    , _freezeDisplay( false )
-			    , _nrPowerChannels( 0 )
-			    , _textureUnit( -1 )
-			    , _filterType(Linear)
-			    , _borderColor( 1.0f, 1.0f, 1.0f, 1.0f )
-			    , _borderColorSource( 1.0f, 1.0f, 1.0f, 1.0f )
-			    , _undefLayerId( -1 )
-			    , _undefChannel( 0 )
-			    , _undefColor( -1.0f, -1.0f, -1.0f, -1.0f )
-			    , _undefColorSource( -1.0f, -1.0f, -1.0f, -1.0f )
-			    , _dirtyTileImages( false )
-			{
-			    for ( int idx=0; idx<4; idx++ )
-				_undefChannelRefCount[idx] = 0;
-			}
-
-			~LayeredTextureData();
+    if ( xStep==pixel_int(pixelSize) )
+    {
+	// Contiguous rows
+	for ( int y=0; y<ySize; y++ )
+	    memcpy( dst+y*dstRowStep, src+y*yStep, xSize*pixelSize );
 
-    LayeredTextureData*	clone() const;
-    osg::Vec2f		getLayerCoord(const osg::Vec2f& global) const;
-    osg::Vec4f		getTextureVec(const osg::Vec2f& global) const;
-    void		clearTransparencyType();
-    void		adaptColors();
-    void		cleanUp();
-    void		updateTileImagesIfNeeded() const;
-    bool		hasRescaledImage() const;
-    void		rescaleImage(int sNew,int tNew,bool inPlace=false);
-    bool		do3D() const;
+	return;
+    }
 
-    const int					_id;
-    osg::Vec2f					_origin;
-    osg::Vec2f					_scale;
-    osg::ref_ptr<osg::Image>			_image;
-    osg::ref_ptr<osg::Image>			_imageSource;
-    Vec2i					_imageSourceSize;
-    const unsigned char*			_imageSourceData;
-    osg::Vec2f					_imageScale;
-    int						_imageModifiedCount;
-    bool					_imageModifiedFlag;
-    ImageDataOrder				_imageDataOrder;
-    int						_sliceNr;
-    osg::Matrixf*				_vertex2TextureTrans;
-    bool					_freezeDisplay;
-    bool					_nrPowerChannels;
-    int						_textureUnit;
-    FilterType					_filterType;
+    switch ( pixelSize )
+    {
+	case 1:  gatherPixelBlocks<1>( src, xStep, yStep, dst, dstRowStep, xSize, ySize ); return;
+	case 2:  gatherPixelBlocks<2>( src, xStep, yStep, dst, dstRowStep, xSize, ySize ); return;
+	case 3:  gatherPixelBlocks<3>( src, xStep, yStep, dst, dstRowStep, xSize, ySize ); return;
+	case 4:  gatherPixelBlocks<4>( src, xStep, yStep, dst, dstRowStep, xSize, ySize ); return;
+	case 8:  gatherPixelBlocks<8>( src, xStep, yStep, dst, dstRowStep, xSize, ySize ); return;
+	case 12: gatherPixelBlocks<12>( src, xStep, yStep, dst, dstRowStep, xSize, ySize ); return;
+	case 16: gatherPixelBlocks<16>( src, xStep, yStep, dst, dstRowStep, xSize, ySize ); return;
+    }
 
-    osg::Vec4f					_borderColor;
-    osg::Vec4f					_borderColorSource;
-    int						_undefLayerId;
-    int						_undefChannel;
-    osg::Vec4f					_undefColor;
-    osg::Vec4f					_undefColorSource;
-    int						_undefChannelRefCount[4];
-    TransparencyType				_transparency[4];
+    for ( int y=0; y<ySize; y++ )
+    {
+	const unsigned char* srcPtr = src + y*yStep;
+	unsigned char* dstPtr = dst + y*dstRowStep;
 
-    mutable std::vector<osg::Image*>		_tileImages;
-    mutable bool				_dirtyTileImages;
-};
+	for ( int x=0; x<xSize; x++ )
+	{
+	    memcpy( dstPtr, srcPtr, pixelSize );
+	    dstPtr += pixelSize;
+	    srcPtr += xStep;
+	}
+    }
+}
 
 
-LayeredTextureData::~LayeredTextureData()
+void LayeredTexture::copyImageTile( const osg::Image& srcImage, osg::Image& tileImage, const Vec2i& tileOrigin, const Vec2i& tileSize, int sliceNr, ImageDataOrder dataOrder )
 {
-    cleanUp();
+    tileImage.allocateImage( tileSize.x(), tileSize.y(), 1, srcImage.getPixelFormat(), srcImage.getDataType(), srcImage.getPacking() );
 
-    if ( _vertex2TextureTrans )
-	delete _vertex2TextureTrans;
+    pixel_int xStep, yStep, zStep;
+    getImageSteps( srcImage, dataOrder, xStep, yStep, zStep );
+
+    const unsigned char* srcOrigin = srcImage.data();
+    srcOrigin += tileOrigin.x()*xStep + tileOrigin.y()*yStep + sliceNr*zStep;
+
+    gatherPixels( srcOrigin, xStep, yStep, tileImage.data(), tileImage.getRowSizeInBytes(), tileSize.x(), tileSize.y(), srcImage.getPixelSizeInBits()/8 );
 }
 
 
-LayeredTextureData* LayeredTextureData::clone() const
+bool LayeredTexture::setImageTileView( osg::Image& srcImage, osg::Image& tileImage, const Vec2i& tileOrigin, const Vec2i& tileSize, int sliceNr, ImageDataOrder dataOrder )
 {
-    LayeredTextureData* res = new LayeredTextureData( _id );
-    res->_origin = _origin;
-    res->_scale = _scale; 
-    res->_textureUnit = _textureUnit;
-    res->_filterType = _filterType;
-    res->_freezeDisplay = _freezeDisplay;
-    res->_imageModifiedCount = _imageModifiedCount;
-    res->_imageScale = _imageScale; 
-    res->_imageDataOrder = _imageDataOrder; 
-    res->_sliceNr = _sliceNr; 
-    res->_imageSource = _imageSource.get();
-    res->_vertex2TextureTrans = _vertex2TextureTrans ? new osg::Matrixf(*_vertex2TextureTrans) : 0;
+#ifdef USE_IMAGE_STRIDE
+    const pixel_int pixelSize = srcImage.getPixelSizeInBits()/8;
+    pixel_int xStep, yStep, zStep;
+    getImageSteps( srcImage, dataOrder, xStep, yStep, zStep );
 
-    if ( _image.get()==_imageSource.get() )
-	res->_image = _image.get();
-    else
-	res->_image = (osg::Image*) _image->clone(osg::CopyOp::DEEP_COPY_ALL);
+    // OpenGL can skip pixels at the end of a row, but not in between
+    if ( !pixelSize || (xStep!=pixelSize && tileSize.x()>1) || yStep%pixelSize )
+	return false;
 
-    res->_borderColor = _borderColor;
-    res->_borderColor = _borderColorSource;
-    res->_undefLayerId = _undefLayerId;
-    res->_undefChannel = _undefChannel;
-    res->_undefColorSource = _undefColorSource;
-    res->_undefColor = _undefColor;
-    res->_dirtyTileImages = _dirtyTileImages;
+    const int rowLength = tileSize.y()>1 ? int(yStep/pixelSize) : tileSize.x();
+    if ( rowLength<tileSize.x() )
+	return false;
 
-    for ( int idx=0; idx<4; idx++ )
-    {
-	res->_undefChannelRefCount[idx] = _undefChannelRefCount[idx];
-	res->_transparency[idx] = _transparency[idx];
-    }
+    unsigned char* dataOrigin = srcImage.data();
+    dataOrigin += tileOrigin.x()*xStep + tileOrigin.y()*yStep + sliceNr*zStep;
 
-    return res;
+    tileImage.setUserData( &srcImage );
+    tileImage.setImage( tileSize.x(), tileSize.y(), 1, srcImage.getInternalTextureFormat(), srcImage.getPixelFormat(), srcImage.getDataType(), dataOrigin, osg::Image::NO_DELETE, srcImage.getPacking(), rowLength ); 
+    return true;
+#else
+    return false;
+#endif
 }
 
 
-osg::Vec2f LayeredTextureData::getLayerCoord( const osg::Vec2f& global ) const
+//============================================================================
+
+/* Filter taps of a separable resampler along one dimension. Every output
+   coordinate has the same number of taps, with source indices clamped to
+   the edge and normalized weights. */
+
+class ResampleKernel
 {
-    osg::Vec2f res = global - _origin;
-    res.x() /= _scale.x() * _imageScale.x();
-    res.y() /= _scale.y() * _imageScale.y();
-    
-    return res;
-}
+public:
+			ResampleKernel(int srcSize,int dstSize,
+				       LayeredTexture::ResampleFilter);
 
+    int			nrTaps() const			{ return _nrTaps; }
+    const int*		indices(int dstIdx) const
+			{ return &_indices[dstIdx*_nrTaps]; }
+    const float*	weights(int dstIdx) const
+			{ return &_weights[dstIdx*_nrTaps]; }
 
-void LayeredTextureData::clearTransparencyType()
+protected:
+
+    static double	filterWeight(double x,LayeredTexture::ResampleFilter);
+
+    int			_nrTaps;
+    std::vector<int>	_indices;
+    std::vector<float>	_weights;
+};
+
+
+double ResampleKernel::filterWeight( double x, LayeredTexture::ResampleFilter filter )
 {
-    for ( int idx=0; idx<4; idx++ )
-	_transparency[idx] = TransparencyUnknown;
+    if ( filter==LayeredTexture::BoxFilter )
+	return x>=-0.5 && x<0.5 ? 1.0 : 0.0;
+
+    if ( filter==LayeredTexture::TriangleFilter )
+	return x>-1.0 && x<1.0 ? 1.0-fabs(x) : 0.0;
+
+    // Lanczos with three lobes
+    if ( x<=-3.0 || x>=3.0 )
+	return 0.0;
+    if ( x==0.0 )
+	return 1.0;
+
+    const double px = osg::PI * x;
+    return 3.0 * sin(px) * sin(px/3.0) / (px*px);
 }
 
 
-void LayeredTextureData::adaptColors()
+ResampleKernel::ResampleKernel( int srcSize, int dstSize, LayeredTexture::ResampleFilter filter )
 {
-    _undefColor  = _undefColorSource;
-    _borderColor = _borderColorSource;
+    const double radius = filter==LayeredTexture::BoxFilter ? 0.5 :
+			  filter==LayeredTexture::TriangleFilter ? 1.0 : 3.0;
 
-    if ( !_image )
-	return;
+    // Widen the filter when minifying, to average all covered pixels
+    const double scale = double(srcSize) / double(dstSize);
+    const double filterScale = scale>1.0 ? scale : 1.0;
+    const double support = radius * filterScale;
 
-    const GLenum format = _image->getPixelFormat();
+    _nrTaps = (int) ceil( 2.0*support ) + 1;
+    _indices.resize( dstSize*_nrTaps, 0 );
+    _weights.resize( dstSize*_nrTaps, 0.0f );
 
-    for ( int idx=0; idx<4; idx++ )
+    for ( int dstIdx=0; dstIdx<dstSize; dstIdx++ )
     {
-	const int ic = texture2ImageChannel( idx, format );
+	// Pixel centers of source and destination coincide at the edges
+	const double center = (dstIdx+0.5)*scale - 0.5;
+	const int first = (int) floor( center-support ) + 1;
 
-	if ( ic==ZERO_CHANNEL )
-	{
-	    _undefColor[idx]  = _undefColor[idx]<0.0f  ? -1.0f : 0.0f;
-	    _borderColor[idx] = _borderColor[idx]<0.0f ? -1.0f : 0.0f;
-	}
-	else if ( ic==ONE_CHANNEL )
+	int* indices = &_indices[dstIdx*_nrTaps];
+	float* weights = &_weights[dstIdx*_nrTaps];
+	double sum = 0.0;
+
+	for ( int tap=0; tap<_nrTaps; tap++ )
 	{
-	    _undefColor[idx]  = _undefColor[idx]<0.0f  ? -1.0f : 1.0f;
-	    _borderColor[idx] = _borderColor[idx]<0.0f ? -1.0f : 1.0f;
+	    const int srcIdx = first+tap;
+	    const double weight = filterWeight( (srcIdx-center)/filterScale, filter );
+
+	    indices[tap] = srcIdx<0 ? 0 : (srcIdx>=srcSize ? srcSize-1 : srcIdx);
+	    weights[tap] = (float) weight;
+	    sum += weight;
 	}
-	else if ( ic>=0 )
+
+	if ( sum==0.0 )
 	{
-	    const int tc = osgGeo::LayeredTexture::image2TextureChannel( ic, format );
-	    _undefColor[idx]  = _undefColorSource[tc];
-	    _borderColor[idx] = _borderColorSource[tc];
+	    // Nearest pixel as fall-back
+	    const int nearest = (int) floor( center+0.5 );
+	    indices[0] = nearest<0 ? 0 : (nearest>=srcSize ? srcSize-1 : nearest);
+	    weights[0] = 1.0f;
+	    continue;
 	}
+
+	for ( int tap=0; tap<_nrTaps; tap++ )
+	    weights[tap] = float( weights[tap]/sum );
     }
 }
 
 
-#define GET_PIXEL_INDEX( idx, image, x, y, z, order ) \
-    const pixel_int idx = order==STR ? x+(y+z*image->t())*image->s() : \
-			  order==SRT ? x+(z+y*image->r())*image->s() : \
-			  order==TRS ? z+(x+y*image->s())*image->r() : \
-			  order==TSR ? y+(x+z*image->s())*image->t() : \
-			  order==RST ? y+(z+x*image->r())*image->t() : \
-			/*order==RTS*/ z+(y+x*image->t())*image->r();
+/* Resamples the output rows [start,stop) of one image slice, for
+   parallelFor(.). Per output row, the source rows are combined first,
+   followed by filtering that row horizontally. */
 
-#define GET_COLOR_WITHOUT_OVERFLOW( color, image, idx ) \
-			  /* OSG multiplies idx by number of BITS per pixel */ \
-    if ( idx < 33554432 ) /* (2^32)/128 (upper bound for GL_RGBA+GL_DOUBLE) */ \
-	color = image->getColor( pixelIdx ); \
-    else if ( image->t() > image->r() ) \
-    { \
-	const unsigned int pixBytes = image->getPixelSizeInBits()/8; \
-	const unsigned int size = image->getRowStepInBytes() / pixBytes; \
-	const unsigned int blocks = (unsigned int) (idx/size); \
-	color = image->getColor( (unsigned int) (idx-blocks*size), blocks ); \
-    } \
-    else \
-    { \
-	const unsigned int pixBytes = image->getPixelSizeInBits()/8; \
-	const unsigned int size = image->getImageSizeInBytes() / pixBytes; \
-	const unsigned int blocks = (unsigned int) (idx/size); \
-	color = image->getColor( (unsigned int)(idx-blocks*size), 0, blocks ); \
-    }
+template <class T>
+class ResampleTask : public ParallelForBody
+{
+public:
+			ResampleTask(const unsigned char* srcSlice,
+				     pixel_int xStep,pixel_int yStep,
+				     int srcWidth,osg::Image& dstImage,
+				     int nrComponents,
+				     const ResampleKernel& xKernel,
+				     const ResampleKernel& yKernel)
+			    : _srcSlice( srcSlice )
+			    , _xStep( xStep )
+			    , _yStep( yStep )
+			    , _srcWidth( srcWidth )
+			    , _dstImage( dstImage )
+			    , _nrComponents( nrComponents )
+			    , _xKernel( xKernel )
+			    , _yKernel( yKernel )
+			{}
 
+    void		run(size_t start,size_t stop);
 
-#define GET_COLOR( color, image, x, y, z, order ) \
-\
-    osg::Vec4f color = _borderColor; \
-    if ( x>=0 && x<image->s() && y>=0 && y<image->t() ) \
-    { \
-	GET_PIXEL_INDEX( pixelIdx, image, x, y, z, order ); \
-	GET_COLOR_WITHOUT_OVERFLOW( color, image, pixelIdx ); \
-    } \
-    else if ( _borderColor[0]<0.0f ) \
-    { \
-	const int xClamp = x<=0 ? 0 : ( x>=image->s() ? image->s()-1 : x ); \
-	const int yClamp = y<=0 ? 0 : ( y>=image->t() ? image->t()-1 : y ); \
-	GET_PIXEL_INDEX( pixelIdx, image, xClamp, yClamp, z, order ); \
-	GET_COLOR_WITHOUT_OVERFLOW( color, image, pixelIdx ); \
-    }
+protected:
 
-osg::Vec4f LayeredTextureData::getTextureVec( const osg::Vec2f& globalCoord ) const
-{
-    if ( do3D() || !_image.get() || !_image->s() || !_image->t() || !_image->r() )
-	return _borderColor;
+    static T		toValue(float);
 
-    osg::Vec2f local = getLayerCoord( globalCoord );
-    if ( _filterType!=Nearest )
+    const unsigned char*	_srcSlice;
+    pixel_int			_xStep;
+    pixel_int			_yStep;
+    int				_srcWidth;
+    osg::Image&			_dstImage;
+    int				_nrComponents;
+    const ResampleKernel&	_xKernel;
+    const ResampleKernel&	_yKernel;
+};
+
+
+template <>
+inline unsigned char ResampleTask<unsigned char>::toValue( float val )
+{
+    // Lanczos lobes may over- and undershoot
+    return val<=0.0f ? 0 : (val>=255.0f ? 255 : (unsigned char) (val+0.5f));
+}
+
+
+template <>
+inline float ResampleTask<float>::toValue( float val )
+{ return val; }
+
+
+template <class T>
+void ResampleTask<T>::run( size_t start, size_t stop )
+{
+    const int nc = _nrComponents;
+    const int dstWidth = _dstImage.s();
+    std::vector<float> row( _srcWidth*nc );
+
+    for ( int y=int(start); y<int(stop); y++ )
+    {
+	std::fill( row.begin(), row.end(), 0.0f );
+
+	const int* yIndices = _yKernel.indices( y );
+	const float* yWeights = _yKernel.weights( y );
+
+	for ( int tap=0; tap<_yKernel.nrTaps(); tap++ )
+	{
+	    const float weight = yWeights[tap];
+	    if ( weight==0.0f )
+		continue;
+
+	    const unsigned char* srcPtr = _srcSlice + yIndices[tap]*_yStep;
+	    float* rowPtr = &row[0];
+
+	    for ( int x=0; x<_srcWidth; x++ )
+	    {
+		const T* pixel = reinterpret_cast<const T*>( srcPtr );
+		for ( int comp=0; comp<nc; comp++ )
+		    rowPtr[comp] += weight * float(pixel[comp]);
+
+		rowPtr += nc;
+		srcPtr += _xStep;
+	    }
+	}
+
+	T* dstPtr = reinterpret_cast<T*>( _dstImage.data(0,y) );
+
+	for ( int x=0; x<dstWidth; x++ )
+	{
+	    const int* xIndices = _xKernel.indices( x );
+	    const float* xWeights = _xKernel.weights( x );
+
+	    for ( int comp=0; comp<nc; comp++ )
+	    {
+		float sum = 0.0f;
+		for ( int tap=0; tap<_xKernel.nrTaps(); tap++ )
+		    sum += xWeights[tap] * row[xIndices[tap]*nc+comp];
+
+		*dstPtr++ = toValue( sum );
+	    }
+	}
+    }
+}
+
+
+bool LayeredTexture::resampleImage( const osg::Image& srcImage, osg::Image& dstImage, int sNew, int tNew, int sliceNr, ImageDataOrder dataOrder, ResampleFilter filter )
+{
+    const GLenum dataType = srcImage.getDataType();
+    const unsigned int pixelSize = srcImage.getPixelSizeInBits()/8;
+    const unsigned int typeSize = dataType==GL_FLOAT ? sizeof(float) : 1;
+
+    if ( sNew<1 || tNew<1 || !srcImage.data() || srcImage.getPixelSizeInBits()%8 )
+	return false;
+    if ( (dataType!=GL_UNSIGNED_BYTE && dataType!=GL_FLOAT) || pixelSize%typeSize )
+	return false;
+
+    if ( sliceNr>=srcImage.r() )
+	sliceNr = srcImage.r()-1;
+
+    pixel_int xStep, yStep, zStep;
+    getImageSteps( srcImage, dataOrder, xStep, yStep, zStep );
+    const unsigned char* srcSlice = srcImage.data() + sliceNr*zStep;
+
+    dstImage.allocateImage( sNew, tNew, 1, srcImage.getPixelFormat(), dataType, srcImage.getPacking() );
+    dstImage.setInternalTextureFormat( srcImage.getInternalTextureFormat() );
+
+    const ResampleKernel xKernel( srcImage.s(), sNew, filter );
+    const ResampleKernel yKernel( srcImage.t(), tNew, filter );
+    const int nrComponents = pixelSize / typeSize;
+
+    if ( dataType==GL_FLOAT )
+    {
+	ResampleTask<float> task( srcSlice, xStep, yStep, srcImage.s(), dstImage, nrComponents, xKernel, yKernel );
+	parallelFor( tNew, task );
+    }
+    else
+    {
+	ResampleTask<unsigned char> task( srcSlice, xStep, yStep, srcImage.s(), dstImage, nrComponents, xKernel, yKernel );
+	parallelFor( tNew, task );
+    }
+
+    return true;
+}
+
+
+//============================================================================
+
+// Mip levels are box filtered per component, for byte and float data only
+
+static bool getMipmapComponents( const osg::Image& image, int& nrComponents )
+{
+    const GLenum dataType = image.getDataType();
+    const unsigned int typeBits = dataType==GL_FLOAT ? 8*sizeof(float) : 8;
+
+    if ( dataType!=GL_UNSIGNED_BYTE && dataType!=GL_FLOAT )
+	return false;
+    if ( !image.getPixelSizeInBits() || image.getPixelSizeInBits()%typeBits )
+	return false;
+
+    nrComponents = image.getPixelSizeInBits() / typeBits;
+    return true;
+}
+
+
+template <class T> inline T boxAverage(T a,T b,T c,T d);
+
+template <> inline unsigned char boxAverage( unsigned char a, unsigned char b, unsigned char c, unsigned char d )
+{ return (unsigned char) ((int(a)+int(b)+int(c)+int(d)+2) / 4); }
+
+template <> inline float boxAverage( float a, float b, float c, float d )
+{ return (a+b+c+d) * 0.25f; }
+
+
+/* Halves the rows [start,stop) of the next mip level, for parallelFor(.).
+   The last odd row or column is averaged with itself only if the level
+   size is one. */
+
+template <class T>
+class MipLevelTask : public ParallelForBody
+{
+public:
+			MipLevelTask(const unsigned char* src,pixel_int xStep,
+				     pixel_int yStep,int srcWidth,int srcHeight,
+				     unsigned char* dst,int dstWidth,
+				     int nrComponents)
+			    : _src( src ), _xStep( xStep ), _yStep( yStep )
+			    , _srcWidth( srcWidth ), _srcHeight( srcHeight )
+			    , _dst( dst ), _dstWidth( dstWidth )
+			    , _nrComponents( nrComponents )
+			{}
+
+    void		run(size_t start,size_t stop)
+			{
+			    const int nc = _nrComponents;
+			    for ( int y=int(start); y<int(stop); y++ )
+			    {
+				const int y0 = 2*y;
+				const int y1 = y0+1<_srcHeight ? y0+1 : y0;
+				T* dst = reinterpret_cast<T*>(_dst) + pixel_int(y)*_dstWidth*nc;
+
+				for ( int x=0; x<_dstWidth; x++ )
+				{
+				    const int x0 = 2*x;
+				    const int x1 = x0+1<_srcWidth ? x0+1 : x0;
+				    const T* p00 = reinterpret_cast<const T*>( _src + x0*_xStep + y0*_yStep );
+				    const T* p10 = reinterpret_cast<const T*>( _src + x1*_xStep + y0*_yStep );
+				    const T* p01 = reinterpret_cast<const T*>( _src + x0*_xStep + y1*_yStep );
+				    const T* p11 = reinterpret_cast<const T*>( _src + x1*_xStep + y1*_yStep );
+
+				    for ( int comp=0; comp<nc; comp++ )
+					*dst++ = boxAverage( p00[comp], p10[comp], p01[comp], p11[comp] );
+				}
+			    }
+			}
+
+protected:
+
+    const unsigned char*	_src;
+    pixel_int			_xStep;
+    pixel_int			_yStep;
+    int				_srcWidth;
+    int				_srcHeight;
+    unsigned char*		_dst;
+    int				_dstWidth;
+    int				_nrComponents;
+};
+
+
+static void downsampleMipLevel( const unsigned char* src, pixel_int xStep, pixel_int yStep, int srcWidth, int srcHeight, unsigned char* dst, int dstWidth, int dstHeight, GLenum dataType, int nrComponents )
+{
+    if ( dataType==GL_FLOAT )
+    {
+	MipLevelTask<float> task( src, xStep, yStep, srcWidth, srcHeight, dst, dstWidth, nrComponents );
+	parallelFor( dstHeight, task, 16 );
+    }
+    else
+    {
+	MipLevelTask<unsigned char> task( src, xStep, yStep, srcWidth, srcHeight, dst, dstWidth, nrComponents );
+	parallelFor( dstHeight, task, 16 );
+    }
+}
+
+
+/* Copies a tile and its complete mip chain into one image. Levels at which
+   the tile is aligned to the layer pyramid are copied from it, so that
+   neighbouring tiles stay consistent across their seams. Other levels are
+   halved from the previous tile level. */
+
+static osg::Image* createMipmappedTile( const osg::Image& image, ImageDataOrder dataOrder, int sliceNr, const Vec2i& origin, const Vec2i& size, const std::vector<osg::ref_ptr<osg::Image> >& pyramid, int nrComponents )
+{
+    const int pixelSize = image.getPixelSizeInBits()/8;
+
+    std::vector<Vec2i> levelSizes( 1, size );
+    osg::Image::MipmapDataType offsets;
+    unsigned int totalSize = size.x()*size.y()*pixelSize;
+
+    while ( levelSizes.back().x()>1 || levelSizes.back().y()>1 )
+    {
+	const Vec2i& prev = levelSizes.back();
+	const Vec2i levelSize( prev.x()>1 ? prev.x()/2 : 1, prev.y()>1 ? prev.y()/2 : 1 );
+	offsets.push_back( totalSize );
+	totalSize += levelSize.x()*levelSize.y()*pixelSize;
+	levelSizes.push_back( levelSize );
+    }
+
+    unsigned char* data = new unsigned char[totalSize];
+
+    pixel_int xStep, yStep, zStep;
+    getImageSteps( image, dataOrder, xStep, yStep, zStep );
+    const unsigned char* srcOrigin = image.data() + origin.x()*xStep + origin.y()*yStep + sliceNr*zStep;
+    gatherPixels( srcOrigin, xStep, yStep, data, size.x()*pixelSize, size.x(), size.y(), pixelSize );
+
+    for ( unsigned int level=1; level<levelSizes.size(); level++ )
+    {
+	const Vec2i& levelSize = levelSizes[level];
+	unsigned char* dst = data + offsets[level-1];
+	const int factor = 1 << level;
+
+	if ( level<=pyramid.size() && origin.x()%factor==0 && origin.y()%factor==0 && size.x()%factor==0 && size.y()%factor==0 )
+	{
+	    const osg::Image& src = *pyramid[level-1];
+	    const unsigned char* srcPtr = src.data() + (pixel_int(origin.y()/factor)*src.s() + origin.x()/factor) * pixelSize;
+	    gatherPixels( srcPtr, pixelSize, pixel_int(src.s())*pixelSize, dst, levelSize.x()*pixelSize, levelSize.x(), levelSize.y(), pixelSize );
+	    continue;
+	}
+
+	const Vec2i& prevSize = levelSizes[level-1];
+	const unsigned char* prev = level>1 ? data+offsets[level-2] : data;
+	downsampleMipLevel( prev, pixelSize, prevSize.x()*pixelSize, prevSize.x(), prevSize.y(), dst, levelSize.x(), levelSize.y(), image.getDataType(), nrComponents );
+    }
+
+    osg::Image* tileImage = new osg::Image;
+    tileImage->setImage( size.x(), size.y(), 1, image.getInternalTextureFormat(), image.getPixelFormat(), image.getDataType(), data, osg::Image::USE_NEW_DELETE, 1 );
+    tileImage->setMipmapLevels( offsets );
+    return tileImage;
+}
+
+
+//============================================================================
+
+/* Resolves data order, slice, pixel format and data type of an image once,
+   so that its texels can be fetched by plain pointer arithmetic. */
+
+struct TexelSampler
+{
+    typedef osg::Vec4f	(*FetchFunc)(const osg::Image&,const unsigned char*);
+
+			TexelSampler()
+			    : _image( 0 )
+			    , _fetch( 0 )
+			{}
+
+    void		set(const osg::Image*,ImageDataOrder,int sliceNr);
+    bool		isValid() const		{ return _fetch!=0; }
+    bool		isUpToDate(const osg::Image* image) const
+			{
+			    return image==_image && (!image ||
+				   image->getModifiedCount()==_modifiedCount);
+			}
+
+    inline osg::Vec4f	getColor(int x,int y,const osg::Vec4f& border) const
+			{
+			    if ( x<0 || x>=_width || y<0 || y>=_height )
+			    {
+				if ( border[0]>=0.0f )
+				    return border;
+
+				x = x<=0 ? 0 : ( x>=_width ? _width-1 : x );
+				y = y<=0 ? 0 : ( y>=_height ? _height-1 : y );
+			    }
+
+			    return _fetch( *_image, _data+x*_xStep+y*_yStep );
+			}
+
+    const osg::Image*	_image;
+    unsigned int	_modifiedCount;
+    const unsigned char* _data;
+    int			_width;
+    int			_height;
+    pixel_int		_xStep;
+    pixel_int		_yStep;
+    FetchFunc		_fetch;
+};
+
+
+/* Texel fetch specialized per pixel format and data type. Mimics
+   osg::Image::getColor(.) without its run-time format and type switches. */
+
+template <class T> inline float texelScale()		{ return 1.0f; }
+template <> inline float texelScale<unsigned char>()	{ return 1.0f/255.0f; }
+
+template <GLenum Format,class T>
+static osg::Vec4f fetchTexel( const osg::Image&, const unsigned char* ptr )
+{
+    const T* data = reinterpret_cast<const T*>( ptr );
+    const float scale = texelScale<T>();
+
+    if ( Format==GL_LUMINANCE )
+    {
+	const float l = float(data[0])*scale;
+	return osg::Vec4f( l, l, l, 1.0f );
+    }
+    if ( Format==GL_ALPHA )
+	return osg::Vec4f( 1.0f, 1.0f, 1.0f, float(data[0])*scale );
+    if ( Format==GL_LUMINANCE_ALPHA )
+    {
+	const float l = float(data[0])*scale;
+	return osg::Vec4f( l, l, l, float(data[1])*scale );
+    }
+    if ( Format==GL_RGB )
+	return osg::Vec4f( float(data[0])*scale, float(data[1])*scale, float(data[2])*scale, 1.0f );
+    if ( Format==GL_RGBA )
+	return osg::Vec4f( float(data[0])*scale, float(data[1])*scale, float(data[2])*scale, float(data[3])*scale );
+    if ( Format==GL_BGR )
+	return osg::Vec4f( float(data[2])*scale, float(data[1])*scale, float(data[0])*scale, 1.0f );
+
+    // GL_BGRA
+    return osg::Vec4f( float(data[2])*scale, float(data[1])*scale, float(data[0])*scale, float(data[3])*scale );
+}
+
+
+static osg::Vec4f fetchAnyTexel( const osg::Image& image, const unsigned char* ptr )
+{
+    const osg::Image* imagePtr = &image;
+    const pixel_int pixelIdx = (ptr-image.data()) / (image.getPixelSizeInBits()/8);
+
+    osg::Vec4f color;
+    GET_COLOR_WITHOUT_OVERFLOW( color, imagePtr, pixelIdx );
+    return color;
+}
+
+
+template <class T>
+static TexelSampler::FetchFunc getFetchFunc( GLenum format )
+{
+    switch ( format )
+    {
+	case GL_LUMINANCE:	 return &fetchTexel<GL_LUMINANCE,T>;
+	case GL_ALPHA:		 return &fetchTexel<GL_ALPHA,T>;
+	case GL_LUMINANCE_ALPHA: return &fetchTexel<GL_LUMINANCE_ALPHA,T>;
+	case GL_RGB:		 return &fetchTexel<GL_RGB,T>;
+	case GL_RGBA:		 return &fetchTexel<GL_RGBA,T>;
+	case GL_BGR:		 return &fetchTexel<GL_BGR,T>;
+	case GL_BGRA:		 return &fetchTexel<GL_BGRA,T>;
+	default:		 return &fetchAnyTexel;
+    }
+}
+
+
+void TexelSampler::set( const osg::Image* image, ImageDataOrder dataOrder, int sliceNr )
+{
+    _image = image;
+    _fetch = 0;
+
+    if ( !image || !image->s() || !image->t() || !image->r() || !image->data() )
+	return;
+
+    _modifiedCount = image->getModifiedCount();
+    _width = image->s();
+    _height = image->t();
+
+    pixel_int zStep;
+    getImageSteps( *image, dataOrder, _xStep, _yStep, zStep );
+
+    const int r = sliceNr>=image->r() ? image->r()-1 : sliceNr;
+    _data = image->data() + r*zStep;
+
+    const GLenum dataType = image->getDataType();
+    if ( image->getPixelSizeInBits()%8 )
+	_fetch = 0;
+    else if ( dataType==GL_UNSIGNED_BYTE )
+	_fetch = getFetchFunc<unsigned char>( image->getPixelFormat() );
+    else if ( dataType==GL_FLOAT )
+	_fetch = getFetchFunc<float>( image->getPixelFormat() );
+    else
+	_fetch = &fetchAnyTexel;
+}
+
+
+//============================================================================
+
+/* Min/max texel values of a layer slice per block of sBlockSize texels,
+   summarized further in a quadtree of coarser levels. Region queries are
+   conservative: blocks partly inside the region count in full. */
+
+class BlockStatistics
+{
+public:
+    static const int	sBlockSize = 16;
+
+			BlockStatistics()
+			    : _image( 0 )
+			    , _modifiedCount( 0 )
+			    , _data( 0 )
+			    , _xStep( 0 )
+			    , _yStep( 0 )
+			{}
+
+    bool		isUpToDate(const TexelSampler&) const;
+    void		update(const TexelSampler&);
+    void		invalidate()			{ _image = 0; }
+    bool		getRange(const Vec2i& origin,const Vec2i& size,
+				 osg::Vec4f& min,osg::Vec4f& max) const;
+
+protected:
+
+    struct Level
+    {
+	int				_width;
+	int				_height;
+	std::vector<osg::Vec4f>		_min;
+	std::vector<osg::Vec4f>		_max;
+    };
+
+    class BlockTask : public ParallelForBody
+    {
+    public:
+			BlockTask(const TexelSampler& sampler,Level& level)
+			    : _sampler( sampler ), _level( level )
+			{}
+
+	void		run(size_t start,size_t stop);
+
+    protected:
+	const TexelSampler&	_sampler;
+	Level&			_level;
+    };
+
+    void		addRange(int levelNr,int bx,int by,const Vec2i& first,
+				 const Vec2i& last,osg::Vec4f& min,
+				 osg::Vec4f& max) const;
+
+    std::vector<Level>		_levels;
+    const osg::Image*		_image;
+    unsigned int		_modifiedCount;
+    const unsigned char*	_data;
+    pixel_int			_xStep;
+    pixel_int			_yStep;
+};
+
+
+void BlockStatistics::BlockTask::run( size_t start, size_t stop )
+{
+    const osg::Vec4f noBorder( -1.0f, -1.0f, -1.0f, -1.0f );
+
+    for ( int by=int(start); by<int(stop); by++ )
+    {
+	const int y0 = by*sBlockSize;
+	const int y1 = osg::minimum( y0+sBlockSize, _sampler._height );
+
+	for ( int bx=0; bx<_level._width; bx++ )
+	{
+	    const int x0 = bx*sBlockSize;
+	    const int x1 = osg::minimum( x0+sBlockSize, _sampler._width );
+
+	    osg::Vec4f min = _sampler.getColor( x0, y0, noBorder );
+	    osg::Vec4f max = min;
+
+	    for ( int y=y0; y<y1; y++ )
+	    {
+		for ( int x=x0; x<x1; x++ )
+		{
+		    const osg::Vec4f col = _sampler.getColor( x, y, noBorder );
+		    for ( int ch=0; ch<4; ch++ )
+		    {
+			if ( col[ch]<min[ch] ) min[ch] = col[ch];
+			if ( col[ch]>max[ch] ) max[ch] = col[ch];
+		    }
+		}
+	    }
+
+	    _level._min[by*_level._width+bx] = min;
+	    _level._max[by*_level._width+bx] = max;
+	}
+    }
+}
+
+
+bool BlockStatistics::isUpToDate( const TexelSampler& sampler ) const
+{
+    return _image && sampler.isUpToDate(_image) && sampler._data==_data &&
+	   sampler._xStep==_xStep && sampler._yStep==_yStep;
+}
+
+
+void BlockStatistics::update( const TexelSampler& sampler )
+{
+    _levels.clear();
+    _image = 0;
+
+    if ( !sampler.isValid() )
+	return;
+
+    Level level;
+    level._width = (sampler._width+sBlockSize-1) / sBlockSize;
+    level._height = (sampler._height+sBlockSize-1) / sBlockSize;
+    level._min.resize( level._width*level._height );
+    level._max.resize( level._width*level._height );
+    _levels.push_back( level );
+
+    BlockTask task( sampler, _levels.back() );
+    parallelFor( level._height, task, 4 );
+
+    while ( _levels.back()._width>1 || _levels.back()._height>1 )
+    {
+	const Level& fine = _levels.back();
+	Level coarse;
+	coarse._width = (fine._width+1) / 2;
+	coarse._height = (fine._height+1) / 2;
+	coarse._min.resize( coarse._width*coarse._height );
+	coarse._max.resize( coarse._width*coarse._height );
+
+	for ( int by=0; by<coarse._height; by++ )
+	{
+	    for ( int bx=0; bx<coarse._width; bx++ )
+	    {
+		const int idx = 2*by*fine._width + 2*bx;
+		osg::Vec4f min = fine._min[idx];
+		osg::Vec4f max = fine._max[idx];
+
+		for ( int child=1; child<4; child++ )
+		{
+		    const int cx = 2*bx + child%2;
+		    const int cy = 2*by + child/2;
+		    if ( cx>=fine._width || cy>=fine._height )
+			continue;
+
+		    const osg::Vec4f& childMin = fine._min[cy*fine._width+cx];
+		    const osg::Vec4f& childMax = fine._max[cy*fine._width+cx];
+		    for ( int ch=0; ch<4; ch++ )
+		    {
+			if ( childMin[ch]<min[ch] ) min[ch] = childMin[ch];
+			if ( childMax[ch]>max[ch] ) max[ch] = childMax[ch];
+		    }
+		}
+
+		coarse._min[by*coarse._width+bx] = min;
+		coarse._max[by*coarse._width+bx] = max;
+	    }
+	}
+
+	_levels.push_back( coarse );
+    }
+
+    _image = sampler._image;
+    _modifiedCount = sampler._modifiedCount;
+    _data = sampler._data;
+    _xStep = sampler._xStep;
+    _yStep = sampler._yStep;
+}
+
+
+bool BlockStatistics::getRange( const Vec2i& origin, const Vec2i& size, osg::Vec4f& min, osg::Vec4f& max ) const
+{
+    if ( _levels.empty() || size.x()<1 || size.y()<1 )
+	return false;
+
+    const Level& base = _levels.front();
+    Vec2i first( origin.x()/sBlockSize, origin.y()/sBlockSize );
+    Vec2i last( (origin.x()+size.x()-1)/sBlockSize, (origin.y()+size.y()-1)/sBlockSize );
+
+    for ( int dim=0; dim<=1; dim++ )
+    {
+	const int nrBlocks = dim ? base._height : base._width;
+	if ( first[dim]<0 ) first[dim] = 0;
+	if ( last[dim]>=nrBlocks ) last[dim] = nrBlocks-1;
+	if ( first[dim]>last[dim] )
+	    return false;
+    }
+
+    min = osg::Vec4f( FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX );
+    max = -min;
+    addRange( _levels.size()-1, 0, 0, first, last, min, max );
+    return true;
+}
+
+
+void BlockStatistics::addRange( int levelNr, int bx, int by, const Vec2i& first, const Vec2i& last, osg::Vec4f& min, osg::Vec4f& max ) const
+{
+    const Level& level = _levels[levelNr];
+    if ( bx>=level._width || by>=level._height )
+	return;
+
+    const int x0 = bx << levelNr;
+    const int y0 = by << levelNr;
+    const int x1 = x0 + (1<<levelNr) - 1;
+    const int y1 = y0 + (1<<levelNr) - 1;
+
+    if ( x1<first.x() || x0>last.x() || y1<first.y() || y0>last.y() )
+	return;
+
+    if ( !levelNr || (x0>=first.x() && x1<=last.x() && y0>=first.y() && y1<=last.y()) )
+    {
+	const osg::Vec4f& blockMin = level._min[by*level._width+bx];
+	const osg::Vec4f& blockMax = level._max[by*level._width+bx];
+	for ( int ch=0; ch<4; ch++ )
+	{
+	    if ( blockMin[ch]<min[ch] ) min[ch] = blockMin[ch];
+	    if ( blockMax[ch]>max[ch] ) max[ch] = blockMax[ch];
+	}
+	return;
+    }
+
+    for ( int child=0; child<4; child++ )
+	addRange( levelNr-1, 2*bx+child%2, 2*by+child/2, first, last, min, max );
+}
+
+
+//============================================================================
+
+
+struct LayeredTextureData : public osg::Referenced
+{
+			LayeredTextureData(int id)
+			    : _id( id )
+			    , _origin( 0.0f, 0.0f )
+			    , _scale( 1.0f, 1.0f )
+			    , _image( 0 )
+			    , _imageSource( 0 )
+			    , _imageScale( 1.0f, 1.0f )
+			    , _imageDataOrder( STR )
+			    , _declaredDataOrder( STR )
+			    , _imageReorder( KeepDataOrder )
+			    , _reorderedData( 0 )
+			    , _reorderedModifiedCount( 0 )
+			    , _sliceNr( 0 )
+			    , _vertex2TextureTrans( 0 )
+			    , _freezeDisplay( false )
+			    , _nrPowerChannels( 0 )
+			    , _textureUnit( -1 )
+			    , _filterType(Linear)
+			    , _borderColor( 1.0f, 1.0f, 1.0f, 1.0f )
+			    , _borderColorSource( 1.0f, 1.0f, 1.0f, 1.0f )
+			    , _undefLayerId( -1 )
+			    , _undefChannel( 0 )
+			    , _undefColor( -1.0f, -1.0f, -1.0f, -1.0f )
+			    , _undefColorSource( -1.0f, -1.0f, -1.0f, -1.0f )
+			    , _dirtyTileImages( false )
+			    , _hasCopiedTiles( false )
+			    , _hasConstantTiles( false )
+			    , _dirtyTileSampling( false )
+			    , _renewTileImages( false )
+			    , _mipPyramidImage( 0 )
+			    , _mipPyramidData( 0 )
+			    , _mipPyramidModifiedCount( 0 )
+			    , _mipPyramidSliceNr( -1 )
+			    , _mipPyramidDataOrder( STR )
+			{
+			    for ( int idx=0; idx<4; idx++ )
+				_undefChannelRefCount[idx] = 0;
+			}
+
+			~LayeredTextureData();
+
+    LayeredTextureData*	clone() const;
+    osg::Vec2f		getLayerCoord(const osg::Vec2f& global) const;
+    osg::Vec4f		getTextureVec(const osg::Vec2f& global) const;
+    void		getTextureSpan(float globalY,const float* globalX,
+				       int nrPixels,float* const* channels) const;
+    const TexelSampler*	getTexelSampler(TexelSampler& sourceSampler) const;
+    osg::Vec4f		sampleTexture(const TexelSampler&,float localX,
+				      float localY) const;
+    void		clearTransparencyType();
+    TransparencyType	getTransparencyType(int channel);
+    void		dirtyTransparencyChunks(const Vec2i& origin,
+						const Vec2i& size);
+    void		adaptColors();
+    void		cleanUp();
+    void		updateTileImagesIfNeeded() const;
+    void		dirtyTileImages(const Vec2i& origin,
+					const Vec2i& size) const;
+    bool		hasRescaledImage() const;
+    void		rescaleImage(int sNew,int tNew,bool inPlace=false,
+				     LayeredTexture::ResampleFilter=
+					LayeredTexture::TriangleFilter);
+    bool		do3D() const;
+    void		updateTexelSampler();
+
+    const int					_id;
+    osg::Vec2f					_origin;
+    osg::Vec2f					_scale;
+    osg::ref_ptr<osg::Image>			_image;
+    osg::ref_ptr<osg::Image>			_imageSource;
+    Vec2i					_imageSourceSize;
+    const unsigned char*			_imageSourceData;
+    osg::Vec2f					_imageScale;
+    int						_imageModifiedCount;
+    bool					_imageModifiedFlag;
+    ImageDataOrder				_imageDataOrder; // Stored
+    ImageDataOrder				_declaredDataOrder;
+    ImageReorder				_imageReorder;
+    const unsigned char*			_reorderedData;
+    unsigned int				_reorderedModifiedCount;
+    int						_sliceNr;
+    osg::Matrixf*				_vertex2TextureTrans;
+    bool					_freezeDisplay;
+    bool					_nrPowerChannels;
+    int						_textureUnit;
+    FilterType					_filterType;
+
+    osg::Vec4f					_borderColor;
+    osg::Vec4f					_borderColorSource;
+    int						_undefLayerId;
+    int						_undefChannel;
+    osg::Vec4f					_undefColor;
+    osg::Vec4f					_undefColorSource;
+    int						_undefChannelRefCount[4];
+    TransparencyType				_transparency[4];
+    std::vector<TransparencyType>		_transparencyChunks[4];
+    TexelSampler				_texelSampler;
+
+    mutable std::vector<osg::Image*>		_tileImages;
+    mutable bool				_dirtyTileImages;
+    mutable bool				_hasCopiedTiles; // Not views
+    mutable bool				_hasConstantTiles;
+
+    /* Tile textures of the current tiling, so that a new image or sampling
+       state of the layer can be applied without retiling. */
+    struct TileTexture
+    {
+	osg::ref_ptr<osg::Texture2D>	_texture;
+	osg::observer_ptr<osg::StateSet> _stateset;	// Of the cut-out
+	int			_unit;
+	Vec2i			_hasBorderArea;
+	Vec2i			_origin;
+	Vec2i			_size;
+	int			_sliceNr;
+	ImageDataOrder		_dataOrder;
+	bool			_renewable;	// Taken from the layer image
+    };
+
+    mutable std::vector<TileTexture>		_tileTextures;
+    mutable bool				_dirtyTileSampling;
+    mutable bool				_renewTileImages;
+
+    bool		getValueRange(const Vec2i& origin,const Vec2i& size,
+				      osg::Vec4f& min,osg::Vec4f& max) const;
+    void		dirtyValueRanges() const;
+
+    mutable OpenThreads::Mutex			_blockStatsMutex;
+    mutable BlockStatistics			_blockStats;
+
+    void		getMipPyramid(std::vector<osg::ref_ptr<osg::Image> >&,
+				      int& nrComponents) const;
+
+    mutable OpenThreads::Mutex			_mipPyramidMutex;
+    mutable std::vector<osg::ref_ptr<osg::Image> > _mipPyramid;
+    mutable const osg::Image*			_mipPyramidImage;
+    mutable const unsigned char*		_mipPyramidData;
+    mutable unsigned int			_mipPyramidModifiedCount;
+    mutable int					_mipPyramidSliceNr;
+    mutable ImageDataOrder			_mipPyramidDataOrder;
+};
+
+
+LayeredTextureData::~LayeredTextureData()
+{
+    cleanUp();
+
+    if ( _vertex2TextureTrans )
+	delete _vertex2TextureTrans;
+}
+
+
+LayeredTextureData* LayeredTextureData::clone() const
+{
+    LayeredTextureData* res = new LayeredTextureData( _id );
+    res->_origin = _origin;
+    res->_scale = _scale; 
+    res->_textureUnit = _textureUnit;
+    res->_filterType = _filterType;
+    res->_freezeDisplay = _freezeDisplay;
+    res->_imageModifiedCount = _imageModifiedCount;
+    res->_imageScale = _imageScale; 
+    res->_imageDataOrder = _imageDataOrder; 
+    res->_declaredDataOrder = _declaredDataOrder;
+    res->_imageReorder = _imageReorder;
+    res->_reorderedData = _reorderedData;
+    res->_reorderedModifiedCount = _reorderedModifiedCount;
+    res->_sliceNr = _sliceNr; 
+    res->_imageSource = _imageSource.get();
+    res->_vertex2TextureTrans = _vertex2TextureTrans ? new osg::Matrixf(*_vertex2TextureTrans) : 0;
+
+    if ( _image.get()==_imageSource.get() )
+	res->_image = _image.get();
+    else
+	res->_image = (osg::Image*) _image->clone(osg::CopyOp::DEEP_COPY_ALL);
+
+    res->_borderColor = _borderColor;
+    res->_borderColor = _borderColorSource;
+    res->_undefLayerId = _undefLayerId;
+    res->_undefChannel = _undefChannel;
+    res->_undefColorSource = _undefColorSource;
+    res->_undefColor = _undefColor;
+    res->_dirtyTileImages = _dirtyTileImages;
+
+    for ( int idx=0; idx<4; idx++ )
+    {
+	res->_undefChannelRefCount[idx] = _undefChannelRefCount[idx];
+	res->_transparency[idx] = _transparency[idx];
+	res->_transparencyChunks[idx] = _transparencyChunks[idx];
+    }
+
+    res->updateTexelSampler();
+    return res;
+}
+
+
+osg::Vec2f LayeredTextureData::getLayerCoord( const osg::Vec2f& global ) const
+{
+    osg::Vec2f res = global - _origin;
+    res.x() /= _scale.x() * _imageScale.x();
+    res.y() /= _scale.y() * _imageScale.y();
+    
+    return res;
+}
+
+
+void LayeredTextureData::clearTransparencyType()
+{
+    for ( int idx=0; idx<4; idx++ )
+    {
+	_transparency[idx] = TransparencyUnknown;
+	_transparencyChunks[idx].clear();
+    }
+}
+
+
+#define TRANSPARENCY_CHUNK_SIZE	16384	// pixels
+
+TransparencyType LayeredTextureData::getTransparencyType( int channel )
+{
+    TransparencyType& tt = _transparency[channel];
+    if ( tt!=TransparencyUnknown )
+	return tt;
+
+    const osg::Image* image = _image.get();
+    const pixel_int nrPixels = pixel_int(image->s()) * image->t() * image->r();
+    const int imageChannel = texture2ImageChannel( channel, image->getPixelFormat() );
+
+    if ( imageChannel<0 || nrPixels<1 )
+    {
+	tt = getImageTransparencyType( image, channel, 0, nrPixels );
+	return tt;
+    }
+
+    // Never read a whole file-backed image just to classify it
+    if ( dynamic_cast<const MappedImage*>(image) )
+    {
+	tt = HasTransparencies;
+	return tt;
+    }
+
+    // Only chunks that were never classified or touched since are scanned
+    std::vector<TransparencyType>& chunks = _transparencyChunks[channel];
+    const pixel_int nrChunks = (nrPixels+TRANSPARENCY_CHUNK_SIZE-1) / TRANSPARENCY_CHUNK_SIZE;
+    if ( chunks.size()!=nrChunks )
+	chunks.assign( nrChunks, TransparencyUnknown );
+
+    bool foundOpaquePixel = false;
+    bool foundTransparentPixel = false;
+
+    for ( pixel_int idx=0; idx<nrChunks; idx++ )
+    {
+	if ( chunks[idx]==TransparencyUnknown )
+	{
+	    const pixel_int firstPixel = idx * TRANSPARENCY_CHUNK_SIZE;
+	    const pixel_int nrChunkPixels = osg::minimum( pixel_int(TRANSPARENCY_CHUNK_SIZE), nrPixels-firstPixel );
+	    chunks[idx] = getImageTransparencyType( image, channel, firstPixel, nrChunkPixels );
+	}
+
+	if ( chunks[idx]==HasTransparencies )
+	{
+	    tt = HasTransparencies;
+	    return tt;
+	}
+
+	if ( chunks[idx]!=Opaque )
+	    foundTransparentPixel = true;
+	if ( chunks[idx]!=FullyTransparent )
+	    foundOpaquePixel = true;
+    }
+
+    if ( foundTransparentPixel )
+	tt = foundOpaquePixel ? OnlyFullTransparencies : FullyTransparent;
+    else
+	tt = Opaque;
+
+    return tt;
+}
+
+
+void LayeredTextureData::dirtyTransparencyChunks( const Vec2i& origin, const Vec2i& size )
+{
+    if ( !_image || !_image->data() )
+	return;
+
+    const pixel_int pixelSize = _image->getPixelSizeInBits()/8;
+    if ( !pixelSize )
+	return;
+
+    const int sliceNr = _sliceNr>=_image->r() ? _image->r()-1 : _sliceNr;
+    const ImageDataOrder dataOrder = hasRescaledImage() ? STR : _imageDataOrder;
+
+    pixel_int xStep, yStep, zStep;
+    getImageSteps( *_image, dataOrder, xStep, yStep, zStep );
+
+    Vec2i first( osg::maximum(origin.x(),0), osg::maximum(origin.y(),0) );
+    Vec2i last( osg::minimum(origin.x()+size.x(),_image->s())-1,
+		osg::minimum(origin.y()+size.y(),_image->t())-1 );
+    if ( first.x()>last.x() || first.y()>last.y() )
+	return;
+
+    // Pixel lines along the smallest step span contiguous byte ranges
+    const bool rowMajor = xStep<=yStep;
+    const int dim = rowMajor ? 1 : 0;
+    const pixel_int majorStep = rowMajor ? yStep : xStep;
+    const pixel_int minorStep = rowMajor ? xStep : yStep;
+    const pixel_int lineBytes = (last[1-dim]-first[1-dim])*minorStep + pixelSize;
+    const pixel_int chunkBytes = TRANSPARENCY_CHUNK_SIZE * pixelSize;
+
+    for ( int major=first[dim]; major<=last[dim]; major++ )
+    {
+	const pixel_int lineStart = sliceNr*zStep + major*majorStep + first[1-dim]*minorStep;
+	const pixel_int lastChunk = (lineStart+lineBytes-1) / chunkBytes;
+
+	for ( pixel_int chunk=lineStart/chunkBytes; chunk<=lastChunk; chunk++ )
+	{
+	    for ( int channel=0; channel<4; channel++ )
+	    {
+		if ( chunk<_transparencyChunks[channel].size() )
+		    _transparencyChunks[channel][chunk] = TransparencyUnknown;
+	    }
+	}
+    }
+}
+
+
+void LayeredTextureData::adaptColors()
+{
+    _undefColor  = _undefColorSource;
+    _borderColor = _borderColorSource;
+
+    if ( !_image )
+	return;
+
+    const GLenum format = _image->getPixelFormat();
+
+    for ( int idx=0; idx<4; idx++ )
+    {
+	const int ic = texture2ImageChannel( idx, format );
+
+	if ( ic==ZERO_CHANNEL )
+	{
+	    _undefColor[idx]  = _undefColor[idx]<0.0f  ? -1.0f : 0.0f;
+	    _borderColor[idx] = _borderColor[idx]<0.0f ? -1.0f : 0.0f;
+	}
+	else if ( ic==ONE_CHANNEL )
+	{
+	    _undefColor[idx]  = _undefColor[idx]<0.0f  ? -1.0f : 1.0f;
+	    _borderColor[idx] = _borderColor[idx]<0.0f ? -1.0f : 1.0f;
+	}
+	else if ( ic>=0 )
+	{
+	    const int tc = osgGeo::LayeredTexture::image2TextureChannel( ic, format );
+	    _undefColor[idx]  = _undefColorSource[tc];
+	    _borderColor[idx] = _borderColorSource[tc];
+	}
+    }
+}
+
+
+const TexelSampler* LayeredTextureData::getTexelSampler( TexelSampler& sourceSampler ) const
+{
+    if ( do3D() || !_image.get() )
+	return 0;
+
+    const TexelSampler* sampler = &_texelSampler;
+
+    if ( !sampler->isUpToDate(_image.get()) )
+    {
+	// Image has been modified since the last update traversal
+	sourceSampler.set( _image.get(), hasRescaledImage() ? STR : _imageDataOrder, _sliceNr );
+	sampler = &sourceSampler;
+    }
+
+    return sampler->isValid() ? sampler : 0;
+}
+
+
+osg::Vec4f LayeredTextureData::sampleTexture( const TexelSampler& sampler, float localX, float localY ) const
+{
+    int s = (int) floor( localX );
+    int t = (int) floor( localY );
+
+    osg::Vec4f col00 = sampler.getColor( s, t, _borderColor );
+
+    if ( _filterType==Nearest )
+	return col00;
+
+    const float sFrac = localX-s;
+    const float tFrac = localY-t;
+
+    if ( !tFrac )
+    {
+	if ( !sFrac )
+	    return col00;
+
+	const osg::Vec4f col10 = sampler.getColor( s+1, t, _borderColor );
+	return col00*(1.0f-sFrac) + col10*sFrac;
+    }
+
+    const osg::Vec4f col01 = sampler.getColor( s, t+1, _borderColor );
+    col00 = col00*(1.0f-tFrac) + col01*tFrac;
+
+    if ( !sFrac )
+	return col00;
+
+    const osg::Vec4f col11 = sampler.getColor( s+1, t+1, _borderColor );
+    osg::Vec4f col10 = sampler.getColor( s+1, t, _borderColor );
+
+    col10 = col10*(1.0f-tFrac) + col11*tFrac;
+    return  col00*(1.0f-sFrac) + col10*sFrac;
+}
+
+
+osg::Vec4f LayeredTextureData::getTextureVec( const osg::Vec2f& globalCoord ) const
+{
+    TexelSampler sourceSampler;
+    const TexelSampler* sampler = getTexelSampler( sourceSampler );
+    if ( !sampler )
+	return _borderColor;
+
+    osg::Vec2f local = getLayerCoord( globalCoord );
+    if ( _filterType!=Nearest )
 	local -= osg::Vec2f( 0.5, 0.5 );
 
+    return sampleTexture( *sampler, local.x(), local.y() );
+}
+
+
+void LayeredTextureData::getTextureSpan( float globalY, const float* globalX, int nrPixels, float* const* channels ) const
+{
+    TexelSampler sourceSampler;
+    const TexelSampler* sampler = getTexelSampler( sourceSampler );
+
+    // Same arithmetic as getLayerCoord(.), with the row part done once
+    const float xFactor = _scale.x() * _imageScale.x();
+    float localY = (globalY-_origin.y()) / (_scale.y()*_imageScale.y());
+    const float filterShift = _filterType!=Nearest ? 0.5f : 0.0f;
+    localY -= filterShift;
+
+    for ( int idx=0; idx<nrPixels; idx++ )
+    {
+	osg::Vec4f col = _borderColor;
+	if ( sampler )
+	{
+	    const float localX = (globalX[idx]-_origin.x()) / xFactor;
+	    col = sampleTexture( *sampler, localX-filterShift, localY );
+	}
+
+	for ( int ch=0; ch<4; ch++ )
+	{
+	    if ( channels[ch] )
+		channels[ch][idx] = col[ch];
+	}
+    }
+}
+
+
+void LayeredTextureData::cleanUp()
+{
+    std::vector<osg::Image*>::iterator it = _tileImages.begin();
+    for ( ; it!=_tileImages.end(); it++ )
+	(*it)->unref();
+
+    _tileImages.clear();
+    _tileTextures.clear();
+    _dirtyTileSampling = false;
+    _renewTileImages = false;
+    _hasCopiedTiles = false;
+    _hasConstantTiles = false;
+}
+
+
+void LayeredTextureData::updateTileImagesIfNeeded() const
+{
+    if ( _dirtyTileImages )
+    {
+	std::vector<osg::Image*>::iterator it = _tileImages.begin();
+	for ( ; it!=_tileImages.end(); it++ )
+	    (*it)->dirty();
+
+	_dirtyTileImages = false;
+    }
+}
+
+
+void LayeredTextureData::dirtyTileImages( const Vec2i& origin, const Vec2i& size ) const
+{
+    if ( !_image || _tileImages.empty() )
+	return;
+
+    const int sliceNr = _sliceNr>=_image->r() ? _image->r()-1 : _sliceNr;
     const ImageDataOrder dataOrder = hasRescaledImage() ? STR : _imageDataOrder;
-    const int r = _sliceNr>=_image->r() ? _image->r()-1 : _sliceNr;
 
-    int s = (int) floor( local.x() );
-    int t = (int) floor( local.y() );
+    pixel_int xStep, yStep, zStep;
+    getImageSteps( *_image, dataOrder, xStep, yStep, zStep );
+    const unsigned char* sliceData = _image->data() + sliceNr*zStep;
 
-    GET_COLOR( col00, _image, s, t, r, dataOrder );
+    std::vector<osg::Image*>::const_iterator it = _tileImages.begin();
+    for ( ; it!=_tileImages.end(); it++ )
+    {
+	// Tile images are stride views on the layer image
+	const unsigned char* tileData = (*it)->data();
+	if ( tileData>=sliceData && xStep!=yStep )
+	{
+	    const pixel_int offset = tileData - sliceData;
+	    const bool rowMajor = xStep<yStep;
+	    const pixel_int majorStep = rowMajor ? yStep : xStep;
+	    const pixel_int minorStep = rowMajor ? xStep : yStep;
+	    const int major0 = (int) (offset/majorStep);
+	    const int minor0 = (int) ((offset%majorStep)/minorStep);
+	    const int x0 = rowMajor ? minor0 : major0;
+	    const int y0 = rowMajor ? major0 : minor0;
+
+	    if ( x0>=origin.x()+size.x() || x0+(*it)->s()<=origin.x() ||
+		 y0>=origin.y()+size.y() || y0+(*it)->t()<=origin.y() )
+		continue;
+	}
 
-    if ( _filterType==Nearest )
-	return col00;
+	(*it)->dirty();
+    }
+}
 
-    const float sFrac = local.x()-s;
-    const float tFrac = local.y()-t;
 
-    if ( !tFrac )
+bool LayeredTextureData::getValueRange( const Vec2i& origin, const Vec2i& size, osg::Vec4f& min, osg::Vec4f& max ) const
+{
+    TexelSampler sourceSampler;
+    const TexelSampler* sampler = getTexelSampler( sourceSampler );
+    if ( !sampler )
+	return false;
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _blockStatsMutex );
+    if ( !_blockStats.isUpToDate(*sampler) )
+	_blockStats.update( *sampler );
+
+    return _blockStats.getRange( origin, size, min, max );
+}
+
+
+void LayeredTextureData::dirtyValueRanges() const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _blockStatsMutex );
+    _blockStats.invalidate();
+}
+
+
+void LayeredTextureData::getMipPyramid( std::vector<osg::ref_ptr<osg::Image> >& levels, int& nrComponents ) const
+{
+    levels.clear();
+
+    const osg::Image* image = _image.get();
+    if ( !image || !image->data() || !getMipmapComponents(*image,nrComponents) )
+	return;
+
+    const int sliceNr = _sliceNr>=image->r() ? image->r()-1 : _sliceNr;
+    const ImageDataOrder dataOrder = hasRescaledImage() ? STR : _imageDataOrder;
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mipPyramidMutex );
+
+    if ( _mipPyramidImage!=image || _mipPyramidData!=image->data() ||
+	 _mipPyramidModifiedCount!=image->getModifiedCount() ||
+	 _mipPyramidSliceNr!=sliceNr || _mipPyramidDataOrder!=dataOrder )
     {
-	if ( !sFrac )
-	    return col00;
+	_mipPyramid.clear();
 
-	s++;
-	GET_COLOR( col10, _image, s, t, r, dataOrder );
-	return col00*(1.0f-sFrac) + col10*sFrac;
+	const pixel_int pixelSize = image->getPixelSizeInBits()/8;
+	pixel_int xStep, yStep, zStep;
+	getImageSteps( *image, dataOrder, xStep, yStep, zStep );
+
+	const unsigned char* src = image->data() + sliceNr*zStep;
+	int width = image->s();
+	int height = image->t();
+
+	while ( width>1 || height>1 )
+	{
+	    const int newWidth = width>1 ? width/2 : 1;
+	    const int newHeight = height>1 ? height/2 : 1;
+
+	    osg::ref_ptr<osg::Image> level = new osg::Image;
+	    level->allocateImage( newWidth, newHeight, 1, image->getPixelFormat(), image->getDataType(), 1 );
+	    downsampleMipLevel( src, xStep, yStep, width, height, level->data(), newWidth, newHeight, image->getDataType(), nrComponents );
+	    _mipPyramid.push_back( level );
+
+	    src = level->data();
+	    xStep = pixelSize;
+	    yStep = newWidth*pixelSize;
+	    width = newWidth;
+	    height = newHeight;
+	}
+
+	_mipPyramidImage = image;
+	_mipPyramidData = image->data();
+	_mipPyramidModifiedCount = image->getModifiedCount();
+	_mipPyramidSliceNr = sliceNr;
+	_mipPyramidDataOrder = dataOrder;
     }
 
-    t++;
-    GET_COLOR( col01, _image, s, t, r, dataOrder );
-    col00 = col00*(1.0f-tFrac) + col01*tFrac;
+    levels = _mipPyramid;
+}
 
-    if ( !sFrac )
-	return col00;
 
-    s++;
-    GET_COLOR( col11, _image, s, t, r, dataOrder );
-    t--;
-    GET_COLOR( col10, _image, s, t, r, dataOrder );
+bool LayeredTextureData::hasRescaledImage() const 
+{ return _image && _image!=_imageSource; }
 
-    col10 = col10*(1.0f-tFrac) + col11*tFrac;
-    return  col00*(1.0f-sFrac) + col10*sFrac;
+
+void LayeredTextureData::rescaleImage( int sNew, int tNew, bool inPlace, LayeredTexture::ResampleFilter filter )
+{
+    if ( sNew<1 || tNew<1 || !_imageSource )
+	return;
+
+    const int sliceNr = _sliceNr>=_imageSource->r() ? _imageSource->r()-1 : _sliceNr;
+    osg::ref_ptr<osg::Image> imageToScale = new osg::Image();
+
+    if ( LayeredTexture::resampleImage(*_imageSource,*imageToScale,sNew,tNew,sliceNr,_imageDataOrder,filter) )
+    {}
+    else if ( _imageDataOrder==STR  )
+    {
+	imageToScale->setImage( _imageSource->s(), _imageSource->t(), 1, _imageSource->getInternalTextureFormat(), _imageSource->getPixelFormat(), _imageSource->getDataType(), _imageSource->data(0,0,sliceNr), osg::Image::NO_DELETE, _imageSource->getPacking() );
+    }
+    else
+    {
+	LayeredTexture::copyImageTile( *_imageSource, *imageToScale, Vec2i(0,0), Vec2i(_imageSource->s(),_imageSource->t()), sliceNr, _imageDataOrder ); 
+    }
+
+    // scaleImage(.) can only deal with 2D images without stride
+    if ( imageToScale->s()!=sNew || imageToScale->t()!=tNew )
+	imageToScale->scaleImage( sNew, tNew, 1 ); 
+
+    if ( inPlace && _image && sNew==_image->s() && tNew==_image->t() )
+	_image->copySubImage( 0, 0, 0, imageToScale ); 
+    else
+	_image = imageToScale;
+
+    updateTexelSampler();
 }
 
 
-void LayeredTextureData::cleanUp()
+void LayeredTextureData::updateTexelSampler()
 {
-    std::vector<osg::Image*>::iterator it = _tileImages.begin();
-    for ( ; it!=_tileImages.end(); it++ )
-	(*it)->unref();
+    _texelSampler.set( _image.get(), hasRescaledImage() ? STR : _imageDataOrder, _sliceNr );
+}
 
-    _tileImages.clear();
+
+bool LayeredTextureData::do3D() const
+{
+    const osg::Image* image = _vertex2TextureTrans ? _imageSource.get() : 0;
+    return image && image->s()>1 && image->t()>1 && image->r()>1;
 }
 
 
-void LayeredTextureData::updateTileImagesIfNeeded() const
+//============================================================================
+
+
+/* Stack undef setup against which cut-outs were found to be completely
+   undefined. Tiling has to be redone as soon as it changes. */
+
+struct UndefCutoutState
 {
-    if ( _dirtyTileImages )
+			UndefCutoutState()
+			    : _layerId( -1 ), _channel( 0 ), _inverted( false )
+			    , _transparent( false ), _image( 0 )
+			    , _imageModifiedCount( 0 ), _modifiedCount( 0 )
+			    , _sliceNr( 0 )
+			{}
+
+    bool		operator==(const UndefCutoutState& st) const
+			{
+			    return _layerId==st._layerId &&
+				   _channel==st._channel &&
+				   _inverted==st._inverted &&
+				   _transparent==st._transparent &&
+				   _image==st._image &&
+				   _imageModifiedCount==st._imageModifiedCount &&
+				   _modifiedCount==st._modifiedCount &&
+				   _sliceNr==st._sliceNr;
+			}
+
+    int			_layerId;
+    int			_channel;
+    bool		_inverted;
+    bool		_transparent;
+    const osg::Image*	_image;
+    int			_imageModifiedCount;
+    unsigned int	_modifiedCount;
+    int			_sliceNr;
+};
+
+
+struct TilingInfo
+{
+			TilingInfo()
+			    : _undefinedCutouts( false )
+			{ reInit(); }
+
+    void		reInit()
+			{
+			    _envelopeOrigin = osg::Vec2f( 0.0f, 0.0f );
+			    _envelopeSize = osg::Vec2f( 0.0f, 0.0f );
+			    _smallestScale = osg::Vec2f( 1.0f, 1.0f );
+			    _maxTileSize = osg::Vec2f( 0.0f, 0.0f );
+			    _needsUpdate = false;
+			    _retilingNeeded = true;
+			}
+
+    osg::Vec2f		_envelopeOrigin;
+    osg::Vec2f		_envelopeSize;
+    osg::Vec2f		_smallestScale;
+    osg::Vec2f  	_maxTileSize;
+    bool		_needsUpdate;
+    bool		_retilingNeeded;
+
+    bool		_undefinedCutouts;	// Since last reInitTiling(.)
+    UndefCutoutState	_undefCutoutState;
+};
+
+
+struct TextureInfo
+{
+    				TextureInfo()
+				    : _isValid( false )
+				    , _contextId( -1 )
+				    , _nrUnits( 256 )
+				    , _maxSize( 65536 )
+				    , _nonPowerOf2Support( false )
+				    , _shadingSupport( false )
+				    , _floatSupport( false )
+				    , _nrVertexUnits( 256 )
+				{}
+
+    bool			_isValid;
+    int				_contextId;
+    int				_nrUnits;
+    int				_maxSize;
+    bool			_nonPowerOf2Support;
+    bool			_shadingSupport;
+    bool			_floatSupport;
+    int				_nrVertexUnits;
+};
+
+
+//============================================================================
+
+
+/* Identifies the texture of a cut-out tile by everything that determines
+   its texels and sampling state. */
+
+struct TileCacheKey
+{
+    bool		operator<(const TileCacheKey&) const;
+
+    int			_layerId;
+    const osg::Image*	_image;
+    const unsigned char* _data;
+    int			_modifiedCount;
+    Vec2i		_origin;
+    Vec2i		_size;
+    int			_sliceNr;
+    int			_dataOrder;
+    bool		_resizeHint;
+    int			_wrapS;
+    int			_wrapT;
+    int			_minFilter;
+    int			_magFilter;
+    float		_maxAnisotropy;
+    osg::Vec4f		_borderColor;
+    bool		_cpuMipmaps;
+};
+
+
+bool TileCacheKey::operator<( const TileCacheKey& key ) const
+{
+    if ( _layerId!=key._layerId ) return _layerId<key._layerId;
+    if ( _image!=key._image ) return _image<key._image;
+    if ( _data!=key._data ) return _data<key._data;
+    if ( _modifiedCount!=key._modifiedCount )
+	return _modifiedCount<key._modifiedCount;
+
+    if ( _origin!=key._origin ) return _origin<key._origin;
+    if ( _size!=key._size ) return _size<key._size;
+    if ( _sliceNr!=key._sliceNr ) return _sliceNr<key._sliceNr;
+    if ( _dataOrder!=key._dataOrder ) return _dataOrder<key._dataOrder;
+    if ( _resizeHint!=key._resizeHint ) return _resizeHint<key._resizeHint;
+    if ( _wrapS!=key._wrapS ) return _wrapS<key._wrapS;
+    if ( _wrapT!=key._wrapT ) return _wrapT<key._wrapT;
+    if ( _minFilter!=key._minFilter ) return _minFilter<key._minFilter;
+    if ( _magFilter!=key._magFilter ) return _magFilter<key._magFilter;
+    if ( _maxAnisotropy!=key._maxAnisotropy )
+	return _maxAnisotropy<key._maxAnisotropy;
+
+    if ( _borderColor!=key._borderColor )
+	return _borderColor<key._borderColor;
+
+    return _cpuMipmaps<key._cpuMipmaps;
+}
+
+
+/* Tile textures kept across retiling by all layered textures, evicting the
+   least recently used ones when their total size exceeds the process-wide
+   memory budget. Identical cut-outs of different layered textures share a
+   texture, so a texture found here must not be modified. */
+
+struct TileTextureCache
+{
+			TileTextureCache(unsigned int budget)
+			    : _budget( budget )
+			    , _totalSize( 0 )
+			{}
+
+    osg::ref_ptr<osg::Texture2D> find(const TileCacheKey&,bool& isView);
+    void		insert(const TileCacheKey&,osg::Texture2D*,
+			       const osg::Image* source,bool isView,
+			       const LayeredTexture* owner);
+    void		purge(const LayeredTexture* owner,int layerId=-1);
+			//!<All layers if layerId is -1
+    void		purgeCopies(const osg::Image*);
+			//!<Gathered copies that miss in-place image updates
+    void		setBudget(unsigned int);
+    unsigned int	getBudget();
+
+    osg::ref_ptr<osg::Texture2D> getConstantTexture(unsigned char value);
+			//!<Shared 1x1 texture with all channels set to value
+    osg::ref_ptr<osg::Texture2D> getTexelTexture(const osg::Image& texel);
+			//!<Shared 1x1 texture of the given 1x1 image
+
+protected:
+
+    struct Entry
     {
-	std::vector<osg::Image*>::iterator it = _tileImages.begin();
-	for ( ; it!=_tileImages.end(); it++ )
-	    (*it)->dirty();
+	TileCacheKey				_key;
+	osg::ref_ptr<osg::Texture2D>		_texture;
+	osg::ref_ptr<const osg::Image>		_source;
+	const LayeredTexture*			_owner;
+	unsigned int				_size;
+	bool					_isView;
+    };
+
+    typedef std::list<Entry>				EntryList;
+    typedef std::map<TileCacheKey,EntryList::iterator>	EntryMap;
+
+    void		evict();
+    void		erase(EntryList::iterator&);
+
+    typedef std::map<unsigned char,osg::ref_ptr<osg::Texture2D> > ConstantMap;
+    typedef std::map<std::string,osg::ref_ptr<osg::Texture2D> > TexelMap;
+
+    OpenThreads::Mutex	_mutex;
+    EntryList		_entries;	// Most recently used first
+    ConstantMap		_constantTextures;
+    TexelMap		_texelTextures;
+    EntryMap		_entryMap;
+    unsigned int	_budget;
+    unsigned int	_totalSize;
+};
+
+
+osg::ref_ptr<osg::Texture2D> TileTextureCache::find( const TileCacheKey& key, bool& isView )
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+
+    EntryMap::iterator it = _entryMap.find( key );
+    if ( it==_entryMap.end() )
+	return 0;
+
+    _entries.splice( _entries.begin(), _entries, it->second );
+    isView = it->second->_isView;
+    return it->second->_texture;
+}
+
+
+void TileTextureCache::insert( const TileCacheKey& key, osg::Texture2D* texture, const osg::Image* source, bool isView, const LayeredTexture* owner )
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+
+    const osg::Image* tile = texture->getImage();
+    const unsigned int size = tile->s() * tile->t() * (tile->getPixelSizeInBits()/8);
+    if ( !_budget || size>_budget || _entryMap.find(key)!=_entryMap.end() )
+	return;
+
+    Entry entry;
+    entry._key = key;
+    entry._texture = texture;
+    entry._source = source;	// Keeps image identity unique in the key
+    entry._owner = owner;
+    entry._size = size;
+    entry._isView = isView;
+
+    _entries.push_front( entry );
+    _entryMap[key] = _entries.begin();
+    _totalSize += size;
+
+    evict();
+}
+
+
+void TileTextureCache::erase( EntryList::iterator& it )
+{
+    _totalSize -= it->_size;
+    _entryMap.erase( it->_key );
+    it = _entries.erase( it );
+}
+
+
+void TileTextureCache::purge( const LayeredTexture* owner, int layerId )
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+
+    EntryList::iterator it = _entries.begin();
+    while ( it!=_entries.end() )
+    {
+	if ( it->_owner==owner && (layerId==-1 || it->_key._layerId==layerId) )
+	    erase( it );
+	else
+	    it++;
+    }
+}
+
+
+void TileTextureCache::purgeCopies( const osg::Image* image )
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+
+    EntryList::iterator it = _entries.begin();
+    while ( it!=_entries.end() )
+    {
+	if ( it->_key._image==image && !it->_isView )
+	    erase( it );
+	else
+	    it++;
+    }
+}
+
+
+void TileTextureCache::setBudget( unsigned int budget )
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+    _budget = budget;
+    evict();
+}
+
+
+unsigned int TileTextureCache::getBudget()
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+    return _budget;
+}
+
+
+osg::ref_ptr<osg::Texture2D> TileTextureCache::getConstantTexture( unsigned char value )
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+
+    osg::ref_ptr<osg::Texture2D>& texture = _constantTextures[value];
+    if ( !texture )
+    {
+	osg::ref_ptr<osg::Image> image = new osg::Image;
+	image->allocateImage( 1, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, 1 );
+	memset( image->data(), value, 4 );
+
+	texture = new osg::Texture2D( image.get() );
+	texture->setFilter( osg::Texture::MIN_FILTER, osg::Texture::NEAREST );
+	texture->setFilter( osg::Texture::MAG_FILTER, osg::Texture::NEAREST );
+    }
+
+    return texture;
+}
+
+
+osg::ref_ptr<osg::Texture2D> TileTextureCache::getTexelTexture( const osg::Image& texel )
+{
+    char format[64];
+    snprintf( format, 64, "%d %d %d:", texel.getInternalTextureFormat(), texel.getPixelFormat(), texel.getDataType() );
+    std::string key( format );
+    key.append( (const char*) texel.data(), texel.getPixelSizeInBits()/8 );
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+
+    osg::ref_ptr<osg::Texture2D>& texture = _texelTextures[key];
+    if ( texture )
+	return texture;
+
+    // Forget the texels no tile refers to any longer
+    if ( _texelTextures.size()>256 )
+    {
+	TexelMap::iterator it = _texelTextures.begin();
+	while ( it!=_texelTextures.end() )
+	{
+	    if ( it->second.valid() && it->second->referenceCount()==1 )
+		_texelTextures.erase( it++ );
+	    else
+		it++;
+	}
+    }
+
+    osg::ref_ptr<osg::Texture2D>& newTexture = _texelTextures[key];
+    newTexture = new osg::Texture2D( const_cast<osg::Image*>(&texel) );
+    newTexture->setFilter( osg::Texture::MIN_FILTER, osg::Texture::NEAREST );
+    newTexture->setFilter( osg::Texture::MAG_FILTER, osg::Texture::NEAREST );
+    return newTexture;
+}
+
+
+void TileTextureCache::evict()
+{
+    while ( _totalSize>_budget && !_entries.empty() )
+    {
+	EntryList::iterator it = _entries.end();
+	erase( --it );
+    }
+}
+
+
+static TileTextureCache tileTextureCache( 64*1024*1024 );
+
+
+/* Texture3D objects shared by all cut-outs of all layered textures, so that
+   the voxels of a 3D layer are held by one texture object and uploaded only
+   once per graphics context. In-place image updates are uploaded by the
+   texture itself, so only another image or filtering needs a new one. The
+   cache does not keep textures alive, so replaced or removed images are
+   freed with the last cut-out using them. */
+
+class Texture3DCache
+{
+public:
+			Texture3DCache() : _nrCreated( 0 )	{}
+
+    osg::ref_ptr<osg::Texture3D> get(osg::Image*,osg::Texture::WrapMode,
+			    osg::Texture::FilterMode,
+			    const osg::Vec4f& borderColor);
+			//!<Referenced before unlocking, so pruning cannot free it
+    void		prune();
+			//!<Forgets textures that were freed
+
+    unsigned int	nrTextures();
+    unsigned int	nrCreated();
+
+protected:
+
+    struct Key
+    {
+	bool			operator<(const Key&) const;
+
+	const osg::Image*	_image;
+	int			_wrapMode;
+	int			_filterMode;
+	osg::Vec4f		_borderColor;
+    };
+
+    // A live texture references its image, which keeps the key unique
+    typedef std::map<Key,osg::observer_ptr<osg::Texture3D> >	EntryMap;
+
+    void		pruneUnlocked();
+
+    OpenThreads::Mutex	_mutex;
+    EntryMap		_entries;
+    unsigned int	_nrCreated;
+};
 
-	_dirtyTileImages = false;
-    }
+
+bool Texture3DCache::Key::operator<( const Key& key ) const
+{
+    if ( _image!=key._image ) return _image<key._image;
+    if ( _wrapMode!=key._wrapMode ) return _wrapMode<key._wrapMode;
+    if ( _filterMode!=key._filterMode ) return _filterMode<key._filterMode;
+    return _borderColor<key._borderColor;
 }
 
 
-bool LayeredTextureData::hasRescaledImage() const 
-{ return _image && _image!=_imageSource; }
+osg::ref_ptr<osg::Texture3D> Texture3DCache::get( osg::Image* image, osg::Texture::WrapMode wrapMode, osg::Texture::FilterMode filterMode, const osg::Vec4f& borderColor )
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
 
+    Key key;
+    key._image = image;
+    key._wrapMode = wrapMode;
+    key._filterMode = filterMode;
+    key._borderColor = borderColor;
 
-void LayeredTextureData::rescaleImage( int sNew, int tNew, bool inPlace )
-{
-    if ( sNew<1 || tNew<1 || !_imageSource )
-	return;
+    osg::ref_ptr<osg::Texture3D> texture;
+    EntryMap::iterator it = _entries.find( key );
+    if ( it!=_entries.end() && it->second.lock(texture) )
+	return texture;
 
-    const int sliceNr = _sliceNr>=_imageSource->r() ? _imageSource->r()-1 : _sliceNr;
-    osg::ref_ptr<osg::Image> imageToScale = new osg::Image();
+    pruneUnlocked();
 
-    if ( _imageDataOrder==STR  )
-    {
-	imageToScale->setImage( _imageSource->s(), _imageSource->t(), 1, _imageSource->getInternalTextureFormat(), _imageSource->getPixelFormat(), _imageSource->getDataType(), _imageSource->data(0,0,sliceNr), osg::Image::NO_DELETE, _imageSource->getPacking() );
-    }
-    else
-    {
-	copyImageTile( *_imageSource, *imageToScale, Vec2i(0,0), Vec2i(_imageSource->s(),_imageSource->t()), sliceNr, _imageDataOrder ); 
-    }
+    texture = new osg::Texture3D( image );
+    texture->setResizeNonPowerOfTwoHint( false );
+    texture->setWrap( osg::Texture::WRAP_S, wrapMode );
+    texture->setWrap( osg::Texture::WRAP_T, wrapMode );
+    texture->setWrap( osg::Texture::WRAP_R, wrapMode );
+    texture->setFilter( osg::Texture::MAG_FILTER, filterMode );
+    texture->setFilter( osg::Texture::MIN_FILTER, filterMode );
+    texture->setBorderColor( borderColor );
 
-    // scaleImage(.) can only deal with 2D images without stride
-    imageToScale->scaleImage( sNew, tNew, 1 ); 
+    _entries[key] = texture;
+    _nrCreated++;
 
-    if ( inPlace && _image && sNew==_image->s() && tNew==_image->t() )
-	_image->copySubImage( 0, 0, 0, imageToScale ); 
-    else
-	_image = imageToScale;
+    return texture;
 }
 
 
-bool LayeredTextureData::do3D() const
+void Texture3DCache::prune()
 {
-    const osg::Image* image = _vertex2TextureTrans ? _imageSource.get() : 0;
-    return image && image->s()>1 && image->t()>1 && image->r()>1;
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+    pruneUnlocked();
 }
 
 
-//============================================================================
+void Texture3DCache::pruneUnlocked()
+{
+    EntryMap::iterator it = _entries.begin();
+    while ( it!=_entries.end() )
+    {
+	if ( !it->second.valid() )
+	    _entries.erase( it++ );
+	else
+	    it++;
+    }
+}
 
 
-struct TilingInfo
+unsigned int Texture3DCache::nrTextures()
 {
-			TilingInfo()			{ reInit(); }
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+    return _entries.size();
+}
 
-    void		reInit()
-			{
-			    _envelopeOrigin = osg::Vec2f( 0.0f, 0.0f );
-			    _envelopeSize = osg::Vec2f( 0.0f, 0.0f );
-			    _smallestScale = osg::Vec2f( 1.0f, 1.0f );
-			    _maxTileSize = osg::Vec2f( 0.0f, 0.0f );
-			    _needsUpdate = false;
-			    _retilingNeeded = true;
-			}
 
-    osg::Vec2f		_envelopeOrigin;
-    osg::Vec2f		_envelopeSize;
-    osg::Vec2f		_smallestScale;
-    osg::Vec2f  	_maxTileSize;
-    bool		_needsUpdate;
-    bool		_retilingNeeded;
-};
+unsigned int Texture3DCache::nrCreated()
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+    return _nrCreated;
+}
 
 
-struct TextureInfo
+static Texture3DCache texture3DCache;
+
+
+unsigned int LayeredTexture::getNrShared3DTextures()
 {
-    				TextureInfo()
-				    : _isValid( false )
-				    , _contextId( -1 )
-				    , _nrUnits( 256 )
-				    , _maxSize( 65536 )
-				    , _nonPowerOf2Support( false )
-				    , _shadingSupport( false )
-				    , _floatSupport( false )
-				    , _nrVertexUnits( 256 )
-				{}
+    texture3DCache.prune();
+    return texture3DCache.nrTextures();
+}
 
-    bool			_isValid;
-    int				_contextId;
-    int				_nrUnits;
-    int				_maxSize;
-    bool			_nonPowerOf2Support;
-    bool			_shadingSupport;
-    bool			_floatSupport;
-    int				_nrVertexUnits;
-};
+
+unsigned int LayeredTexture::getNrCreated3DTextures()
+{ return texture3DCache.nrCreated(); }
 
 
 //============================================================================
@@ -680,6 +2397,7 @@ LayeredTexture::LayeredTexture()
     , _externalTexelSizeRatio( 1.0 )
     , _tilingInfo( new TilingInfo )
     , _texInfo( new TextureInfo )
+    , _resampleFilter( TriangleFilter )
     , _useNormalizedTexCoords( false )
     , _vertexOffsetLayerId( -1 )
     , _vertexOffsetChannel( 0 )
@@ -695,11 +2413,20 @@ LayeredTexture::LayeredTexture()
     , _maySkipEarlyProcesses( false )
     , _useShaders( false )
     , _enableMipmapping( true )
+    , _cpuMipmaps( false )
     , _compositeLayerUpdate( true )
     , _retileCompositeLayer( false )
+    , _updateCompositeRegion( false )
     , _reInitTiling( false )
+    , _nrRetilings( 0 )
+    , _nrTileSamplingUpdates( 0 )
+    , _nrTileImageRenewals( 0 )
     , _isOn( true )
     , _compositeSubsampleSteps( 1 )
+    , _compositeViewDependent( false )
+    , _compositeViewLevel( 0, 0 )
+    , _asyncCompositing( false )
+    , _compositeJob( 0 )
 {
     _id2idxTable.push_back( -1 );	// ID=0 used to represent ColSeqTexture
 
@@ -719,6 +2446,7 @@ LayeredTexture::LayeredTexture( const LayeredTexture& lt,
     , _externalTexelSizeRatio( lt._externalTexelSizeRatio )
     , _tilingInfo( new TilingInfo(*lt._tilingInfo) )
     , _texInfo( new TextureInfo(*lt._texInfo) )
+    , _resampleFilter( lt._resampleFilter )
     , _useNormalizedTexCoords( lt._useNormalizedTexCoords )
     , _vertexOffsetLayerId( lt._vertexOffsetLayerId )
     , _vertexOffsetChannel( lt._vertexOffsetChannel )
@@ -733,12 +2461,23 @@ LayeredTexture::LayeredTexture( const LayeredTexture& lt,
     , _maySkipEarlyProcesses( lt._maySkipEarlyProcesses )
     , _useShaders( lt._useShaders )
     , _enableMipmapping( lt._enableMipmapping )
+    , _cpuMipmaps( lt._cpuMipmaps )
     , _compositeLayerId( lt._compositeLayerId )
     , _compositeLayerUpdate( lt._compositeLayerUpdate )
     , _retileCompositeLayer( false )
+    , _updateCompositeRegion( false )
     , _reInitTiling( false )
+    , _nrRetilings( 0 )
+    , _nrTileSamplingUpdates( 0 )
+    , _nrTileImageRenewals( 0 )
     , _isOn( lt._isOn )
     , _compositeSubsampleSteps( lt._compositeSubsampleSteps )
+    , _compositeViewDependent( lt._compositeViewDependent )
+    , _compositeViewOrigin( lt._compositeViewOrigin )
+    , _compositeViewOpposite( lt._compositeViewOpposite )
+    , _compositeViewLevel( lt._compositeViewLevel )
+    , _asyncCompositing( lt._asyncCompositing )
+    , _compositeJob( 0 )
 {
     for ( unsigned int idx=0; idx<lt._dataLayers.size(); idx++ )
     {
@@ -760,6 +2499,8 @@ LayeredTexture::LayeredTexture( const LayeredTexture& lt,
 
 LayeredTexture::~LayeredTexture()
 {
+    cancelCompositeJob( false );
+
     std::for_each( _dataLayers.begin(), _dataLayers.end(),
 	    	   osg::intrusive_ptr_release );
 
@@ -768,6 +2509,9 @@ LayeredTexture::~LayeredTexture()
 
     delete _tilingInfo;
     delete _texInfo;
+    tileTextureCache.purge( this );
+
+    texture3DCache.prune();
 }
 
 
@@ -801,6 +2545,7 @@ void LayeredTexture::turnOn( bool yn )
 
 int LayeredTexture::addDataLayer()
 {
+    cancelCompositeJob();
     _lock.writeLock();
 
     unsigned int freeId = _id2idxTable.size();
@@ -857,6 +2602,7 @@ void LayeredTexture::removeDataLayer( int id )
     if ( id==_compositeLayerId )
 	return; 
 
+    cancelCompositeJob();
     _lock.writeLock();
     int idx = getDataLayerIndex( id );
     if ( idx!=-1 )
@@ -875,6 +2621,8 @@ void LayeredTexture::removeDataLayer( int id )
 		_releasedIds.push_back( id );
 	}
 
+	tileTextureCache.purge( this, id );
+
 	osg::ref_ptr<LayeredTextureData> ltd = _dataLayers[idx];
 	_dataLayers.erase( _dataLayers.begin()+idx );
 	setUpdateVar( _tilingInfo->_needsUpdate, true );
@@ -898,106 +2646,424 @@ int LayeredTexture::getDataLayerID( int idx ) const
 }
 
 
-int LayeredTexture::getDataLayerIndex( int id ) const
+int LayeredTexture::getDataLayerIndex( int id ) const
+{
+    return id>=0 && id<(int)_id2idxTable.size() ? _id2idxTable[id] : -1;
+}
+
+
+bool LayeredTexture::isDataLayerOK( int id ) const
+{
+    return getDataLayerImage( id );
+}
+
+
+int LayeredTexture::getTextureUnitNrDims( int unit ) const
+{
+    for ( unsigned int idx=0; unit>=0 && idx<_dataLayers.size(); idx++ )
+    {
+	if ( _dataLayers[idx]->_textureUnit==unit && _dataLayers[idx]->do3D() )
+	    return 3;
+    }
+
+    return 2;
+}
+
+
+int LayeredTexture::getTileParamsSize() const
+{
+    int size = 0;
+    for ( unsigned int idx=0; idx<_dataLayers.size(); idx++ )
+    {
+	const int unit = _dataLayers[idx]->_textureUnit;
+	if ( unit>=0 && !_dataLayers[idx]->do3D() && 2*unit+2>size )
+	    size = 2*unit + 2;
+    }
+
+    return size;
+}
+
+
+void LayeredTexture::addUnitParamsCode( std::string& code, int unit, bool texCrd, bool texSize, bool lod ) const
+{
+    char line[100];
+
+    bool isTiled = false;
+    for ( unsigned int idx=0; unit>=0 && idx<_dataLayers.size(); idx++ )
+    {
+	if ( _dataLayers[idx]->_textureUnit==unit && !_dataLayers[idx]->do3D() )
+	    isTiled = true;
+    }
+
+    if ( !isTiled )
+    {
+	const int nrDims = getTextureUnitNrDims( unit );
+	if ( texCrd )
+	{
+	    snprintf( line, 100, "uniform vec4 texcrdfactor%d;\n", unit );
+	    code += line;
+	    snprintf( line, 100, "uniform vec4 texcrdbias%d;\n", unit );
+	    code += line;
+	}
+	if ( texSize )
+	{
+	    snprintf( line, 100, "uniform vec%d texsize%d;\n", nrDims, unit );
+	    code += line;
+	}
+	if ( nrDims==3 && texSize )
+	{
+	    snprintf( line, 100, "uniform mat4 vertextrans%d;\n", unit );
+	    code += line;
+	}
+	if ( lod )
+	{
+	    snprintf( line, 100, "uniform float lod%d;\n", unit );
+	    code += line;
+	}
+	return;
+    }
+
+    // tileparams[2*unit] = (texsize,lod,offsetifudf)
+    // tileparams[2*unit+1] = (texcrdfactor,texcrdbias)
+
+    if ( texCrd )
+    {
+	snprintf( line, 100, "#define texcrdfactor%d vec4(tileparams[%d].xy,1.0,1.0)\n", unit, 2*unit+1 );
+	code += line;
+	snprintf( line, 100, "#define texcrdbias%d vec4(tileparams[%d].zw,0.0,0.0)\n", unit, 2*unit+1 );
+	code += line;
+    }
+    if ( texSize )
+    {
+	snprintf( line, 100, "#define texsize%d tileparams[%d].xy\n", unit, 2*unit );
+	code += line;
+    }
+    if ( lod )
+    {
+	snprintf( line, 100, "#define lod%d tileparams[%d].z\n", unit, 2*unit );
+	code += line;
+    }
+}
+
+
+void LayeredTexture::addAssignTexCrdLine( std::string& code, int unit ) const
+{
+    char line[50];
+
+    if ( getTextureUnitNrDims(unit)==3 )
+	snprintf( line, 50, "texcrd = (vertextrans%d*vertexpos).stp;\n", unit );
+    else
+	snprintf( line, 50, "texcrd = gl_TexCoord[%d].stp;\n", unit );
+
+    code += line;
+}
+
+
+void LayeredTexture::setDataLayerOrigin( int id, const osg::Vec2f& origin )
+{
+    const int idx = getDataLayerIndex( id );
+    if ( idx!=-1 )
+    {
+	triggerCancelBackgroundWork();
+	_dataLayers[idx]->_origin = origin; 
+	setUpdateVar( _tilingInfo->_needsUpdate, true );
+    }
+}
+
+
+void LayeredTexture::setDataLayerScale( int id, const osg::Vec2f& scale )
+{
+    const int idx = getDataLayerIndex( id );
+    if ( idx!=-1 && scale.x()>=0.0f && scale.y()>0.0f )
+    {
+	triggerCancelBackgroundWork();
+	_dataLayers[idx]->_scale = scale;
+	setUpdateVar( _tilingInfo->_needsUpdate, true );
+    }
+}
+
+
+static void permuteDimensions( osg::Image* image, ImageDataOrder dataOrder )
+{
+    if ( !image || dataOrder==STR )
+	return;
+
+    int sNew=0, tNew=0, rNew=0;
+
+    if ( dataOrder==SRT )
+    {
+	sNew = image->s(); tNew = image->r(); rNew = image->t();
+    }
+    else if ( dataOrder==TRS )
+    {
+	sNew = image->t(); tNew = image->r(); rNew = image->s();
+    }
+    else if ( dataOrder==TSR )
+    {
+	sNew = image->t(); tNew = image->s(); rNew = image->r();
+    }
+    else if ( dataOrder==RST )
+    {
+	sNew = image->r(); tNew = image->s(); rNew = image->t();
+    }
+    else if ( dataOrder==RTS )
+    {
+	sNew = image->r(); tNew = image->t(); rNew = image->s();
+    }
+
+    image->setImage( sNew, tNew, rNew, image->getInternalTextureFormat(), image->getPixelFormat(), image->getDataType(), image->data(), image->getAllocationMode(), image->getPacking(), image->getRowLength() );
+}
+
+
+static void permuteDimensionsBack( osg::Image* image, ImageDataOrder dataOrder )
+{
+    if ( dataOrder==TRS )
+	dataOrder = RST;
+    else if ( dataOrder==RST )
+	dataOrder = TRS;
+
+    permuteDimensions( image, dataOrder );
+
+}
+
+
+//============================================================================
+
+
+/* Gathers strided slices into STR order, in bands of rows per slice, for
+   parallelFor(.) */
+
+class ReorderTask : public ParallelForBody
+{
+public:
+		ReorderTask(const unsigned char* src,pixel_int xStep,
+			    pixel_int yStep,pixel_int zStep,unsigned char* dst,
+			    int xSize,int ySize,int nrSlices,int pixelSize);
+
+    size_t	nrItems() const		{ return size_t(_nrSlices)*_nrBands; }
+    void	run(size_t start,size_t stop);
+
+protected:
+
+    static const int	sBandSize = 32;
+
+    const unsigned char*	_src;
+    pixel_int			_xStep;
+    pixel_int			_yStep;
+    pixel_int			_zStep;
+    unsigned char*		_dst;
+    int				_xSize;
+    int				_ySize;
+    int				_nrSlices;
+    int				_nrBands;
+    int				_pixelSize;
+};
+
+
+ReorderTask::ReorderTask( const unsigned char* src, pixel_int xStep, pixel_int yStep, pixel_int zStep, unsigned char* dst, int xSize, int ySize, int nrSlices, int pixelSize )
+    : _src( src )
+    , _xStep( xStep )
+    , _yStep( yStep )
+    , _zStep( zStep )
+    , _dst( dst )
+    , _xSize( xSize )
+    , _ySize( ySize )
+    , _nrSlices( nrSlices )
+    , _nrBands( (ySize+sBandSize-1)/sBandSize )
+    , _pixelSize( pixelSize )
+{}
+
+
+void ReorderTask::run( size_t start, size_t stop )
+{
+    const pixel_int dstRowStep = pixel_int(_xSize) * _pixelSize;
+
+    for ( size_t idx=start; idx<stop; idx++ )
+    {
+	const int slice = int( idx/_nrBands );
+	const int y0 = int( idx%_nrBands ) * sBandSize;
+	const int nrRows = y0+sBandSize<_ySize ? sBandSize : _ySize-y0;
+
+	const unsigned char* src = _src + slice*_zStep + y0*_yStep;
+	unsigned char* dst = _dst + (pixel_int(slice)*_ySize+y0) * dstRowStep;
+
+	gatherPixels( src, _xStep, _yStep, dst, dstRowStep, _xSize, nrRows, _pixelSize );
+    }
+}
+
+
+/* In-place transpose of the nrSlices [ySize][xSize] matrices of pixels at
+   data. Uses one slice of scratch memory. */
+
+static void transposeSlices( unsigned char* data, int xSize, int ySize, int nrSlices, int pixelSize )
 {
-    return id>=0 && id<(int)_id2idxTable.size() ? _id2idxTable[id] : -1;
-}
+    const pixel_int sliceSize = pixel_int(xSize) * ySize * pixelSize;
+    std::vector<unsigned char> buffer( sliceSize );
 
+    for ( int slice=0; slice<nrSlices; slice++ )
+    {
+	unsigned char* slicePtr = data + slice*sliceSize;
+	memcpy( &buffer[0], slicePtr, sliceSize );
 
-bool LayeredTexture::isDataLayerOK( int id ) const
-{
-    return getDataLayerImage( id );
+	ReorderTask task( &buffer[0], pixel_int(xSize)*pixelSize, pixelSize, 0, slicePtr, ySize, xSize, 1, pixelSize );
+	parallelFor( task.nrItems(), task );
+    }
 }
 
 
-int LayeredTexture::getTextureUnitNrDims( int unit ) const
+/* In-place transpose of a [nrRows][nrCols] matrix of elements of elemSize
+   bytes by cycle following, for parallelFor(.). Cycles are disjoint, and
+   each is moved by the thread that owns its smallest element, so no shared
+   bookkeeping is needed. */
+
+class TransposeTask : public ParallelForBody
 {
-    for ( int idx=0; unit>=0 && idx<_dataLayers.size(); idx++ )
-    {
-	if ( _dataLayers[idx]->_textureUnit==unit && _dataLayers[idx]->do3D() )
-	    return 3;
-    }
+public:
+		TransposeTask(unsigned char* data,pixel_int nrRows,
+			      pixel_int nrCols,pixel_int elemSize)
+		    : _data( data )
+		    , _nrRows( nrRows )
+		    , _nrCols( nrCols )
+		    , _elemSize( elemSize )
+		{}
 
-    return 2;
-}
+    size_t	nrItems() const		{ return size_t(_nrRows*_nrCols); }
+    void	run(size_t start,size_t stop);
 
+protected:
 
-void LayeredTexture::addAssignTexCrdLine( std::string& code, int unit ) const
-{
-    char line[50];
+    // Element that ends up at idx in the transposed matrix
+    pixel_int	source(pixel_int idx) const
+		{ return (idx%_nrRows)*_nrCols + idx/_nrRows; }
 
-    if ( getTextureUnitNrDims(unit)==3 )
-	snprintf( line, 50, "texcrd = (vertextrans%d*vertexpos).stp;\n", unit );
-    else
-	snprintf( line, 50, "texcrd = gl_TexCoord[%d].stp;\n", unit );
+    bool	isCycleLeader(pixel_int idx) const;
 
-    code += line;
-}
+    unsigned char*	_data;
+    const pixel_int	_nrRows;
+    const pixel_int	_nrCols;
+    const pixel_int	_elemSize;
+};
 
 
-void LayeredTexture::setDataLayerOrigin( int id, const osg::Vec2f& origin )
+bool TransposeTask::isCycleLeader( pixel_int idx ) const
 {
-    const int idx = getDataLayerIndex( id );
-    if ( idx!=-1 )
+    for ( pixel_int cur=source(idx); cur!=idx; cur=source(cur) )
     {
-	_dataLayers[idx]->_origin = origin; 
-	setUpdateVar( _tilingInfo->_needsUpdate, true );
+	if ( cur<idx )
+	    return false;
     }
+
+    return true;
 }
 
 
-void LayeredTexture::setDataLayerScale( int id, const osg::Vec2f& scale )
+void TransposeTask::run( size_t start, size_t stop )
 {
-    const int idx = getDataLayerIndex( id );
-    if ( idx!=-1 && scale.x()>=0.0f && scale.y()>0.0f )
+    std::vector<unsigned char> carry( _elemSize );
+
+    for ( pixel_int first=start; first<pixel_int(stop); first++ )
     {
-	_dataLayers[idx]->_scale = scale;
-	setUpdateVar( _tilingInfo->_needsUpdate, true );
+	if ( source(first)==first || !isCycleLeader(first) )
+	    continue;
+
+	memcpy( &carry[0], _data+first*_elemSize, _elemSize );
+	pixel_int cur = first;
+
+	while ( true )
+	{
+	    const pixel_int src = source( cur );
+	    if ( src==first )
+	    {
+		memcpy( _data+cur*_elemSize, &carry[0], _elemSize );
+		break;
+	    }
+
+	    memcpy( _data+cur*_elemSize, _data+src*_elemSize, _elemSize );
+	    cur = src;
+	}
     }
 }
 
 
-static void permuteDimensions( osg::Image* image, ImageDataOrder dataOrder )
+static void transposeElements( unsigned char* data, pixel_int nrRows, pixel_int nrCols, pixel_int elemSize )
 {
-    if ( !image || dataOrder==STR )
+    if ( nrRows*nrCols<3 )
 	return;
 
-    int sNew=0, tNew=0, rNew=0;
+    TransposeTask task( data, nrRows, nrCols, elemSize );
+    parallelFor( task.nrItems(), task, 64 );
+}
 
-    if ( dataOrder==SRT )
-    {
-	sNew = image->s(); tNew = image->r(); rNew = image->t();
-    }
-    else if ( dataOrder==TRS )
-    {
-	sNew = image->t(); tNew = image->r(); rNew = image->s();
-    }
-    else if ( dataOrder==TSR )
+
+bool LayeredTexture::reorderImageData( osg::Image& image, ImageDataOrder dataOrder, bool inPlace )
+{
+    const int pixelSize = image.getPixelSizeInBits()/8;
+    if ( !image.data() || pixelSize<1 )
+	return false;
+
+    if ( image.getRowLength()>image.s() || image.getRowSizeInBytes()!=(unsigned int)(image.s()*pixelSize) )
     {
-	sNew = image->t(); tNew = image->s(); rNew = image->r();
+	std::cerr << "Cannot reorder image data with padded rows" << std::endl;
+	return false;
     }
-    else if ( dataOrder==RST )
+
+    permuteDimensions( &image, dataOrder );
+    if ( dataOrder==STR )
+	return true;
+
+    const int sizes[3] = { image.s(), image.t(), image.r() };
+
+    pixel_int steps[3];
+    getImageSteps( image, dataOrder, steps[0], steps[1], steps[2] );
+
+    if ( !inPlace )
     {
-	sNew = image->r(); tNew = image->s(); rNew = image->t();
+	unsigned char* newData = new unsigned char[image.getTotalSizeInBytes()];
+
+	ReorderTask task( image.data(), steps[0], steps[1], steps[2], newData, sizes[0], sizes[1], sizes[2], pixelSize );
+	parallelFor( task.nrItems(), task );
+
+	image.setImage( image.s(), image.t(), image.r(), image.getInternalTextureFormat(), image.getPixelFormat(), image.getDataType(), newData, osg::Image::USE_NEW_DELETE, image.getPacking() );
+	return true;
     }
-    else if ( dataOrder==RTS )
+
+    // Dimensions from fastest to slowest in memory
+    int order[3] = { 0, 1, 2 };
+    for ( int idx=0; idx<3; idx++ )
     {
-	sNew = image->r(); tNew = image->t(); rNew = image->s();
+	for ( int idy=2; idy>idx; idy-- )
+	{
+	    if ( steps[order[idy]]<steps[order[idy-1]] )
+		std::swap( order[idy], order[idy-1] );
+	}
     }
 
-    image->setImage( sNew, tNew, rNew, image->getInternalTextureFormat(), image->getPixelFormat(), image->getDataType(), image->data(), image->getAllocationMode(), image->getPacking(), image->getRowLength() );
-}
+    // Bubble the dimensions back to STR by swapping neighbours
+    for ( int pass=0; pass<2; pass++ )
+    {
+	for ( int idx=0; idx<2-pass; idx++ )
+	{
+	    if ( order[idx]<order[idx+1] )
+		continue;
 
+	    const int fast = sizes[order[0]];
+	    const int mid = sizes[order[1]];
+	    const int slow = sizes[order[2]];
 
-static void permuteDimensionsBack( osg::Image* image, ImageDataOrder dataOrder )
-{
-    if ( dataOrder==TRS )
-	dataOrder = RST;
-    else if ( dataOrder==RST )
-	dataOrder = TRS;
+	    if ( sizes[order[idx]]>1 && sizes[order[idx+1]]>1 )
+	    {
+		if ( idx==0 )
+		    transposeSlices( image.data(), fast, mid, slow, pixelSize );
+		else
+		    transposeElements( image.data(), slow, mid, pixel_int(fast)*pixelSize );
+	    }
 
-    permuteDimensions( image, dataOrder );
+	    std::swap( order[idx], order[idx+1] );
+	}
+    }
 
+    image.dirty();
+    return true;
 }
 
 
@@ -1007,6 +3073,11 @@ void LayeredTexture::setDataLayerImage( int id, osg::Image* image, bool freezewh
     if ( idx==-1 )
 	return;
 
+    if ( id!=_compositeLayerId )
+	cancelCompositeJob();
+    else
+	triggerCancelBackgroundWork();
+
     LayeredTextureData& layer = *_dataLayers[idx];
 
     if ( image || !freezewhile0 )
@@ -1022,18 +3093,54 @@ void LayeredTexture::setDataLayerImage( int id, osg::Image* image, bool freezewh
 	    return;
 	}
 
+	const MappedImage* mappedImage = dynamic_cast<const MappedImage*>( image );
+	if ( mappedImage )
+	{
+	    layer._declaredDataOrder = mappedImage->getDataOrder();
+	    if ( nrPowerChannels>0 )
+	    {
+		std::cerr << "Cannot encode base channel power of mapped image" << std::endl;
+		nrPowerChannels = 0;
+	    }
+	}
+
 	if ( nrPowerChannels>=0 )	// -1 = no need to update power channels
 	    layer._nrPowerChannels = encodeBaseChannelPower(*image,nrPowerChannels);
 
-	permuteDimensions( image, layer._imageDataOrder );
+	// Only unmodified data reordered before is no longer in declared order
+	const bool isReordered = image==layer._imageSource.get() && image->data()==layer._reorderedData && image->getModifiedCount()==layer._reorderedModifiedCount;
+
+	if ( isReordered )
+	    ;
+	else if ( layer._imageReorder!=KeepDataOrder && layer._declaredDataOrder!=STR && !mappedImage && reorderImageData(*image,layer._declaredDataOrder,layer._imageReorder==ReorderInPlace) )
+	{
+	    // Tiles can be views from now on
+	    layer._imageDataOrder = STR;
+	    layer._reorderedData = image->data();
+	    layer._reorderedModifiedCount = image->getModifiedCount();
+	}
+	else
+	{
+	    layer._imageDataOrder = layer._declaredDataOrder;
+	    layer._reorderedData = 0;
+	    permuteDimensions( image, layer._imageDataOrder );
+	}
+
 	Vec2i newImageSize( image->s(), image->t() );
 
 #ifdef USE_IMAGE_STRIDE
-	const bool retile = layer._imageSource.get()!=image || layer._imageSourceData!=image->data() || layer._imageSourceSize!=newImageSize || !layer._tileImages.size();
+	const bool retile = layer._imageSource.get()!=image || layer._imageSourceData!=image->data() || layer._imageSourceSize!=newImageSize || !layer._tileImages.size() || layer._hasCopiedTiles;
 #else
 	const bool retile = true;
 #endif
 
+	if ( retile )
+	    tileTextureCache.purge( this, id );
+
+	// Same layout keeps all cut-outs, so tiles only need the new texels
+	const osg::Image* oldSource = layer._imageSource.get();
+	const bool sameLayout = oldSource && layer._imageSourceSize==newImageSize && oldSource->r()==image->r() && oldSource->getPixelFormat()==image->getPixelFormat() && oldSource->getDataType()==image->getDataType();
+
 	layer._imageSource = image;
 	layer._imageSourceData = image->data();
 	layer._imageSourceSize = newImageSize;
@@ -1047,7 +3154,7 @@ void LayeredTexture::setDataLayerImage( int id, osg::Image* image, bool freezewh
 
 	if ( rescaleImage && !layer.do3D() && _textureSizePolicy!=AnySize && id!=_compositeLayerId )
 	{
-	    layer.rescaleImage( s, t, !retile );
+	    layer.rescaleImage( s, t, !retile, _resampleFilter );
 	    layer._imageScale.x() = float(image->s()) / float(s);
 	    layer._imageScale.y() = float(image->t()) / float(t);
 	}
@@ -1059,20 +3166,29 @@ void LayeredTexture::setDataLayerImage( int id, osg::Image* image, bool freezewh
 
 	layer._imageModifiedCount = image->getModifiedCount();
 	layer.clearTransparencyType();
+	layer.updateTexelSampler();
 
-	if ( retile || layer.do3D() )
+	if ( layer.do3D() || (retile && !sameLayout) )
 	{
 	    layer.adaptColors();
 	    setUpdateVar( _tilingInfo->_needsUpdate, true );
 	}
+	else if ( retile )
+	    setUpdateVar( layer._renewTileImages, true );
 	else
 	    setUpdateVar( layer._dirtyTileImages, true );
+
+	// Texture size of 3D layers is a setup uniform
+	if ( layer.do3D() )
+	    setUpdateVar( _updateSetupStateSet, true );
     }
     else if ( layer._image )
     {
+	tileTextureCache.purge( this, id );
 	layer._image = 0; 
 	layer._imageSource = 0;
 	layer._nrPowerChannels = 0;
+	layer.updateTexelSampler();
 	layer.adaptColors();
 	setUpdateVar( _tilingInfo->_needsUpdate, true );
     }
@@ -1084,6 +3200,7 @@ void LayeredTexture::setDataLayerUndefLayerID( int id, int undefId )
     const int idx = getDataLayerIndex( id );
     if ( idx!=-1 )
     {
+	triggerCancelBackgroundWork();
 	raiseUndefChannelRefCount( false, idx );
 
 	setUpdateVar( _updateSetupStateSet, true );
@@ -1099,6 +3216,7 @@ void LayeredTexture::setDataLayerUndefChannel( int id, int channel )
     const int idx = getDataLayerIndex( id );
     if ( idx!=-1 && channel>=0 && channel<4 )
     {
+	triggerCancelBackgroundWork();
 	raiseUndefChannelRefCount( false, idx );
 
 	setUpdateVar( _updateSetupStateSet, true );
@@ -1135,6 +3253,7 @@ void LayeredTexture::setDataLayerBorderColor( int id, const osg::Vec4f& col )
     const int idx = getDataLayerIndex( id );
     if ( idx!=-1 )
     {
+	triggerCancelBackgroundWork();
 	_dataLayers[idx]->_borderColorSource = osg::Vec4f(-1.0f,-1.0f,-1.0f,-1.0f);
 	if ( col[0]>=0.0f && col[1]>=0.0f && col[2]>=0.0f && col[3]>=0.0f )
 	{
@@ -1145,8 +3264,14 @@ void LayeredTexture::setDataLayerBorderColor( int id, const osg::Vec4f& col )
 	}
 
 	_dataLayers[idx]->adaptColors();
-	if ( _dataLayers[idx]->_textureUnit>=0 )
+	if ( _dataLayers[idx]->_textureUnit<0 )
+	    return;
+
+	// Border of the stack undef layer decides on undefined cut-outs
+	if ( _dataLayers[idx]->do3D() || id==_stackUndefLayerId )
 	    setUpdateVar( _tilingInfo->_retilingNeeded, true );
+	else
+	    setUpdateVar( _dataLayers[idx]->_dirtyTileSampling, true );
     }
 }
 
@@ -1156,9 +3281,16 @@ void LayeredTexture::setDataLayerFilterType( int id, FilterType filterType )
     const int idx = getDataLayerIndex( id );
     if ( idx!=-1 )
     {
+	triggerCancelBackgroundWork();
 	_dataLayers[idx]->_filterType = filterType;
-	if ( _dataLayers[idx]->_textureUnit>=0 )
+	if ( _dataLayers[idx]->_textureUnit<0 )
+	    return;
+
+	// Tiles of 2D layers keep their image
+	if ( _dataLayers[idx]->do3D() )
 	    setUpdateVar( _tilingInfo->_retilingNeeded, true );
+	else
+	    setUpdateVar( _dataLayers[idx]->_dirtyTileSampling, true );
     }
 }
 
@@ -1179,15 +3311,37 @@ void LayeredTexture::setDataLayerImageOrder( int id, ImageDataOrder dataOrder )
 
     LayeredTextureData* layer = _dataLayers[idx];
 
-    if ( layer->_imageDataOrder!=dataOrder )
+    if ( layer->_declaredDataOrder!=dataOrder )
     {
+	cancelCompositeJob();
 	permuteDimensionsBack( layer->_imageSource, layer->_imageDataOrder );
-	layer->_imageDataOrder = dataOrder;
+	layer->_declaredDataOrder = dataOrder;
 	setDataLayerImage( id, layer->_imageSource, false, -1 );
     }
 }
 
 
+void LayeredTexture::setDataLayerImageReorder( int id, ImageReorder reorder )
+{
+    const int idx = getDataLayerIndex( id );
+    if ( idx==-1 )
+	return;
+
+    LayeredTextureData* layer = _dataLayers[idx];
+
+    if ( layer->_imageReorder!=reorder )
+    {
+	layer->_imageReorder = reorder;
+	if ( reorder!=KeepDataOrder && layer->_imageDataOrder!=STR && layer->_imageSource.get() )
+	{
+	    cancelCompositeJob();
+	    permuteDimensionsBack( layer->_imageSource, layer->_imageDataOrder );
+	    setDataLayerImage( id, layer->_imageSource, false, -1 );
+	}
+    }
+}
+
+
 void LayeredTexture::setDataLayerSliceNr( int id, int nr )
 {
     if ( nr<0 ) nr=0;
@@ -1195,12 +3349,15 @@ void LayeredTexture::setDataLayerSliceNr( int id, int nr )
     const int idx = getDataLayerIndex( id );
     if ( idx!=-1 && _dataLayers[idx]->_sliceNr!=nr )
     {
+	cancelCompositeJob();
 	_dataLayers[idx]->_sliceNr = nr;
 	if ( _dataLayers[idx]->hasRescaledImage() )
 	{
 	    osg::Image* image = _dataLayers[idx]->_image;
 	    _dataLayers[idx]->rescaleImage( image->s(), image->t() );
 	}
+	else
+	    _dataLayers[idx]->updateTexelSampler();
 	if ( _dataLayers[idx]->_textureUnit>=0 )
 	    setUpdateVar( _tilingInfo->_retilingNeeded, true );
     }
@@ -1215,6 +3372,9 @@ void LayeredTexture::setDataLayerVertex2TextureTransform( int id, const osg::Mat
 
     const bool did3D = _dataLayers[idx]->do3D();
 
+     // Background tiling may still read the transform to be deleted
+     triggerCancelBackgroundWork();
+
      if ( _dataLayers[idx]->_vertex2TextureTrans )
 	 delete _dataLayers[idx]->_vertex2TextureTrans;
 
@@ -1223,6 +3383,9 @@ void LayeredTexture::setDataLayerVertex2TextureTransform( int id, const osg::Mat
      if ( did3D != _dataLayers[idx]->do3D() )
 	setDataLayerImage( id, _dataLayers[idx]->_imageSource, false, -1 );
 
+     if ( did3D || _dataLayers[idx]->do3D() )
+	setUpdateVar( _updateSetupStateSet, true );
+
      setUpdateVar( _tilingInfo->_needsUpdate, true );
 }
 
@@ -1499,7 +3662,8 @@ GET_PROP( BorderColor, const osg::Vec4f&, _borderColor, osg::Vec4f(1.0f,1.0f,1.0
 GET_PROP( ImageUndefColor, const osg::Vec4f&, _undefColor, osg::Vec4f(-1.0f,-1.0f,-1.0f,-1.0f) )
 GET_PROP( SliceNr, int, _sliceNr, -1 )
 GET_PROP( Vertex2TextureTransform, const osg::Matrixf*, _vertex2TextureTrans, 0 );
-GET_PROP( ImageOrder, ImageDataOrder, _imageDataOrder, STR )
+GET_PROP( ImageOrder, ImageDataOrder, _declaredDataOrder, STR )
+GET_PROP( ImageReorder, ImageReorder, _imageReorder, KeepDataOrder )
 
 
 TransparencyType LayeredTexture::getDataLayerTransparencyType( int id, int channel ) const
@@ -1508,11 +3672,7 @@ TransparencyType LayeredTexture::getDataLayerTransparencyType( int id, int chann
     if ( idx==-1 || channel<0 || channel>3 || !_dataLayers[idx]->_image )
 	return FullyTransparent;
 
-    TransparencyType& tt = _dataLayers[idx]->_transparency[channel];
-
-    if ( tt==TransparencyUnknown )
-	tt = getImageTransparencyType( _dataLayers[idx]->_image, channel );
-
+    const TransparencyType tt = _dataLayers[idx]->getTransparencyType( channel );
     return addOpacity( tt, _dataLayers[idx]->_borderColor[channel] );
 }
 
@@ -1527,6 +3687,23 @@ osg::Vec4f LayeredTexture::getDataLayerTextureVec( int id, const osg::Vec2f& glo
 }
 
 
+void LayeredTexture::getDataLayerTextureSpan( int id, float globalY, const float* globalX, int nrPixels, float* const* channels ) const
+{
+    const int idx = getDataLayerIndex( id );
+    if ( idx!=-1 )
+    {
+	_dataLayers[idx]->getTextureSpan( globalY, globalX, nrPixels, channels );
+	return;
+    }
+
+    for ( int ch=0; ch<4; ch++ )
+    {
+	if ( channels[ch] )
+	    std::fill( channels[ch], channels[ch]+nrPixels, -1.0f );
+    }
+}
+
+
 LayerProcess* LayeredTexture::getProcess( int idx )
 { return idx>=0 && idx<(int) _processes.size() ? _processes[idx] : 0;  }
 
@@ -1541,6 +3718,7 @@ void LayeredTexture::addProcess( LayerProcess* process )
 	return;
 
     process->ref();
+    cancelCompositeJob();
     _lock.writeLock();
     _processes.push_back( process );
     setUpdateVar( _updateSetupStateSet, true );
@@ -1550,6 +3728,7 @@ void LayeredTexture::addProcess( LayerProcess* process )
 
 void LayeredTexture::removeProcess( const LayerProcess* process )
 {
+    cancelCompositeJob();
     _lock.writeLock();
     std::vector<LayerProcess*>::iterator it = std::find( _processes.begin(),
 	    					    _processes.end(), process );
@@ -1566,6 +3745,7 @@ void LayeredTexture::removeProcess( const LayerProcess* process )
 #define MOVE_LAYER( func, cond, inc ) \
 void LayeredTexture::func( const LayerProcess* process ) \
 { \
+    cancelCompositeJob(); \
     _lock.writeLock(); \
     std::vector<LayerProcess*>::iterator it = std::find( _processes.begin(), \
 	    					    _processes.end(), process);\
@@ -1585,6 +3765,19 @@ MOVE_LAYER( moveProcessEarlier, it!=_processes.begin(), -1 )
 MOVE_LAYER( moveProcessLater, neighbor!=_processes.end(), +1 )
 
 
+void LayeredTexture::assumeTextureInfo( int maxSize, int nrUnits, bool shadingSupport )
+{
+    _texInfo->_isValid = true;
+    _texInfo->_maxSize = maxSize;
+    _texInfo->_nrUnits = nrUnits;
+    _texInfo->_nrVertexUnits = nrUnits;
+    _texInfo->_nonPowerOf2Support = true;
+    _texInfo->_shadingSupport = shadingSupport;
+    _texInfo->_floatSupport = true;
+    setUpdateVar( _tilingInfo->_retilingNeeded, true );
+}
+
+
 void LayeredTexture::setGraphicsContextID( int id )
 {
     _texInfo->_contextId = id;
@@ -1787,13 +3980,21 @@ bool LayeredTexture::needsRetiling() const
     if ( isDisplayFrozen() )
 	return false;
 
-    std::vector<LayeredTextureData*>::const_iterator lit = _dataLayers.begin();
-    for ( ; lit!=_dataLayers.end(); lit++ )
-	(*lit)->updateTileImagesIfNeeded();
-
     updateTilingInfoIfNeeded();
     updateTextureInfoIfNeeded();
 
+    _undefCutoutLock.lock();
+    const bool undefinedCutouts = _tilingInfo->_undefinedCutouts;
+    const UndefCutoutState undefCutoutState = _tilingInfo->_undefCutoutState;
+    _undefCutoutLock.unlock();
+
+    if ( undefinedCutouts )
+    {
+	UndefCutoutState state;
+	if ( !getUndefCutoutState(state) || !(state==undefCutoutState) )
+	    const_cast<LayeredTexture*>(this)->setUpdateVar( _tilingInfo->_retilingNeeded, true );
+    }
+
     return _tilingInfo->_retilingNeeded || _retileCompositeLayer;
 }
 
@@ -1833,28 +4034,188 @@ int LayeredTexture::maxTextureSize() const
 }
 
 
-int LayeredTexture::nrTextureUnits() const
-{
-    updateTextureInfoIfNeeded();
-    return _texInfo->_isValid ? _texInfo->_nrUnits : -1;
+int LayeredTexture::nrTextureUnits() const
+{
+    updateTextureInfoIfNeeded();
+    return _texInfo->_isValid ? _texInfo->_nrUnits : -1;
+}
+
+
+void LayeredTexture::reInitTiling( float texelSizeRatio )
+{
+    // Another node sharing this texture may have retiled it already
+    if ( _nrRetilings>0 && !isDisplayFrozen() && !needsRetiling() &&
+	 texelSizeRatio==_externalTexelSizeRatio )
+	return;
+
+    // Tiling jobs of other nodes sharing this texture still use its tiles
+    triggerCancelBackgroundWork();
+
+    _reInitTiling = true;
+    updateTilingInfoIfNeeded();
+    updateTextureInfoIfNeeded();
+    assignTextureUnits();
+
+    _tileRegistrationLock.lock();
+    std::vector<LayeredTextureData*>::iterator lit = _dataLayers.begin();
+    for ( ; lit!=_dataLayers.end(); lit++ )
+	(*lit)->cleanUp();
+    _tileRegistrationLock.unlock();
+
+    setUpdateVar( _tilingInfo->_retilingNeeded, false );
+    setUpdateVar( _retileCompositeLayer, false );
+    _undefCutoutLock.lock();
+    _tilingInfo->_undefinedCutouts = false;
+    _undefCutoutLock.unlock();
+    _externalTexelSizeRatio = texelSizeRatio; 
+    _reInitTiling = false;
+    _nrRetilings++;
+}
+
+
+/* Cached tile textures may be shared with other layered textures, so their
+   sampling state or image is only changed in a copy that replaces them in
+   the cut-out. Cut-outs sharing a tile texture keep sharing its copy. */
+
+typedef std::map<const osg::Texture2D*,osg::ref_ptr<osg::Texture2D> > TileTextureCopyMap;
+
+static osg::Texture2D& copyTileTexture( LayeredTextureData::TileTexture& tile, TileTextureCopyMap& copies )
+{
+    osg::ref_ptr<osg::Texture2D>& copy = copies[tile._texture.get()];
+    if ( !copy )
+	copy = new osg::Texture2D( *tile._texture, osg::CopyOp::SHALLOW_COPY );
+
+    osg::ref_ptr<osg::StateSet> stateset;
+    if ( tile._stateset.lock(stateset) )
+	stateset->setTextureAttributeAndModes( tile._unit, copy.get() );
+
+    tile._texture = copy;
+    return *copy;
+}
+
+
+void LayeredTexture::updateTileTexturesIfNeeded( LayeredTextureData& layer )
+{
+    if ( layer._renewTileImages )
+    {
+	layer._renewTileImages = false;
+	if ( renewTileImages(layer) )
+	    _nrTileImageRenewals++;
+	else
+	    setUpdateVar( _tilingInfo->_retilingNeeded, true );
+    }
+
+    if ( !layer._dirtyTileSampling )
+	return;
+
+    layer._dirtyTileSampling = false;
+
+    // Cached tiles are keyed by their former sampling state
+    tileTextureCache.purge( this, layer._id );
+
+    const int idx = getDataLayerIndex( layer._id );
+    const float maxAnisotropy = osg::maximum( getMaxAnisotropy(idx), 1.0f );
+
+    const osg::Texture::FilterMode magFilter = layer._filterType==Nearest ? osg::Texture::NEAREST : osg::Texture::LINEAR;
+    osg::Texture::FilterMode minFilter = magFilter;
+    if ( _enableMipmapping )
+	minFilter = layer._filterType==Nearest ? osg::Texture::NEAREST_MIPMAP_NEAREST : osg::Texture::LINEAR_MIPMAP_LINEAR;
+
+    TileTextureCopyMap copies;
+    std::vector<LayeredTextureData::TileTexture>::iterator it = layer._tileTextures.begin();
+    for ( ; it!=layer._tileTextures.end(); it++ )
+    {
+	osg::Texture2D& texture = copyTileTexture( *it, copies );
+
+	osg::Texture::WrapMode xWrapMode = osg::Texture::CLAMP_TO_EDGE;
+	if ( layer._borderColor[0]>=0.0f && it->_hasBorderArea.x() )
+	    xWrapMode = osg::Texture::CLAMP_TO_BORDER;
+
+	osg::Texture::WrapMode yWrapMode = osg::Texture::CLAMP_TO_EDGE;
+	if ( layer._borderColor[0]>=0.0f && it->_hasBorderArea.y() )
+	    yWrapMode = osg::Texture::CLAMP_TO_BORDER;
+
+	texture.setWrap( osg::Texture::WRAP_S, xWrapMode );
+	texture.setWrap( osg::Texture::WRAP_T, yWrapMode );
+	texture.setMaxAnisotropy( maxAnisotropy );
+	texture.setFilter( osg::Texture::MAG_FILTER, magFilter );
+	texture.setFilter( osg::Texture::MIN_FILTER, minFilter );
+	texture.setBorderColor( layer._borderColor );
+    }
+
+    _nrTileSamplingUpdates++;
+}
+
+
+bool LayeredTexture::renewTileImages( LayeredTextureData& layer )
+{
+    osg::Image* image = layer._image.get();
+    if ( !image )
+	return layer._tileTextures.empty();
+
+    // New texels may no longer be constant
+    if ( layer._hasConstantTiles )
+	return false;
+
+    std::vector<LayeredTextureData::TileTexture>::const_iterator it = layer._tileTextures.begin();
+    for ( ; it!=layer._tileTextures.end(); it++ )
+    {
+	if ( !it->_renewable || it->_sliceNr>=image->r() )
+	    return false;
+
+	for ( int dim=0; dim<=1; dim++ )
+	{
+	    const int size = dim ? image->t() : image->s();
+	    if ( it->_origin[dim]+it->_size[dim] > size )
+		return false;
+	}
+    }
+
+    std::vector<osg::Image*>::iterator iit = layer._tileImages.begin();
+    for ( ; iit!=layer._tileImages.end(); iit++ )
+	(*iit)->unref();
+
+    layer._tileImages.clear();
+    layer._hasCopiedTiles = false;
+
+    TileTextureCopyMap copies;
+    std::vector<LayeredTextureData::TileTexture>::iterator tit = layer._tileTextures.begin();
+    for ( ; tit!=layer._tileTextures.end(); tit++ )
+    {
+	const bool isCopied = copies.find( tit->_texture.get() )!=copies.end();
+	osg::Texture2D& texture = copyTileTexture( *tit, copies );
+	if ( isCopied )
+	    continue;
+
+	osg::ref_ptr<osg::Image> tileImage = new osg::Image;
+	if ( !texture.getResizeNonPowerOfTwoHint() && setImageTileView(*image,*tileImage,tit->_origin,tit->_size,tit->_sliceNr,tit->_dataOrder) )
+	{
+	    tileImage->ref();
+	    layer._tileImages.push_back( tileImage );
+	}
+	else
+	{
+	    copyImageTile( *image, *tileImage, tit->_origin, tit->_size, tit->_sliceNr, tit->_dataOrder );
+	    layer._hasCopiedTiles = true;
+	}
+
+	texture.setImage( tileImage.get() );
+    }
+
+    return true;
 }
 
 
-void LayeredTexture::reInitTiling( float texelSizeRatio )
-{
-    _reInitTiling = true;
-    updateTilingInfoIfNeeded();
-    updateTextureInfoIfNeeded();
-    assignTextureUnits();
+int LayeredTexture::getNrRetilings() const
+{ return _nrRetilings; }
 
-    std::vector<LayeredTextureData*>::iterator lit = _dataLayers.begin();
-    for ( ; lit!=_dataLayers.end(); lit++ )
-	(*lit)->cleanUp();
 
-    setUpdateVar( _tilingInfo->_retilingNeeded, false );
-    _externalTexelSizeRatio = texelSizeRatio; 
-    _reInitTiling = false;
-}
+int LayeredTexture::getNrTileSamplingUpdates() const
+{ return _nrTileSamplingUpdates; }
+
+
+int LayeredTexture::getNrTileImageRenewals() const
+{ return _nrTileImageRenewals; }
 
 
 void LayeredTexture::setAnisotropicPower( int power )
@@ -1865,7 +4226,10 @@ void LayeredTexture::setAnisotropicPower( int power )
     if ( power!=_anisotropicPower )
     {
 	_anisotropicPower = power;
-	setUpdateVar( _tilingInfo->_retilingNeeded, true );
+
+	std::vector<LayeredTextureData*>::iterator it = _dataLayers.begin();
+	for ( ; it!=_dataLayers.end(); it++ )
+	    setUpdateVar( (*it)->_dirtyTileSampling, true );
     }
 }
 
@@ -2057,7 +4421,48 @@ osg::Vec2 LayeredTexture::tilingPlanResolution() const
 }
 
 
-osg::StateSet* LayeredTexture::createCutoutStateSet( const osg::Vec2f& origin, const osg::Vec2f& opposite, std::vector<LayeredTexture::TextureCoordData>& tcData, const VertexOffsetCutoutInfo* vertexOffsetInfo ) const
+// Resolution levels of a layer coarser than the tiling plan resolution
+
+static int getResolutionLevelShift( const LayeredTextureData& layer, const osg::Vec2f& smallestScale )
+{
+    const float xRatio = layer._scale.x()*layer._imageScale.x() / smallestScale.x();
+    const float yRatio = layer._scale.y()*layer._imageScale.y() / smallestScale.y();
+    const float ratio = xRatio<yRatio ? xRatio : yRatio;
+
+    const int shift = (int) floor( log(ratio)/log(2.0f) + EPS );
+    return shift>0 ? shift : 0;
+}
+
+
+int LayeredTexture::getMaxResolutionLevel() const
+{
+    int maxLevel = -1;
+
+    for ( int idx=0; idx<nrDataLayers(); idx++ )
+    {
+	const LayeredTextureData* layer = _dataLayers[idx];
+	const osg::Image* image = layer->_image.get();
+	if ( layer->_textureUnit<0 || layer->do3D() || !image || !image->s() || !image->t() )
+	    continue;
+
+	int nrComponents;
+	if ( !getMipmapComponents(*image,nrComponents) )
+	    return 0;
+
+	int nrLevels = 0;
+	while ( (image->s()>>nrLevels)>1 || (image->t()>>nrLevels)>1 )
+	    nrLevels++;
+
+	nrLevels += getResolutionLevelShift( *layer, _tilingInfo->_smallestScale );
+	if ( maxLevel<0 || nrLevels<maxLevel )
+	    maxLevel = nrLevels;
+    }
+
+    return maxLevel>0 ? maxLevel : 0;
+}
+
+
+osg::StateSet* LayeredTexture::createCutoutStateSet( const osg::Vec2f& origin, const osg::Vec2f& opposite, std::vector<LayeredTexture::TextureCoordData>& tcData, const VertexOffsetCutoutInfo* vertexOffsetInfo, int resolutionLevel ) const
 {
     tcData.clear();
     osg::ref_ptr<osg::StateSet> stateset = new osg::StateSet;
@@ -2071,6 +4476,10 @@ osg::StateSet* LayeredTexture::createCutoutStateSet( const osg::Vec2f& origin, c
 			       smallestScale.y() * (opposite.y()+0.5) );
     globalOpposite += _tilingInfo->_envelopeOrigin;
 
+    const bool isUndefined = isCutoutUndefined( globalOrigin, globalOpposite );
+
+    std::vector<osg::Vec4f> tileParams( getTileParamsSize(), osg::Vec4f(0.0f,0.0f,0.0f,0.0f) );
+
     for ( int idx=nrDataLayers()-1; idx>=0; idx-- )
     {
 	LayeredTextureData* layer = _dataLayers[idx];
@@ -2083,13 +4492,36 @@ osg::StateSet* LayeredTexture::createCutoutStateSet( const osg::Vec2f& origin, c
 	    continue;
 	}
 
-	const osg::Vec2f localOrigin = layer->getLayerCoord( globalOrigin );
-	const osg::Vec2f localOpposite = layer->getLayerCoord( globalOpposite );
+	osg::Vec2f localOrigin = layer->getLayerCoord( globalOrigin );
+	osg::Vec2f localOpposite = layer->getLayerCoord( globalOpposite );
 
-	osg::Image* image = layer->_image;
+	osg::ref_ptr<osg::Image> image = layer->_image;
 	if ( !image || !image->s() || !image->t() )
 	    continue;
 
+	int level = 0;
+	if ( resolutionLevel>0 )
+	    level = resolutionLevel - getResolutionLevelShift( *layer, smallestScale );
+
+	int nrMipComponents = 0;
+	std::vector<osg::ref_ptr<osg::Image> > mipPyramid;
+	if ( level>0 || (_enableMipmapping && _cpuMipmaps && !isUndefined) )
+	    layer->getMipPyramid( mipPyramid, nrMipComponents );
+
+	const bool hasMipPyramid = !mipPyramid.empty();
+	if ( level>int(mipPyramid.size()) )
+	    level = mipPyramid.size();
+
+	// Coarse cut-outs are taken from a pyramid level in its own pixels
+	if ( level>0 )
+	{
+	    const float factor = 1 << level;
+	    localOrigin /= factor;
+	    localOpposite /= factor;
+	    image = mipPyramid[level-1];
+	    mipPyramid.erase( mipPyramid.begin(), mipPyramid.begin()+level );
+	}
+
 	const Vec2i imageSize( image->s(), image->t() );
 	Vec2i hasBorderArea, tileOrigin, tileSize;
 
@@ -2191,44 +4623,114 @@ osg::StateSet* LayeredTexture::createCutoutStateSet( const osg::Vec2f& origin, c
 	    sliceNr = image->r()-1;
 
 	ImageDataOrder dataOrder( STR );
-	if ( !layer->hasRescaledImage() ) 
+	if ( !layer->hasRescaledImage() && !level ) 
 	    dataOrder = layer->_imageDataOrder;
 
-	osg::ref_ptr<osg::Image> tileImage = new osg::Image;
+	osg::Texture::WrapMode xWrapMode = osg::Texture::CLAMP_TO_EDGE;
+	if ( layer->_borderColor[0]>=0.0f && hasBorderArea.x() )
+	    xWrapMode = osg::Texture::CLAMP_TO_BORDER;
 
-#ifdef USE_IMAGE_STRIDE
-	// OpenGL crashes when resizing image with stride
-	if ( (dataOrder==STR || dataOrder==SRT) && !resizeHint )
+	osg::Texture::WrapMode yWrapMode = osg::Texture::CLAMP_TO_EDGE;
+	if ( layer->_borderColor[0]>=0.0f && hasBorderArea.y() )
+	    yWrapMode = osg::Texture::CLAMP_TO_BORDER;
+
+	const osg::Texture::FilterMode magFilter = layer->_filterType==Nearest ? osg::Texture::NEAREST : osg::Texture::LINEAR;
+	osg::Texture::FilterMode minFilter = magFilter;
+	if ( _enableMipmapping )
+	    minFilter = layer->_filterType==Nearest ? osg::Texture::NEAREST_MIPMAP_NEAREST : osg::Texture::LINEAR_MIPMAP_LINEAR;
+
+	TileCacheKey key;
+	key._layerId = layer->_id;
+	key._image = image.get();
+	key._data = image->data();
+	key._modifiedCount = layer->_imageModifiedCount;
+	key._origin = tileOrigin;
+	key._size = tileSize;
+	key._sliceNr = sliceNr;
+	key._dataOrder = dataOrder;
+	key._resizeHint = resizeHint;
+	key._wrapS = xWrapMode;
+	key._wrapT = yWrapMode;
+	key._minFilter = minFilter;
+	key._magFilter = magFilter;
+	key._maxAnisotropy = osg::maximum( getMaxAnisotropy(idx), 1.0f );
+	key._borderColor = layer->_borderColor;
+
+	key._cpuMipmaps = _enableMipmapping && _cpuMipmaps && !resizeHint && !isUndefined && hasMipPyramid;
+
+	bool isView = false;
+	osg::ref_ptr<osg::Texture2D> texture;
+
+	// Constant tiles look the same from any texel, unless sampling border
+	bool isConstant = false;
+	if ( !isUndefined && !level && !resizeHint && !hasBorderArea.x() && !hasBorderArea.y() )
 	{
-	    unsigned char* dataOrigin = image->data(tileOrigin.x(),tileOrigin.y(),sliceNr);
-	    int rowLength = image->s();
+	    osg::Vec4f min, max;
+	    isConstant = layer->getValueRange(tileOrigin,tileSize,min,max) && min==max;
+	}
+
+	// Shader ignores all layers where stack undef layer reads one
+	if ( isUndefined )
+	    texture = tileTextureCache.getConstantTexture( _invertUndefLayers ? 0 : 255 );
+	else if ( isConstant )
+	{
+	    osg::ref_ptr<osg::Image> texel = new osg::Image;
+	    copyImageTile( *image, *texel, tileOrigin, Vec2i(1,1), sliceNr, dataOrder );
+	    texture = tileTextureCache.getTexelTexture( *texel );
+
+	    // Forces retiling when the texels change
+	    _tileRegistrationLock.lock();
+	    layer->_hasConstantTiles = true;
+	    layer->_hasCopiedTiles = true;
+	    _tileRegistrationLock.unlock();
+	}
+	else
+	    texture = tileTextureCache.find( key, isView );
 
-	    if ( dataOrder==SRT )
+	if ( isUndefined || isConstant )
+	    ;
+	else if ( texture )
+	{
+	    // Tile views need to be dirtied by partial image updates again
+	    if ( isView )
 	    {
-		dataOrigin = image->data(tileOrigin.x(),sliceNr,0);
-		rowLength *= image->r();
-		dataOrigin += tileOrigin.y() * rowLength * image->getPixelSizeInBits()/8;
+		texture->getImage()->ref();
+		_tileRegistrationLock.lock();
+		layer->_tileImages.push_back( texture->getImage() );
+		_tileRegistrationLock.unlock();
 	    }
-
-	    tileImage->setUserData( image );
-	    tileImage->setImage( tileSize.x(), tileSize.y(), 1, image->getInternalTextureFormat(), image->getPixelFormat(), image->getDataType(), dataOrigin, osg::Image::NO_DELETE, image->getPacking(), rowLength ); 
-
-	    tileImage->ref();
-	    const_cast<LayeredTexture*>(this)->_lock.writeLock();
-	    layer->_tileImages.push_back( tileImage );
-	    const_cast<LayeredTexture*>(this)->_lock.writeUnlock();
 	}
 	else
-#endif
-	    copyImageTile( *image, *tileImage, tileOrigin, tileSize, sliceNr, dataOrder );
-
-	osg::Texture::WrapMode xWrapMode = osg::Texture::CLAMP_TO_EDGE;
-	if ( layer->_borderColor[0]>=0.0f && hasBorderArea.x() )
-	    xWrapMode = osg::Texture::CLAMP_TO_BORDER;
+	{
+	    osg::ref_ptr<osg::Image> tileImage = new osg::Image;
 
-	osg::Texture::WrapMode yWrapMode = osg::Texture::CLAMP_TO_EDGE;
-	if ( layer->_borderColor[0]>=0.0f && hasBorderArea.y() )
-	    yWrapMode = osg::Texture::CLAMP_TO_BORDER;
+	    if ( key._cpuMipmaps )
+		tileImage = createMipmappedTile( *image, dataOrder, sliceNr, tileOrigin, tileSize, mipPyramid, nrMipComponents );
+	    // OpenGL crashes when resizing image with stride. Pyramid levels
+	    // are replaced rather than modified, so views would not be dirtied
+	    else if ( !resizeHint && !level && setImageTileView(*image,*tileImage,tileOrigin,tileSize,sliceNr,dataOrder) )
+	    {
+		isView = true;
+		tileImage->ref();
+		_tileRegistrationLock.lock();
+		layer->_tileImages.push_back( tileImage );
+		_tileRegistrationLock.unlock();
+	    }
+	    else
+		copyImageTile( *image, *tileImage, tileOrigin, tileSize, sliceNr, dataOrder );
+
+	    texture = new osg::Texture2D( tileImage.get() );
+	    texture->setResizeNonPowerOfTwoHint( resizeHint );
+	    texture->setWrap( osg::Texture::WRAP_S, xWrapMode );
+	    texture->setWrap( osg::Texture::WRAP_T, yWrapMode );
+	    texture->setMaxAnisotropy( key._maxAnisotropy );
+	    texture->setFilter( osg::Texture::MAG_FILTER, magFilter );
+	    texture->setFilter( osg::Texture::MIN_FILTER, minFilter );
+	    texture->setBorderColor( layer->_borderColor );
+	    texture->setUseHardwareMipMapGeneration( !key._cpuMipmaps );
+
+	    tileTextureCache.insert( key, texture.get(), image.get(), isView, this );
+	}
 
 	osg::Vec2f tc00, tc01, tc10, tc11;
 	tc00.x() = (localOrigin.x() - tileOrigin.x()) / tileSize.x();
@@ -2236,7 +4738,9 @@ osg::StateSet* LayeredTexture::createCutoutStateSet( const osg::Vec2f& origin, c
 	tc11.x() = (localOpposite.x()-tileOrigin.x()) / tileSize.x();
 	tc11.y() = (localOpposite.y()-tileOrigin.y()) / tileSize.y();
 
-	char uniformName[20];
+	osg::Vec4f& sizeParams = tileParams[2*layer->_textureUnit];
+	osg::Vec4f& texCrdParams = tileParams[2*layer->_textureUnit+1];
+
 	if ( _useNormalizedTexCoords )
 	{
 	    const osg::Vec4f texCrdBias( tc00.x(), tc00.y(), 0.0f, 0.0f );
@@ -2251,10 +4755,7 @@ osg::StateSet* LayeredTexture::createCutoutStateSet( const osg::Vec2f& origin, c
 	    texCrdFactor.x() /= tc11.x();
 	    texCrdFactor.y() /= tc11.y();
 
-	    snprintf( uniformName, 20, "texcrdfactor%d", layer->_textureUnit );
-	    stateset->addUniform( new osg::Uniform(uniformName,texCrdFactor) );
-	    snprintf( uniformName, 20, "texcrdbias%d", layer->_textureUnit );
-	    stateset->addUniform( new osg::Uniform(uniformName,texCrdBias) );
+	    texCrdParams = osg::Vec4f( texCrdFactor.x(), texCrdFactor.y(), texCrdBias.x(), texCrdBias.y() );
 	}
 
 	tc01 = osg::Vec2f( tc11.x(), tc00.y() );
@@ -2262,27 +4763,30 @@ osg::StateSet* LayeredTexture::createCutoutStateSet( const osg::Vec2f& origin, c
 
 	tcData.push_back( TextureCoordData( layer->_textureUnit, tc00, tc01, tc10, tc11, tileOrigin, tileSize ) );
 
-	osg::ref_ptr<osg::Texture2D> texture = new osg::Texture2D( tileImage.get() );
-	texture->setResizeNonPowerOfTwoHint( resizeHint );
-	texture->setWrap( osg::Texture::WRAP_S, xWrapMode );
-	texture->setWrap( osg::Texture::WRAP_T, yWrapMode );
-
-	texture->setMaxAnisotropy( osg::maximum(getMaxAnisotropy(idx),1.0f) );
-
-	osg::Texture::FilterMode filterMode = layer->_filterType==Nearest ? osg::Texture::NEAREST : osg::Texture::LINEAR;
-	texture->setFilter( osg::Texture::MAG_FILTER, filterMode );
-
-	if ( _enableMipmapping )
-	    filterMode = layer->_filterType==Nearest ? osg::Texture::NEAREST_MIPMAP_NEAREST : osg::Texture::LINEAR_MIPMAP_LINEAR;
-
-	texture->setFilter( osg::Texture::MIN_FILTER, filterMode );
+	stateset->setTextureAttributeAndModes( layer->_textureUnit, texture.get() );
 
-	texture->setBorderColor( layer->_borderColor );
+	if ( !isUndefined && !isConstant )
+	{
+	    LayeredTextureData::TileTexture tile;
+	    tile._texture = texture;
+	    tile._stateset = stateset;
+	    tile._unit = layer->_textureUnit;
+	    tile._hasBorderArea = hasBorderArea;
+	    tile._origin = tileOrigin;
+	    tile._size = tileSize;
+	    tile._sliceNr = sliceNr;
+	    tile._dataOrder = dataOrder;
+	    tile._renewable = !level && !key._cpuMipmaps;
+
+	    _tileRegistrationLock.lock();
+	    layer->_tileTextures.push_back( tile );
+	    if ( !isView )
+		layer->_hasCopiedTiles = true;
+	    _tileRegistrationLock.unlock();
+	}
 
-	stateset->setTextureAttributeAndModes( layer->_textureUnit, texture.get() );
-	snprintf( uniformName, 20, "texsize%d", layer->_textureUnit );
-	const osg::Vec2 texSize( tileSize.x(), tileSize.y() );
-	stateset->addUniform( new osg::Uniform(uniformName,texSize) );
+	sizeParams.x() = tileSize.x();
+	sizeParams.y() = tileSize.y();
 
 	if ( isDataLayerOK(_vertexOffsetLayerId) )
 	{
@@ -2298,21 +4802,133 @@ osg::StateSet* LayeredTexture::createCutoutStateSet( const osg::Vec2f& origin, c
 		    lod += xRatio>yRatio ? log(xRatio)/log(2.0f) : log(yRatio)/log(2.0f);
 		}
 		else 
-		    stateset->addUniform( new osg::Uniform("offsetifudf",(vertexOffsetInfo ? vertexOffsetInfo->_offsetIfUndef : 0.0f)) );
+		    sizeParams.w() = vertexOffsetInfo ? vertexOffsetInfo->_offsetIfUndef : 0.0f;
 
+		lod -= level;
 		if ( lod<0.0f )
 		    lod = 0.0f;
 
-		snprintf( uniformName, 20, "lod%d", layer->_textureUnit );
-		stateset->addUniform( new osg::Uniform(uniformName,lod) );
+		sizeParams.z() = lod;
 	    }
 	}
     }
 
+    if ( !tileParams.empty() )
+    {
+	osg::ref_ptr<osg::Uniform> uniform = new osg::Uniform( osg::Uniform::FLOAT_VEC4, "tileparams", tileParams.size() );
+	for ( unsigned int idx=0; idx<tileParams.size(); idx++ )
+	    uniform->setElement( idx, tileParams[idx] );
+
+	stateset->addUniform( uniform.get() );
+    }
+
     return stateset.release();
 }
 
 
+bool LayeredTexture::isCutoutEmpty( const osg::Vec2f& origin, const osg::Vec2f& opposite ) const
+{
+    if ( _stackUndefColor[3]>0.0f )
+	return false;
+
+    const osg::Vec2f smallestScale = _tilingInfo->_smallestScale;
+    osg::Vec2f globalOrigin( smallestScale.x() * (origin.x()+0.5),
+			     smallestScale.y() * (origin.y()+0.5) );
+    globalOrigin += _tilingInfo->_envelopeOrigin;
+
+    osg::Vec2f globalOpposite( smallestScale.x() * (opposite.x()+0.5),
+			       smallestScale.y() * (opposite.y()+0.5) );
+    globalOpposite += _tilingInfo->_envelopeOrigin;
+
+    return isCutoutUndefined( globalOrigin, globalOpposite );
+}
+
+
+bool LayeredTexture::getUndefCutoutState( UndefCutoutState& state ) const
+{
+    // Vertex offsets still need the data of undefined cut-outs
+    if ( !_useShaders || isDataLayerOK(_vertexOffsetLayerId) )
+	return false;
+
+    const int idx = getDataLayerIndex( _stackUndefLayerId );
+    if ( idx<0 )
+	return false;
+
+    const LayeredTextureData& layer = *_dataLayers[idx];
+    if ( layer._textureUnit<0 || layer.do3D() || !layer._image )
+	return false;
+
+    state._layerId = _stackUndefLayerId;
+    state._channel = _stackUndefChannel;
+    state._inverted = _invertUndefLayers;
+    state._transparent = _stackUndefColor[3]<=0.0f;
+    state._image = layer._image.get();
+    state._imageModifiedCount = layer._imageModifiedCount;
+    state._modifiedCount = layer._image->getModifiedCount();
+    state._sliceNr = layer._sliceNr;
+    return true;
+}
+
+
+bool LayeredTexture::isCutoutUndefined( const osg::Vec2f& globalOrigin, const osg::Vec2f& globalOpposite ) const
+{
+    UndefCutoutState state;
+    if ( !getUndefCutoutState(state) )
+	return false;
+
+    const LayeredTextureData& layer = *_dataLayers[getDataLayerIndex(_stackUndefLayerId)];
+    const osg::Vec2f localOrigin = layer.getLayerCoord( globalOrigin );
+    const osg::Vec2f localOpposite = layer.getLayerCoord( globalOpposite );
+    const Vec2i imageSize( layer._image->s(), layer._image->t() );
+
+    // Margin of one texel covers the reach of the texture filtering
+    Vec2i origin( (int) floor(localOrigin.x()-0.5)-1, (int) floor(localOrigin.y()-0.5)-1 );
+    Vec2i opposite( (int) ceil(localOpposite.x()+0.5)+1, (int) ceil(localOpposite.y()+0.5)+1 );
+
+    bool hasBorderArea = false;
+    for ( int dim=0; dim<=1; dim++ )
+    {
+	if ( origin[dim]<0 )
+	{
+	    origin[dim] = 0;
+	    hasBorderArea = true;
+	}
+	if ( opposite[dim]>imageSize[dim] )
+	{
+	    opposite[dim] = imageSize[dim];
+	    hasBorderArea = true;
+	}
+
+	if ( origin[dim]>imageSize[dim]-1 )
+	    origin[dim] = imageSize[dim]-1;
+	if ( opposite[dim]<origin[dim]+1 )
+	    opposite[dim] = origin[dim]+1;
+    }
+
+    osg::Vec4f min, max;
+    if ( !layer.getValueRange(origin,opposite-origin,min,max) )
+	return false;
+
+    const int channel = _stackUndefChannel;
+    float udf = _invertUndefLayers ? 1.0f-max[channel] : min[channel];
+
+    if ( hasBorderArea && layer._borderColor[0]>=0.0f )
+    {
+	const float border = layer._borderColor[channel];
+	udf = osg::minimum( udf, _invertUndefLayers ? 1.0f-border : border );
+    }
+
+    if ( udf<1.0f )
+	return false;
+
+    // Cut-outs may be created on the ThreadPool
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _undefCutoutLock );
+    _tilingInfo->_undefCutoutState = state;
+    _tilingInfo->_undefinedCutouts = true;
+    return true;
+}
+
+
 void LayeredTexture::add3DTextureToStateSet( const LayeredTextureData& layer, std::vector<LayeredTexture::TextureCoordData>& tcData, osg::StateSet& stateset ) const
 {
     osg::Image* image = layer._image;
@@ -2323,38 +4939,21 @@ void LayeredTexture::add3DTextureToStateSet( const LayeredTextureData& layer, st
     const Vec2i iDummy( 0, 0 );
     tcData.push_back( TextureCoordData( layer._textureUnit, fDummy, fDummy, fDummy, fDummy, iDummy, iDummy ) );
 
-    osg::ref_ptr<osg::Texture3D> texture = new osg::Texture3D( image );
-    texture->setResizeNonPowerOfTwoHint( false );
-
     osg::Texture::WrapMode wrapMode = osg::Texture::CLAMP_TO_EDGE;
     if ( layer._borderColor[0]>=0.0f )
 	wrapMode = osg::Texture::CLAMP_TO_BORDER;
 
-    texture->setWrap( osg::Texture::WRAP_S, wrapMode );
-    texture->setWrap( osg::Texture::WRAP_T, wrapMode );
-    texture->setWrap( osg::Texture::WRAP_R, wrapMode );
-
     //const int idx = getDataLayerIndex( layer._id );
     //texture->setMaxAnisotropy( osg::maximum(getMaxAnisotropy(idx),1.0f) );
 
     osg::Texture::FilterMode filterMode = layer._filterType==Nearest ? osg::Texture::NEAREST : osg::Texture::LINEAR;
-    texture->setFilter( osg::Texture::MAG_FILTER, filterMode );
 
     //if ( _enableMipmapping )
     //	filterMode = layer._filterType==Nearest ? osg::Texture::NEAREST_MIPMAP_NEAREST : osg::Texture::LINEAR_MIPMAP_LINEAR;
 
-    texture->setFilter( osg::Texture::MIN_FILTER, filterMode );
-    texture->setBorderColor( layer._borderColor );
-
+    // Cut-outs select their region by the vertextrans uniform only
+    osg::ref_ptr<osg::Texture3D> texture = texture3DCache.get( image, wrapMode, filterMode, layer._borderColor );
     stateset.setTextureAttributeAndModes( layer._textureUnit, texture.get() );
-
-    char uniformName[20];
-    snprintf( uniformName, 20, "texsize%d", layer._textureUnit );
-    const osg::Vec3f texSize( image->s(), image->t(), image->r() );
-    stateset.addUniform( new osg::Uniform(uniformName,texSize) );
-
-    snprintf( uniformName, 20, "vertextrans%d", layer._textureUnit );
-    stateset.addUniform( new osg::Uniform(uniformName,*layer._vertex2TextureTrans) );
 }
 
 
@@ -2391,6 +4990,8 @@ void LayeredTexture::updateSetupStateSetIfNeeded()
     for ( ; _isOn && it!=_processes.end(); it++ )
 	(*it)->checkForModifiedColorSequence();
 
+    finishCompositeJobIfDone();
+
     if ( _updateSetupStateSet )
     {
 	if ( !_retileCompositeLayer )
@@ -2398,6 +4999,18 @@ void LayeredTexture::updateSetupStateSetIfNeeded()
 	buildShaders();
 	setUpdateVar( _updateSetupStateSet, false );
     }
+    else if ( _updateCompositeRegion )
+	updateCompositeRegion();
+
+    // Background tiling may register tiles meanwhile
+    _tileRegistrationLock.lock();
+    std::vector<LayeredTextureData*>::iterator lit = _dataLayers.begin();
+    for ( ; lit!=_dataLayers.end(); lit++ )
+    {
+	(*lit)->updateTileImagesIfNeeded();
+	updateTileTexturesIfNeeded( **lit );
+    }
+    _tileRegistrationLock.unlock();
 
     _lock.readUnlock();
 }
@@ -2430,6 +5043,61 @@ void LayeredTexture::checkForModifiedImages()
 }
 
 
+/* Shader programs shared by all layered textures, keyed by their code. As
+   parameter values are passed as uniforms, the code is a canonical
+   signature of the structure of the layer stack. Only structural changes
+   will cost a new compile and link. */
+
+class ShaderProgramCache
+{
+public:
+    osg::Program*	get(const std::string& vertexCode,
+			    const std::string& fragmentCode);
+
+protected:
+    typedef std::pair<std::string,std::string>		Key;
+    typedef std::map<Key,osg::ref_ptr<osg::Program> >	ProgramMap;
+
+    OpenThreads::Mutex	_mutex;
+    ProgramMap		_programs;
+};
+
+
+#define MAX_CACHED_PROGRAMS	64
+
+osg::Program* ShaderProgramCache::get( const std::string& vertexCode, const std::string& fragmentCode )
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+
+    const Key key( vertexCode, fragmentCode );
+    ProgramMap::iterator it = _programs.find( key );
+    if ( it!=_programs.end() )
+	return it->second.get();
+
+    if ( _programs.size()>=MAX_CACHED_PROGRAMS )
+    {
+	// Forget the programs not in use by any StateSet
+	it = _programs.begin();
+	while ( it!=_programs.end() )
+	{
+	    if ( it->second->referenceCount()==1 )
+		_programs.erase( it++ );
+	    else
+		it++;
+	}
+    }
+
+    osg::ref_ptr<osg::Program> program = new osg::Program;
+    program->addShader( new osg::Shader(osg::Shader::VERTEX,vertexCode) );
+    program->addShader( new osg::Shader(osg::Shader::FRAGMENT,fragmentCode) );
+    _programs[key] = program;
+    return program.get();
+}
+
+
+static ShaderProgramCache shaderProgramCache;
+
+
 void LayeredTexture::buildShaders()
 {
     _useShaders = _allowShaders && _texInfo->_shadingSupport;
@@ -2488,9 +5156,8 @@ void LayeredTexture::buildShaders()
 
     _setupStateSet->clear();
 
-    std::string code;
-    getVertexShaderCode( code, activeUnits );
-    osg::ref_ptr<osg::Shader> vertexShader = new osg::Shader( osg::Shader::VERTEX, code );
+    std::string vertexCode;
+    getVertexShaderCode( vertexCode, activeUnits, *_setupStateSet );
 
     if ( needColSeqTexture )
     {
@@ -2498,14 +5165,11 @@ void LayeredTexture::buildShaders()
 	activeUnits.push_back( 0 );
     }
 
-    getFragmentShaderCode( code, activeUnits, nrProc, stackIsOpaque );
-    osg::ref_ptr<osg::Shader> fragmentShader = new osg::Shader( osg::Shader::FRAGMENT, code );
+    std::string fragmentCode;
+    getFragmentShaderCode( fragmentCode, activeUnits, nrProc, stackIsOpaque, *_setupStateSet );
 
-    osg::ref_ptr<osg::Program> program = new osg::Program;
-
-    program->addShader( vertexShader.get() );
-    program->addShader( fragmentShader.get() );
-    _setupStateSet->setAttributeAndModes( program.get() );
+    osg::Program* program = shaderProgramCache.get( vertexCode, fragmentCode );
+    _setupStateSet->setAttributeAndModes( program );
 
     char samplerName[20];
     for ( it=activeUnits.begin(); it!=activeUnits.end(); it++ )
@@ -2514,6 +5178,23 @@ void LayeredTexture::buildShaders()
 	_setupStateSet->addUniform( new osg::Uniform(samplerName, *it) );
     }
 
+    // Uniforms of 3D layers are the same for all tiles
+    std::vector<LayeredTextureData*>::const_iterator lit = _dataLayers.begin();
+    for ( ; lit!=_dataLayers.end(); lit++ )
+    {
+	const osg::Image* image = (*lit)->_image;
+	if ( (*lit)->_textureUnit<0 || !(*lit)->do3D() || !image )
+	    continue;
+
+	char uniformName[20];
+	snprintf( uniformName, 20, "texsize%d", (*lit)->_textureUnit );
+	const osg::Vec3f texSize( image->s(), image->t(), image->r() );
+	_setupStateSet->addUniform( new osg::Uniform(uniformName,texSize) );
+
+	snprintf( uniformName, 20, "vertextrans%d", (*lit)->_textureUnit );
+	_setupStateSet->addUniform( new osg::Uniform(uniformName,*(*lit)->_vertex2TextureTrans) );
+    }
+
     setRenderingHint( stackIsOpaque );
 }
 
@@ -2783,22 +5464,25 @@ void LayeredTexture::assignTextureUnits()
 }
 
 
-void LayeredTexture::getVertexShaderCode( std::string& code, const std::vector<int>& activeUnits ) const
+void LayeredTexture::getVertexShaderCode( std::string& code, const std::vector<int>& activeUnits, osg::StateSet& uniforms ) const
 {
     char line[100];
     code = "varying vec4 vertexpos;\n"
 	   "\n";
 
+    const int tileParamsSize = getTileParamsSize();
+    if ( tileParamsSize )
+    {
+	snprintf( line, 100, "uniform vec4 tileparams[%d];\n", tileParamsSize );
+	code += line;
+    }
+
     if ( _useNormalizedTexCoords )
     {
 	std::vector<int>::const_iterator iit = activeUnits.begin();
 	for ( ; iit!=activeUnits.end(); iit++ )
-	{
-	    snprintf( line, 100, "uniform vec4 texcrdfactor%d;\n", *iit );
-	    code += line;
-	    snprintf( line, 100, "uniform vec4 texcrdbias%d;\n", *iit );
-	    code += line;
-	}
+	    addUnitParamsCode( code, *iit, true, false, false );
+
 	code += "\n";
     }
 
@@ -2819,14 +5503,33 @@ void LayeredTexture::getVertexShaderCode( std::string& code, const std::vector<i
 
 	    snprintf( line, 100, "uniform sampler2D texture%d;\n", *iit );
 	    code += line;
-	    snprintf( line, 100, "uniform vec2 texsize%d;\n", *iit );
-	    code += line;
-
-	    snprintf( line, 100, "uniform float lod%d;\n", *iit );
-	    code += line;
+	    addUnitParamsCode( code, *iit, false, true, true );
 	}
 
-	code += "uniform float offsetifudf;\n"
+	char uniformName[20];
+	snprintf( uniformName, 20, "udfcolor%d", offsetUnit );
+	uniforms.addUniform( new osg::Uniform(uniformName,getDataLayerImageUndefColor(_vertexOffsetLayerId)) );
+	snprintf( line, 100, "uniform vec4 %s;\n", uniformName );
+	code += line;
+
+	osg::Vec3f normal = _vertexOffsetSpanVec0 ^ _vertexOffsetSpanVec1;
+	normal.normalize();
+	const osg::Vec2f scale = getDataLayerScale( _vertexOffsetLayerId );
+
+	uniforms.addUniform( new osg::Uniform("offsetbias",_vertexOffsetBias) );
+	uniforms.addUniform( new osg::Uniform("offsetfactor",_vertexOffsetFactor) );
+	uniforms.addUniform( new osg::Uniform("offsetnormal",normal) );
+	uniforms.addUniform( new osg::Uniform("offsetspan0",osg::Vec3f(_vertexOffsetSpanVec0*scale[0])) );
+	uniforms.addUniform( new osg::Uniform("offsetspan1",osg::Vec3f(_vertexOffsetSpanVec1*scale[1])) );
+
+	snprintf( line, 100, "#define offsetifudf tileparams[%d].w\n", 2*offsetUnit );
+	code += line;
+
+	code += "uniform float offsetbias;\n"
+		"uniform float offsetfactor;\n"
+		"uniform vec3 offsetnormal;\n"
+		"uniform vec3 offsetspan0;\n"
+		"uniform vec3 offsetspan1;\n"
 		"\n"
 		"float offset( vec2 delta )\n"
 		"{\n"
@@ -2861,7 +5564,7 @@ void LayeredTexture::getVertexShaderCode( std::string& code, const std::vector<i
 	    if ( udfColor[_vertexOffsetChannel]>=0.0 )
 	    {
 		code += "    if ( udf > 0.0 )\n";
-		snprintf( line, 100, "        offset = (offset - udf*%.6f) / (1.0-udf);\n", udfColor[_vertexOffsetChannel] );
+		snprintf( line, 100, "        offset = (offset - udf*udfcolor%d[%d]) / (1.0-udf);\n", offsetUnit, _vertexOffsetChannel );
 		code += line;
 	    }
 	}
@@ -2954,45 +5657,21 @@ void LayeredTexture::getVertexShaderCode( std::string& code, const std::vector<i
 		    "\n";
 	}
 
-	osg::Vec3f normal = _vertexOffsetSpanVec0 ^ _vertexOffsetSpanVec1;
-	normal.normalize();
-
-	snprintf( line, 100, "    normal = vec3(%.6f,%.6f,%.6f);\n", normal[0], normal[1], normal[2] );
-	code += line;
-
-	code += "    pivot = ";
+	code += "    normal = offsetnormal;\n"
+		"    pivot = ";
 	if ( isDataLayerOK(udfId) )
 	    code += "pivot>1e29 ? offsetifudf : ";
-	if ( _vertexOffsetBias != 0.0f )
-	{
-	    snprintf( line, 100, "%e + ", _vertexOffsetBias );
-	    code += line;
-	}
-	if ( _vertexOffsetFactor != 1.0f )
-	{
-	    snprintf( line, 100, "%e * ", _vertexOffsetFactor );
-	    code += line;
-	}
-	code += "pivot;\n";
+	code += "offsetbias + offsetfactor*pivot;\n";
 
 	code += "    vertexpos = vec4(normal*pivot, 0.0) + gl_Vertex;\n"
 		"    gl_Position = gl_ModelViewProjectionMatrix * vertexpos;\n"
 		"\n";
 
-	const osg::Vec2f scale = getDataLayerScale( _vertexOffsetLayerId );
-	const osg::Vec3f v0 = _vertexOffsetSpanVec0 * scale[0];
-	const osg::Vec3f v1 = _vertexOffsetSpanVec1 * scale[1];
-
-	snprintf( line, 100, "    vec3 v0 = vec3(%.6f,%.6f,%.6f);\n", v0[0], v0[1], v0[2] );
-	code += line;
-	snprintf( line, 100, "    vec3 v1 = vec3(%.6f,%.6f,%.6f);\n", v1[0], v1[1], v1[2] );
-	code += line;
-	snprintf( line, 100, "    v0 += normal * (connect4[1]-connect4[0]) * %.6f/delta;\n",  _vertexOffsetFactor*0.5 );
-	code += line;
-	snprintf( line, 100, "    v1 += normal * (connect4[3]-connect4[2]) * %.6f/delta;\n",  _vertexOffsetFactor*0.5 );
-	code += line;
-
-	code += "    normal = normalize( cross(v0,v1) );\n";
+	code += "    vec3 v0 = offsetspan0;\n"
+		"    vec3 v1 = offsetspan1;\n"
+		"    v0 += normal * (connect4[1]-connect4[0]) * 0.5*offsetfactor/delta;\n"
+		"    v1 += normal * (connect4[3]-connect4[2]) * 0.5*offsetfactor/delta;\n"
+		"    normal = normalize( cross(v0,v1) );\n";
     }
     else
 	code += "    vertexpos = gl_Vertex;\n"
@@ -3038,9 +5717,10 @@ void LayeredTexture::getVertexShaderCode( std::string& code, const std::vector<i
 }
 
 
-void LayeredTexture::getFragmentShaderCode( std::string& code, const std::vector<int>& activeUnits, int nrProc, bool stackIsOpaque ) const
+void LayeredTexture::getFragmentShaderCode( std::string& code, const std::vector<int>& activeUnits, int nrProc, bool stackIsOpaque, osg::StateSet& uniforms ) const
 {
     char line[100];
+    char uniformName[20];
     code = "varying vec4 vertexpos;\n"
 	   "\n";
 
@@ -3050,48 +5730,46 @@ void LayeredTexture::getFragmentShaderCode( std::string& code, const std::vector
 
     const int udfUnit = getDataLayerTextureUnit( _stackUndefLayerId );
 
+    const int tileParamsSize = getTileParamsSize();
+    if ( tileParamsSize )
+    {
+	snprintf( line, 100, "uniform vec4 tileparams[%d];\n", tileParamsSize );
+	code += line;
+    }
+
     std::vector<int>::const_iterator iit = activeUnits.begin();
     for ( ; iit!=activeUnits.end(); iit++ )
     {
-	if ( _useNormalizedTexCoords )
-	{
-	    snprintf( line, 100, "uniform vec4 texcrdfactor%d;\n", *iit );
-	    code += line;
-	    snprintf( line, 100, "uniform vec4 texcrdbias%d;\n", *iit );
-	    code += line;
-	}
-
 	const int nrDims = getTextureUnitNrDims( *iit );
 	snprintf( line, 100, "uniform sampler%dD texture%d;\n", nrDims, *iit );
 	code += line;
-	snprintf( line, 100, "uniform vec%d texsize%d;\n", nrDims, *iit );
-	code += line;
 
-	if ( nrDims==3 )
+	addUnitParamsCode( code, *iit, _useNormalizedTexCoords, true, useLOD && *iit==udfUnit );
+
+	std::vector<LayeredTextureData*>::const_iterator lit = _dataLayers.begin();
+	for ( ; lit!=_dataLayers.end(); lit++ )
 	{
-	    snprintf( line, 100, "uniform mat4 vertextrans%d;\n", *iit );
-	    code += line;
-	}
+	    if ( (*lit)->_textureUnit != *iit )
+		continue;
 
-	if ( useLOD && *iit==udfUnit )
-	{
-	    snprintf( line, 100, "uniform float lod%d;\n", *iit );
+	    snprintf( uniformName, 20, "udfcolor%d", *iit );
+	    uniforms.addUniform( new osg::Uniform(uniformName,(*lit)->_undefColor) );
+	    snprintf( line, 100, "uniform vec4 %s;\n", uniformName );
 	    code += line;
+	    break;
 	}
     }
 
-    code += "\n";
     const bool stackUdf = isDataLayerOK(_stackUndefLayerId);
-    code += stackUdf ? "void process( float stackudf )\n" :
-		       "void process( void )\n";
-    code += "{\n"
-	    "    vec4 col, udfcol;\n"
-	    "    vec3 texcrd;\n"
-	    "    float a, b, udf, oldudf, orgcol3, mip, var, stddev, scale;\n"
-	    "\n";
+    if ( stackUdf && _stackUndefColor[3]>0.0f )
+    {
+	uniforms.addUniform( new osg::Uniform("stackudfcol",_stackUndefColor) );
+	code += "uniform vec4 stackudfcol;\n";
+    }
 
     int stage = 0;
     float minOpacity = 1.0f;
+    std::string processCode;
 
     std::vector<LayerProcess*>::const_reverse_iterator it = _processes.rbegin();
     for ( ; _isOn && it!=_processes.rend() && nrProc--; it++ )
@@ -3104,21 +5782,34 @@ void LayeredTexture::getFragmentShaderCode( std::string& code, const std::vector
 
 	if ( stage )
 	{
-	    code += "\n"
-		    "    if ( gl_FragColor.a >= 1.0 )\n"
-		    "       return;\n"
-		    "\n";
+	    processCode += "\n"
+			   "    if ( gl_FragColor.a >= 1.0 )\n"
+			   "       return;\n"
+			   "\n";
 	}
 
-	(*it)->getShaderCode( code, stage++ );
+	LayerProcess::getShaderUniformCode( code, stage );
+	(*it)->addShaderUniforms( uniforms, stage );
+	(*it)->getShaderCode( processCode, stage++ );
     }
 
     if ( !stage )
     {
-	snprintf( line, 100, "    gl_FragColor = vec4(1.0,1.0,1.0,%.6f);\n", minOpacity );
-	code += line;
+	uniforms.addUniform( new osg::Uniform("minopacity",minOpacity) );
+	code += "uniform float minopacity;\n";
+	processCode += "    gl_FragColor = vec4(1.0,1.0,1.0,minopacity);\n";
     }
 
+    code += "\n";
+    code += stackUdf ? "void process( float stackudf )\n" :
+		       "void process( void )\n";
+    code += "{\n"
+	    "    vec4 col, udfcol;\n"
+	    "    vec3 texcrd;\n"
+	    "    float a, b, udf, oldudf, orgcol3, mip, var, stddev, scale;\n"
+	    "\n";
+
+    code += processCode;
     code += "}\n"
 	    "\n"
 	    "void main( void )\n"
@@ -3164,8 +5855,7 @@ void LayeredTexture::getFragmentShaderCode( std::string& code, const std::vector
 		    "        process( udf );\n"
 		    "\n";
 
-	    snprintf( line, 100, "    vec4 udfcol = vec4(%.6f,%.6f,%.6f,%.6f);\n", _stackUndefColor[0], _stackUndefColor[1], _stackUndefColor[2], _stackUndefColor[3] );
-	    code += line;
+	    code += "    vec4 udfcol = stackudfcol;\n";
 
 	    code += "\n"
 		    "    if ( udf >= 1.0 )\n"
@@ -3225,6 +5915,20 @@ bool LayeredTexture::isMipmappingEnabled() const
 { return _enableMipmapping; }
 
 
+void LayeredTexture::enableCpuMipmaps( bool yn )
+{
+    if ( _cpuMipmaps!=yn )
+    {
+	_cpuMipmaps = yn;
+	setUpdateVar( _tilingInfo->_retilingNeeded, true );
+    }
+}
+
+
+bool LayeredTexture::areCpuMipmapsEnabled() const
+{ return _cpuMipmaps; }
+
+
 void LayeredTexture::setTextureSizePolicy( TextureSizePolicy policy )
 {
     _textureSizePolicy = policy;
@@ -3259,6 +5963,27 @@ void LayeredTexture::setMaxTextureCopySize( unsigned int width_x_height )
 }
 
 
+void LayeredTexture::setResampleFilter( ResampleFilter filter )
+{
+    if ( _resampleFilter==filter )
+	return;
+
+    _resampleFilter = filter;
+
+    // Forces rescaled copies to be made again
+    std::vector<LayeredTextureData*>::iterator it = _dataLayers.begin();
+    for ( ; it!=_dataLayers.end(); it++ )
+    {
+	if ( (*it)->hasRescaledImage() )
+	    (*it)->_imageModifiedCount = -1;
+    }
+}
+
+
+LayeredTexture::ResampleFilter LayeredTexture::getResampleFilter() const
+{ return _resampleFilter; }
+
+
 void LayeredTexture::invertUndefLayers( bool yn )
 { _invertUndefLayers = yn; }
 
@@ -3267,143 +5992,562 @@ bool LayeredTexture::areUndefLayersInverted() const
 { return _invertUndefLayers; }
 
 
-//============================================================================
+//============================================================================
+
+/* Composites a column range of the image rows [start,stop), relative to
+   a row offset, for parallelFor(.) */
+
+class CompositeTextureTask : public ParallelForBody
+{
+public:
+			CompositeTextureTask(const LayeredTexture& lt,
+			    osg::Image& image,
+			    const std::vector<LayerProcess*>& procs,
+			    float minOpacity,bool dummyTexture,
+			    int rowOffset,int colStart,int colStop,
+			    const osg::Vec2f& origin,const osg::Vec2f& scale,
+			    const OpenThreads::Atomic* cancelFlag=0);
+
+    void		run(size_t start,size_t stop);
+    void		compositeFragment(const osg::Vec2f& globalCoord,
+					  osg::Vec4f& fragColor) const;
+    void		compositeBorderColor(osg::Vec4f&) const;
+
+protected:
+
+    void		compositeSpan(LayerSpan&,float* stackUdf,
+				      unsigned char* skip) const;
+    void		finishFragment(osg::Vec4f& fragColor,
+				       float udf) const;
+
+    static void		packRow(const osg::Vec4f* fragColors,
+				unsigned char* imagePtr,int width);
+
+    const LayeredTexture&		_lt;
+    osg::Image&				_image;
+    const std::vector<LayerProcess*>&	_processList;
+    float				_minOpacity;
+    bool				_dummyTexture;
+    int					_rowOffset;
+    int					_colStart;
+    int					_colStop;
+    const OpenThreads::Atomic*		_cancelFlag;
+
+    osg::Vec2f				_origin;
+    osg::Vec2f				_scale;
+    const LayeredTextureData*		_udfLayer;
+    std::vector<float>			_xCoords;
+};
+
+
+CompositeTextureTask::CompositeTextureTask( const LayeredTexture& lt, osg::Image& image, const std::vector<LayerProcess*>& procs, float minOpacity, bool dummyTexture, int rowOffset, int colStart, int colStop, const osg::Vec2f& origin, const osg::Vec2f& scale, const OpenThreads::Atomic* cancelFlag )
+    : _lt( lt )
+    , _image( image )
+    , _processList( procs )
+    , _minOpacity( minOpacity )
+    , _dummyTexture( dummyTexture )
+    , _rowOffset( rowOffset )
+    , _colStart( colStart>=0 ? colStart : 0 )
+    , _colStop( colStop<=image.s() ? colStop : image.s() )
+    , _cancelFlag( cancelFlag )
+    , _origin( origin )
+    , _scale( scale )
+    , _udfLayer( 0 )
+{
+    const int udfIdx = _lt.getDataLayerIndex( _lt._stackUndefLayerId );
+    if ( udfIdx>=0 )
+	_udfLayer = _lt._dataLayers[udfIdx];
+
+    // Global x-coordinates are identical for every row
+    for ( int x=_colStart; x<_colStop; x++ )
+	_xCoords.push_back( _origin.x()+_scale.x()*(x+0.5) );
+}
+
+
+void CompositeTextureTask::compositeFragment( const osg::Vec2f& globalCoord, osg::Vec4f& fragColor ) const
+{
+    float udf = 0.0f;
+
+    fragColor = osg::Vec4f( -1.0f, -1.0f, -1.0f, -1.0f );
+
+    if ( _udfLayer && !_dummyTexture )
+    {
+	udf = _udfLayer->getTextureVec(globalCoord)[_lt._stackUndefChannel];
+	if ( _lt._invertUndefLayers )
+	    udf = 1.0-udf;
+    }
+
+    if ( udf<1.0 )
+    {
+	std::vector<LayerProcess*>::const_reverse_iterator it;
+	for ( it=_processList.rbegin(); it!=_processList.rend(); it++ )
+	{
+	    (*it)->doProcess( fragColor, udf, globalCoord );
+
+	    if ( fragColor[3]>=1.0f )
+		break;
+	}
+    }
+
+    finishFragment( fragColor, udf );
+}
+
+
+void CompositeTextureTask::finishFragment( osg::Vec4f& fragColor, float udf ) const
+{
+    const osg::Vec4f& udfColor = _lt._stackUndefColor;
+
+    if ( udf<1.0 )
+    {
+	if ( _dummyTexture )
+	    fragColor = osg::Vec4f( 0.0f, 0.0f, 0.0f, 0.0f );
+	else if ( fragColor[0]==-1.0f )
+	    fragColor = osg::Vec4f( 1.0f, 1.0f, 1.0f, _minOpacity );
+    }
+
+    if ( udf>=1.0f )
+	fragColor = udfColor;
+    else if ( udf>0.0 )
+    {
+	if ( udfColor[3]<=0.0f )
+	    fragColor[3] *= 1.0f-udf;
+	else if ( udfColor[3]>=1.0f && fragColor[3]>=1.0f )
+	    fragColor = fragColor*(1.0f-udf) + udfColor*udf;
+	else if ( fragColor[3]>0.0f )
+	{
+	    const float a = fragColor[3]*(1.0f-udf);
+	    const float b = udfColor[3]*udf;
+	    fragColor = (fragColor*a + udfColor*b) / (a+b);
+	    fragColor[3] = a+b;
+	}
+	else
+	{
+	    fragColor = udfColor;
+	    fragColor[3] *= udf;
+	}
+    }
+
+    if ( fragColor[3]<0.5f/255.0f )
+	fragColor = osg::Vec4f( 0.0f, 0.0f, 0.0f, 0.0f );
+}
+
+
+void CompositeTextureTask::compositeSpan( LayerSpan& span, float* stackUdf, unsigned char* skip ) const
+{
+    const int nrPixels = span._nrPixels;
+
+    for ( int ch=0; ch<4; ch++ )
+	std::fill( span._color[ch], span._color[ch]+nrPixels, -1.0f );
+
+    std::fill( stackUdf, stackUdf+nrPixels, 0.0f );
+
+    if ( _udfLayer && !_dummyTexture )
+    {
+	float* channels[4] = { 0, 0, 0, 0 };
+	channels[_lt._stackUndefChannel] = stackUdf;
+	_udfLayer->getTextureSpan( span._y, span._x, nrPixels, channels );
+
+	if ( _lt._invertUndefLayers )
+	{
+	    for ( int idx=0; idx<nrPixels; idx++ )
+		stackUdf[idx] = 1.0-stackUdf[idx];
+	}
+    }
+
+    int nrActive = 0;
+    for ( int idx=0; idx<nrPixels; idx++ )
+    {
+	skip[idx] = stackUdf[idx]>=1.0 ? 1 : 0;
+	nrActive += 1-skip[idx];
+    }
+
+    std::vector<LayerProcess*>::const_reverse_iterator it;
+    for ( it=_processList.rbegin(); it!=_processList.rend() && nrActive; it++ )
+    {
+	(*it)->doProcessSpan( span );
+
+	// Pixels become opaque in the same way as in compositeFragment(.)
+	const float* alpha = span._color[3];
+	for ( int idx=0; idx<nrPixels; idx++ )
+	{
+	    if ( !skip[idx] && alpha[idx]>=1.0f )
+	    {
+		skip[idx] = 1;
+		nrActive--;
+	    }
+	}
+    }
+}
+
+
+void CompositeTextureTask::compositeBorderColor( osg::Vec4f& borderColor ) const
+{
+    // Border color is sampled at the first pixel beyond the image
+    const osg::Vec2f globalCoord( _origin.x()+_scale.x()*0.5,
+				  _origin.y()+_scale.y()*(_image.t()+0.5) );
+    compositeFragment( globalCoord, borderColor );
+}
+
+
+void CompositeTextureTask::packRow( const osg::Vec4f* fragColors, unsigned char* imagePtr, int width )
+{
+    /* Branch-free equivalent of clamping floor(255*c+0.5) to [0,255].
+       Rounding is done in double precision to stay bit-compatible with
+       the per-pixel implementation it replaces. */
+    const float* src = fragColors[0].ptr();
+    const int nrValues = 4*width;
+
+    for ( int idx=0; idx<nrValues; idx++ )
+    {
+	double val = src[idx]*255.0f;
+	val = val>0.0 ? val : 0.0;
+	val = val<255.0 ? val : 255.0;
+	imagePtr[idx] = (unsigned char) (int) (val+0.5);
+    }
+}
+
+
+void CompositeTextureTask::run( size_t start, size_t stop )
+{
+    const int width = _image.s();
+    const int nrCols = _colStop-_colStart;
+    if ( nrCols<1 )
+	return;
+
+    std::vector<osg::Vec4f> rowColors( nrCols );
+
+    LayerSpan span( nrCols );
+    span._x = &_xCoords[0];
+
+    std::vector<float> colors( 5*nrCols );
+    std::vector<unsigned char> skip( nrCols );
+    for ( int ch=0; ch<4; ch++ )
+	span._color[ch] = &colors[ch*nrCols];
+
+    float* stackUdf = &colors[4*nrCols];
+    span._stackUdf = stackUdf;
+    span._skip = &skip[0];
+
+    for ( int y=_rowOffset+int(start); y<_rowOffset+int(stop); y++ )
+    {
+	if ( _cancelFlag && *_cancelFlag )
+	    return;
+
+	span._y = _origin.y()+_scale.y()*(y+0.5);
+	compositeSpan( span, stackUdf, &skip[0] );
+
+	for ( int x=0; x<nrCols; x++ )
+	{
+	    osg::Vec4f& fragColor = rowColors[x];
+	    for ( int ch=0; ch<4; ch++ )
+		fragColor[ch] = span._color[ch][x];
+
+	    finishFragment( fragColor, stackUdf[x] );
+	}
+
+	unsigned char* imagePtr = _image.data() + (((pixel_int) y)*width+_colStart)*4;
+	packRow( &rowColors[0], imagePtr, nrCols );
+    }
+}
+
+
+float LayeredTexture::getCompositeProcesses( std::vector<LayerProcess*>& processList ) const
+{
+    float minOpacity = 1.0f;
+
+    std::vector<LayerProcess*>::const_iterator it = _processes.begin();
+    for ( ; _isOn && it!=_processes.end(); it++ )
+    {
+	if ( (*it)->getTransparencyType()!=FullyTransparent )
+	    processList.push_back( *it );
+
+	if ( (*it)->getOpacity() < minOpacity )
+	    minOpacity = (*it)->getOpacity();
+    }
+
+    return minOpacity;
+}
+
+
+void LayeredTexture::compositeRegion( osg::Image& image, const Vec2i& origin, const Vec2i& size, osg::Vec4f* borderColor, bool dummyTexture )
+{
+    std::vector<LayerProcess*> processList;
+    const float minOpacity = getCompositeProcesses( processList );
+
+    const LayeredTextureData& compLayer = *_dataLayers[getDataLayerIndex(_compositeLayerId)];
+
+    CompositeTextureTask task( *this, image, processList, minOpacity, dummyTexture, origin.y(), origin.x(), origin.x()+size.x(), compLayer._origin, compLayer._scale );
+
+    int nrRows = size.y();
+    if ( origin.y()+nrRows>image.t() )
+	nrRows = image.t()-origin.y();
+
+    if ( origin.y()>=0 && nrRows>0 )
+	parallelFor( nrRows, task );
+
+    if ( borderColor )
+	task.compositeBorderColor( *borderColor );
+}
+
+
+/* Creates a new composite texture image on the ThreadPool. Processes are
+   referenced, and the layer data stays read-locked while running. Layer
+   changes that may invalidate the data being read must cancel the job
+   first. */
+
+class CompositeJob : public ThreadPoolTask
+{
+public:
+			CompositeJob(LayeredTexture&,osg::Image*,
+				     const osg::Vec2f& origin,
+				     const osg::Vec2f& scale,
+				     const osg::Vec4f& borderColor);
+			~CompositeJob()		{ cancel(); }
+
+    void		start()			{ _group.submit( *this ); }
+    void		execute();
+    void		cancel();
+    void		finish()		{ _group.wait(); }
+    bool		isDone() const		{ return _done>0; }
+
+    osg::ref_ptr<osg::Image>	_image;
+    osg::Vec2f			_origin;
+    osg::Vec2f			_scale;
+    osg::Vec4f			_borderColor;
+
+protected:
+
+    LayeredTexture&				_lt;
+    std::vector<LayerProcess*>			_processList;
+    std::vector<osg::ref_ptr<LayerProcess> >	_processRefs;
+    float					_minOpacity;
+    OpenThreads::Atomic				_cancelled;
+    OpenThreads::Atomic				_done;
+    TaskGroup					_group;
+};
+
+
+CompositeJob::CompositeJob( LayeredTexture& lt, osg::Image* image, const osg::Vec2f& origin, const osg::Vec2f& scale, const osg::Vec4f& borderColor )
+    : _image( image )
+    , _origin( origin )
+    , _scale( scale )
+    , _borderColor( borderColor )
+    , _lt( lt )
+{
+    _minOpacity = _lt.getCompositeProcesses( _processList );
+    _processRefs.assign( _processList.begin(), _processList.end() );
+}
+
+
+void CompositeJob::cancel()
+{
+    _cancelled.exchange( 1 );
+    finish();
+}
+
+
+void CompositeJob::execute()
+{
+    _lt._lock.readLock();
+
+    CompositeTextureTask task( _lt, *_image, _processList, _minOpacity, false, 0, 0, _image->s(), _origin, _scale, &_cancelled );
+    parallelFor( _image->t(), task );
+
+    if ( _borderColor[0]>=0.0f && !_cancelled )
+	task.compositeBorderColor( _borderColor );
+
+    _lt._lock.readUnlock();
+
+    // Redraw is requested by checkCompositeJob(), as workers leave the scene alone
+    if ( !_cancelled )
+	_done.exchange( 1 );
+}
+
+
+void LayeredTexture::touchDataLayerImage( int id, const Vec2i& origin, const Vec2i& size )
+{
+    const int idx = getDataLayerIndex( id );
+    if ( idx==-1 || id==_compositeLayerId || size.x()<1 || size.y()<1 )
+	return;
+
+    LayeredTextureData& layer = *_dataLayers[idx];
+    if ( !layer._imageSource )
+	return;
+
+    // Background tiling may have read the region before it was modified
+    triggerCancelBackgroundWork();
+
+#ifdef USE_IMAGE_STRIDE
+    // Gathered tile copies only see the touch if the image is retiled
+    const bool inPlace = !layer.hasRescaledImage() && !layer.do3D() && !(_cpuMipmaps && _enableMipmapping) && !layer._hasCopiedTiles;
+#else
+    const bool inPlace = false;
+#endif
+
+    if ( !inPlace )
+    {
+	// Derived image data needs a full update
+	layer._imageSource->dirty();
+	triggerRedrawRequest();
+	return;
+    }
+
+    if ( layer._nrPowerChannels )
+	encodeBaseChannelPower( *layer._imageSource, layer._nrPowerChannels, origin, size, layer._sliceNr, layer._imageDataOrder );
+
+    // Cached copies are keyed by a modified count the touch leaves alone
+    tileTextureCache.purgeCopies( layer._imageSource.get() );
+
+    layer.dirtyTileImages( origin, size );
+    layer.dirtyValueRanges();
+    triggerRedrawRequest();
+
+    if ( id==_stackUndefLayerId )
+    {
+	_undefCutoutLock.lock();
+	const bool undefinedCutouts = _tilingInfo->_undefinedCutouts;
+	_undefCutoutLock.unlock();
+
+	if ( undefinedCutouts )
+	    setUpdateVar( _tilingInfo->_retilingNeeded, true );
+    }
+
+    // Re-evaluate cached transparencies that may affect the shader setup
+    layer.dirtyTransparencyChunks( origin, size );
+    bool transparencyChanged = false;
+    std::vector<LayeredTextureData*>::iterator it = _dataLayers.begin();
+    for ( ; it!=_dataLayers.end(); it++ )
+    {
+	if ( (*it)!=&layer && (*it)->_undefLayerId!=id )
+	    continue;
+
+	for ( int channel=0; channel<4; channel++ )
+	{
+	    const TransparencyType oldType = (*it)->_transparency[channel];
+	    if ( oldType==TransparencyUnknown )
+		continue;
+
+	    (*it)->_transparency[channel] = TransparencyUnknown;
+	    if ( getDataLayerTransparencyType((*it)->_id,channel)!=addOpacity(oldType,(*it)->_borderColor[channel]) )
+		transparencyChanged = true;
+	}
+    }
+
+    if ( transparencyChanged )
+    {
+	setUpdateVar( _updateSetupStateSet, true );
+	return;
+    }
+
+    const int compIdx = getDataLayerIndex( _compositeLayerId );
+    const osg::Image* compImage = _dataLayers[compIdx]->_image.get();
+    if ( !compImage || _compositeLayerUpdate )
+	return;
+
+    // Bilinear filtering spreads a pixel over its direct neighbors
+    const osg::Vec2f localOrigin( origin.x()-1.0f, origin.y()-1.0f );
+    const osg::Vec2f localOpposite( origin.x()+size.x()+1.0f, origin.y()+size.y()+1.0f );
+
+    const osg::Vec2f& compOrigin = _dataLayers[compIdx]->_origin;
+    const osg::Vec2f& compScale = _dataLayers[compIdx]->_scale;
+    const Vec2i compSize( compImage->s(), compImage->t() );
+
+    const Vec2i imageSize( layer._image->s(), layer._image->t() );
+    const bool extendedEdges = layer._borderColor[0]<0.0f;
 
-class CompositeTextureThread : public GroupThread<CompositeTextureThread>
-{
-public:
-			CompositeTextureThread(ThreadGroup<CompositeTextureThread>& tg)
-			    : GroupThread<CompositeTextureThread>(tg)
-			{}
+    Vec2i dirtyOrigin, dirtyOpposite;
+    for ( int dim=0; dim<=1; dim++ )
+    {
+	float v0 = layer._origin[dim] + localOrigin[dim]*layer._scale[dim];
+	float v1 = layer._origin[dim] + localOpposite[dim]*layer._scale[dim];
+	v0 = (v0-compOrigin[dim]) / compScale[dim] - 0.5f;
+	v1 = (v1-compOrigin[dim]) / compScale[dim] - 0.5f;
 
-   void			set(const LayeredTexture* lt,
-			    osg::Image* image,osg::Vec4f& borderCol,
-			    const std::vector<LayerProcess*>& procs,
-			    float minOpacity,bool dummyTexture,
-			    pixel_int startNr,pixel_int stopNr,
-			    OpenThreads::BlockCount& ready)
-       			{
-			    beginSetFunction( &ready );
-
-			    _lt = lt;
-			    _image = image;
-			    _borderColor = &borderCol;
-			    _processList = &procs;
-			    _minOpacity = minOpacity;
-			    _dummyTexture = dummyTexture;
-			    _start = startNr>=0 ? startNr : 0;
-			    _stop = stopNr<=image->s()*image->t() ? stopNr : image->s()*image->t();
-			    endSetFunction();
-			}
+	const float maxPixel = float( compSize[dim] );
 
-protected:
+	// Edge pixels may have been extended into the border area
+	if ( extendedEdges && origin[dim]<=0 )
+	    v0 = compScale[dim]>0.0f ? 0.0f : maxPixel;
+	if ( extendedEdges && origin[dim]+size[dim]>=imageSize[dim] )
+	    v1 = compScale[dim]>0.0f ? maxPixel : 0.0f;
 
-    void				doWork();
+	if ( v0>v1 )
+	    std::swap( v0, v1 );
 
-    const LayeredTexture*		_lt;
-    bool				_dummyTexture;
-    osg::Image*				_image;
-    osg::Vec4f*				_borderColor;
-    const std::vector<LayerProcess*>*	_processList;
-    float				_minOpacity;
-    pixel_int				_start;
-    pixel_int				_stop;
-};
+	v0 = v0<0.0f ? 0.0f : ( v0>maxPixel ? maxPixel : v0 );
+	v1 = v1<0.0f ? 0.0f : ( v1>maxPixel ? maxPixel : v1 );
 
+	dirtyOrigin[dim] = (int) floor( v0 );
+	dirtyOpposite[dim] = (int) ceil( v1 ) + 1;
+	if ( dirtyOpposite[dim]>compSize[dim] )
+	    dirtyOpposite[dim] = compSize[dim];
 
-void CompositeTextureThread::doWork()
-{
-    if ( _lt )
-    {
-	const int idx = _lt->getDataLayerIndex( _lt->_compositeLayerId );
-	const osg::Vec2f& origin = _lt->_dataLayers[idx]->_origin;
-	const osg::Vec2f& scale = _lt->_dataLayers[idx]->_scale;
+	if ( dirtyOpposite[dim]<=dirtyOrigin[dim] )
+	    return;
+    }
 
-	const LayeredTextureData* udfLayer = 0;
-	const int udfIdx = _lt->getDataLayerIndex( _lt->_stackUndefLayerId );
-	if ( udfIdx>=0 )
-	    udfLayer = _lt->_dataLayers[udfIdx];
+    if ( _compositeDirtyOpposite.x()>_compositeDirtyOrigin.x() )
+    {
+	for ( int dim=0; dim<=1; dim++ )
+	{
+	    if ( _compositeDirtyOrigin[dim]<dirtyOrigin[dim] )
+		dirtyOrigin[dim] = _compositeDirtyOrigin[dim];
+	    if ( _compositeDirtyOpposite[dim]>dirtyOpposite[dim] )
+		dirtyOpposite[dim] = _compositeDirtyOpposite[dim];
+	}
+    }
 
-	const osg::Vec4f& udfColor = _lt->_stackUndefColor;
-	const int udfChannel = _lt->_stackUndefChannel;
-	float udf = 0.0f;
+    _compositeDirtyOrigin = dirtyOrigin;
+    _compositeDirtyOpposite = dirtyOpposite;
+    setUpdateVar( _updateCompositeRegion, true );
+}
 
-	std::vector<LayerProcess*>::const_reverse_iterator it;
-	unsigned char* imagePtr = _image->data() + _start*4;
-	const int width = _image->s();
-	const pixel_int nrImagePixels = width * _image->t();
 
-	for ( pixel_int pixelNr=_start; pixelNr<=_stop; pixelNr++ )
-	{
-	    osg::Vec2f globalCoord( origin.x()+scale.x()*(pixelNr%width+0.5),
-				    origin.y()+scale.y()*(pixelNr/width+0.5) );
+void LayeredTexture::updateCompositeRegion()
+{
+    setUpdateVar( _updateCompositeRegion, false );
 
-	    osg::Vec4f fragColor( -1.0f, -1.0f, -1.0f, -1.0f );
+    const Vec2i origin = _compositeDirtyOrigin;
+    const Vec2i size = _compositeDirtyOpposite - _compositeDirtyOrigin;
+    _compositeDirtyOrigin = _compositeDirtyOpposite = Vec2i( 0, 0 );
 
-	    if ( udfLayer && !_dummyTexture )
-	    {
-		udf = udfLayer->getTextureVec(globalCoord)[udfChannel];
-		if ( _lt->_invertUndefLayers )
-		    udf = 1.0-udf;
-	    }
+    const int idx = getDataLayerIndex( _compositeLayerId );
+    LayeredTextureData& layer = *_dataLayers[idx];
+    osg::Image* image = layer._image.get();
 
-	    if ( udf<1.0 )
-	    {
-		for ( it=_processList->rbegin(); it!=_processList->rend(); it++ )
-		{
-		    (*it)->doProcess( fragColor, udf, globalCoord );
+    if ( _useShaders || _compositeLayerUpdate || !image || size.x()<1 || size.y()<1 )
+	return;
 
-		    if ( fragColor[3]>=1.0f )
-			break;
-		}
+    if ( _compositeJob )
+    {
+	// Running job may have read the region before it was modified
+	cancelCompositeJob();
+	return;
+    }
 
-		if ( _dummyTexture )
-		    fragColor = osg::Vec4f( 0.0f, 0.0f, 0.0f, 0.0f );
-		else if ( fragColor[0]==-1.0f )
-		    fragColor = osg::Vec4f( 1.0f, 1.0f, 1.0f, _minOpacity );
-	    }
+    if ( origin.x()<0 || origin.y()<0 || origin.x()+size.x()>image->s() || origin.y()+size.y()>image->t() )
+    {
+	setUpdateVar( _updateSetupStateSet, true );
+	return;
+    }
 
-	    if ( udf>=1.0f )
-		fragColor = udfColor;
-	    else if ( udf>0.0 )
-	    {
-		if ( udfColor[3]<=0.0f )
-		    fragColor[3] *= 1.0f-udf;
-		else if ( udfColor[3]>=1.0f && fragColor[3]>=1.0f )
-		    fragColor = fragColor*(1.0f-udf) + udfColor*udf;
-		else if ( fragColor[3]>0.0f )
-		{
-		    const float a = fragColor[3]*(1.0f-udf);
-		    const float b = udfColor[3]*udf;
-		    fragColor = (fragColor*a + udfColor*b) / (a+b);
-		    fragColor[3] = a+b;
-		}
-		else
-		{
-		    fragColor = udfColor;
-		    fragColor[3] *= udf;
-		}
-	    }
+    triggerStartWorkInProgress();
 
-	    if ( fragColor[3]<0.5f/255.0f )
-		fragColor = osg::Vec4f( 0.0f, 0.0f, 0.0f, 0.0f );
+    osg::Vec4f borderColor = getDataLayerBorderColor( _compositeLayerId );
+    const osg::Vec4f oldBorderColor = borderColor;
 
-	    if ( pixelNr<nrImagePixels )
-	    {
-		fragColor *= 255.0f;
-		for ( int tc=0; tc<4; tc++ )
-		{
-		    int val = (int) floor( fragColor[tc]+0.5 );
-		    val = val<=0 ? 0 : (val>=255 ? 255 : val);
+    compositeRegion( *image, origin, size, borderColor[0]>=0.0f ? &borderColor : 0, !_texInfo->_isValid );
 
-		    *imagePtr = (unsigned char) val;
-		    imagePtr++;
-		}
-	    }
-	    else
-		*_borderColor = fragColor;
-	}
+    if ( borderColor!=oldBorderColor )
+	setUpdateVar( _updateSetupStateSet, true );  // Uniform border changed
+    else
+    {
+	layer.clearTransparencyType();
+	layer.dirtyTileImages( origin, size );
+	setRenderingHint( getDataLayerTransparencyType(_compositeLayerId)==Opaque );
     }
+
+    triggerStopWorkInProgress();
 }
 
 
@@ -3424,6 +6568,45 @@ void LayeredTexture::createCompositeTexture( bool dummyTexture, bool triggerProg
     width *= _compositeSubsampleSteps;
     height *= _compositeSubsampleSteps;
 
+    osg::Vec2f origin = ti._envelopeOrigin;
+    osg::Vec2f size = ti._envelopeSize;
+
+    if ( _compositeViewDependent && !_useShaders && !dummyTexture )
+    {
+	Vec2i viewSize;
+	for ( int dim=0; dim<=1; dim++ )
+	{
+	    // Snap to the pixel grid of the full-resolution composite
+	    const float fullScale = ti._envelopeSize[dim] / (dim ? height : width);
+	    const float scale = fullScale * float(1<<_compositeViewLevel[dim]);
+
+	    float v0 = _compositeViewOrigin[dim] - ti._envelopeOrigin[dim];
+	    float v1 = _compositeViewOpposite[dim] - ti._envelopeOrigin[dim];
+	    v0 = scale * floor( v0/scale );
+	    v1 = scale * ceil( v1/scale );
+
+	    if ( v0<0.0f )
+		v0 = 0.0f;
+	    if ( v1>ti._envelopeSize[dim] )
+		v1 = ti._envelopeSize[dim];
+
+	    viewSize[dim] = (int) ceil( (v1-v0)/scale - EPS );
+	    origin[dim] += v0;
+	    size[dim] = viewSize[dim] * scale;
+	}
+
+	if ( viewSize.x()>0 && viewSize.y()>0 )
+	{
+	    width = viewSize.x();
+	    height = viewSize.y();
+	}
+	else
+	{
+	    origin = ti._envelopeOrigin;
+	    size = ti._envelopeSize;
+	}
+    }
+
     if ( dummyTexture || width<1 )
 	width = 1;
     if ( dummyTexture || height<1 )
@@ -3431,77 +6614,69 @@ void LayeredTexture::createCompositeTexture( bool dummyTexture, bool triggerProg
 
     const int idx = getDataLayerIndex( _compositeLayerId );
 
-    _dataLayers[idx]->_origin = ti._envelopeOrigin;
-    _dataLayers[idx]->_scale = osg::Vec2f( ti._envelopeSize.x()/float(width),
-					   ti._envelopeSize.y()/float(height) );
+    const osg::Vec2f scale( size.x()/float(width), size.y()/float(height) );
+    const bool moved = _dataLayers[idx]->_origin!=origin || _dataLayers[idx]->_scale!=scale;
 
     osg::Image* image = const_cast<osg::Image*>(_dataLayers[idx]->_image.get());
 
-    if ( !image || width!=image->s() || height!=image->t() )
-    {
-	image = new osg::Image;
-	image->allocateImage( width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE );
-    }
-
-    std::vector<LayerProcess*> processList;
-    float minOpacity = 1.0f;
-
-    std::vector<LayerProcess*>::const_iterator it = _processes.begin();
-    for ( ; _isOn && it!=_processes.end(); it++ )
-    {
-	if ( (*it)->getTransparencyType()!=FullyTransparent )
-	    processList.push_back( *it );
-
-	if ( (*it)->getOpacity() < minOpacity )
-	    minOpacity = (*it)->getOpacity();
-    }
-
-    pixel_int nrPixels = height*width;
-
     /* Cannot cover mixed use of uniform and extended-edge-pixel borders
        without shaders (trick with extra one-pixel wide border is screwed
        by mipmapping) */
     osg::Vec4f borderColor = getDataLayerBorderColor( _compositeLayerId );
-    if ( borderColor[0]>=0.0f )	
-	nrPixels++; // One extra pixel to compute uniform composite borderColor		
-    int nrTasks = OpenThreads::GetNumberOfProcessors();
 
-    if ( nrTasks<1 )
-	 nrTasks=1;
-    if ( nrTasks>nrPixels )
-	nrTasks = nrPixels;
+    if ( _asyncCompositing && image && !dummyTexture && !_useShaders )
+    {
+	// Previous composite stays on display until the job has finished
+	cancelCompositeJob( false );
+
+	osg::ref_ptr<osg::Image> newImage = new osg::Image;
+	newImage->allocateImage( width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE );
 
-    if (!_compositeThreads)
-	_compositeThreads = ThreadGroup<CompositeTextureThread>::getInst();
+	_compositeDirtyOrigin = _compositeDirtyOpposite = Vec2i( 0, 0 );
+	setUpdateVar( _updateCompositeRegion, false );
 
-    std::vector<osg::ref_ptr<CompositeTextureThread> > tasks;
-    OpenThreads::BlockCount readyCount( nrTasks );
-    readyCount.reset();
+	// Work in progress lasts until the job is finished or cancelled
+	if ( !triggerProgress )
+	    triggerStartWorkInProgress();
+
+	_compositeJob = new CompositeJob( *this, newImage.get(), origin, scale, borderColor );
+	_compositeJob->start();
+	return;
+    }
 
-    pixel_int remainder = nrPixels%nrTasks;
-    pixel_int start = 0;
+    _dataLayers[idx]->_origin = origin;
+    _dataLayers[idx]->_scale = scale;
 
-    while ( start<nrPixels )
+    // New image, since current tiles still refer to the old one if moved
+    if ( !image || width!=image->s() || height!=image->t() || moved )
     {
-	pixel_int stop = start + nrPixels/nrTasks;
-	if ( remainder )
-	    remainder--;
-	else
-	    stop--;
+	image = new osg::Image;
+	image->allocateImage( width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE );
+    }
 
-	osg::ref_ptr<CompositeTextureThread> task = _compositeThreads->getThread();
-	task->set( this, image, borderColor, processList, minOpacity, dummyTexture, start, stop, readyCount );
+    osg::Vec4f* borderColorPtr = borderColor[0]>=0.0f ? &borderColor : 0;
 
-	tasks.push_back( task.get() );
+    compositeRegion( *image, Vec2i(0,0), Vec2i(width,height), borderColorPtr, dummyTexture );
+    _compositeDirtyOrigin = _compositeDirtyOpposite = Vec2i( 0, 0 );
+    setUpdateVar( _updateCompositeRegion, false );
 
-	start = stop+1;
-    }
+    setCompositeImage( *image, origin, scale, borderColor );
+
+    if ( triggerProgress )
+	triggerStopWorkInProgress();
+}
 
-    readyCount.block();
+
+void LayeredTexture::setCompositeImage( osg::Image& image, const osg::Vec2f& origin, const osg::Vec2f& scale, const osg::Vec4f& borderColor )
+{
+    const int idx = getDataLayerIndex( _compositeLayerId );
+    triggerCancelBackgroundWork();
+    _dataLayers[idx]->_origin = origin;
+    _dataLayers[idx]->_scale = scale;
 
     const bool retilingNeededAlready = _tilingInfo->_retilingNeeded;
 
-    setDataLayerImage( _compositeLayerId, image );
+    setDataLayerImage( _compositeLayerId, &image );
 
     setUpdateVar( _retileCompositeLayer, 
 		  _tilingInfo->_needsUpdate ||
@@ -3515,15 +6690,97 @@ void LayeredTexture::createCompositeTexture( bool dummyTexture, bool triggerProg
 
     setUpdateVar( _tilingInfo->_needsUpdate, false );
     setUpdateVar( _tilingInfo->_retilingNeeded, retilingNeededAlready );
+}
 
-    if ( triggerProgress )
-	triggerStopWorkInProgress();
+
+void LayeredTexture::cancelCompositeJob( bool restart )
+{
+    // Background tiling by the nodes reads the same layer data
+    if ( restart )
+	triggerCancelBackgroundWork();
+
+    if ( !_compositeJob )
+	return;
+
+    CompositeJob* job = _compositeJob;
+    _compositeJob = 0;
+    delete job;
+
+    triggerStopWorkInProgress();
+
+    if ( restart )
+	setUpdateVar( _updateSetupStateSet, true );
+}
+
+
+void LayeredTexture::finishCompositeJobIfDone()
+{
+    if ( !_compositeJob || !_compositeJob->isDone() )
+	return;
+
+    CompositeJob* job = _compositeJob;
+    _compositeJob = 0;
+    job->finish();
+
+    setCompositeImage( *job->_image, job->_origin, job->_scale, job->_borderColor );
+    delete job;
+
+    if ( _setupStateSet && !_retileCompositeLayer )
+    {
+	_setupStateSet->clear();
+	setRenderingHint( getDataLayerTransparencyType(_compositeLayerId)==Opaque );
+    }
+
+    triggerStopWorkInProgress();
+}
+
+
+void LayeredTexture::setAsyncCompositing( bool yn )
+{
+    if ( _asyncCompositing==yn )
+	return;
+
+    _asyncCompositing = yn;
+    if ( !yn )
+	cancelCompositeJob();
+}
+
+
+bool LayeredTexture::isAsyncCompositing() const
+{ return _asyncCompositing; }
+
+
+bool LayeredTexture::checkCompositeJob()
+{
+    if ( !_compositeJob )
+	return false;
+
+    if ( !_compositeJob->isDone() )
+	return true;
+
+    // Swapped in by the cull traversal
+    triggerRedrawRequest();
+    return false;
 }
 
 
+void LayeredTexture::setTileCacheBudget( unsigned int nrBytes )
+{ tileTextureCache.setBudget( nrBytes ); }
+
+
+unsigned int LayeredTexture::getTileCacheBudget()
+{ return tileTextureCache.getBudget(); }
+
+
 const osg::Image* LayeredTexture::getCompositeTextureImage()
 {
     createCompositeTexture();
+    if ( _compositeJob )
+    {
+	_compositeJob->finish();
+	finishCompositeJobIfDone();
+    }
+
     return getDataLayerImage( _compositeLayerId );
 }
 
@@ -3547,97 +6804,222 @@ int LayeredTexture::getCompositeSubsampleSteps() const
 }
 
 
-//============================================================================
+void LayeredTexture::setCompositeViewRegion( const osg::Vec2f& origin, const osg::Vec2f& opposite, const osg::Vec2f& nrPixels )
+{
+    updateTilingInfoIfNeeded();
+    const osgGeo::TilingInfo& ti = *_tilingInfo;
+
+    if ( nrPixels.x()<=0.0f || nrPixels.y()<=0.0f || !isEnvelopeDefined() )
+	return;
 
+    osg::Vec2f viewOrigin, viewOpposite;
+    Vec2i level;
+    bool recomposite = !_compositeViewDependent;
 
-class PowerEncodingThread : public GroupThread<PowerEncodingThread>
+    for ( int dim=0; dim<=1; dim++ )
+    {
+	const float smallestScale = ti._smallestScale[dim];
+	float v0 = smallestScale*(origin[dim]+0.5) + ti._envelopeOrigin[dim];
+	float v1 = smallestScale*(opposite[dim]+0.5) + ti._envelopeOrigin[dim];
+	if ( v0>v1 )
+	    std::swap( v0, v1 );
+
+	const float envStart = ti._envelopeOrigin[dim];
+	const float envStop = envStart + ti._envelopeSize[dim];
+	if ( v0<envStart )
+	    v0 = envStart;
+	if ( v1>envStop )
+	    v1 = envStop;
+	if ( v1<=v0 )
+	    return;
+
+	// Coarsen by powers of 2 to avoid recompositing at every zoom step
+	const float fullScale = smallestScale / _compositeSubsampleSteps;
+	const float neededScale = (v1-v0) / nrPixels[dim];
+	level[dim] = 0;
+	while ( level[dim]<16 && fullScale*float(2<<level[dim])<=neededScale )
+	    level[dim]++;
+
+	if ( level[dim]<_compositeViewLevel[dim] || level[dim]>_compositeViewLevel[dim]+1 )
+	    recomposite = true;
+
+	if ( v0<_compositeViewOrigin[dim] || v1>_compositeViewOpposite[dim] )
+	    recomposite = true;
+
+	// Margin around the view saves recompositing at small pans
+	const float margin = 0.25f * (v1-v0);
+	viewOrigin[dim] = v0>envStart+margin ? v0-margin : envStart;
+	viewOpposite[dim] = v1<envStop-margin ? v1+margin : envStop;
+    }
+
+    if ( !recomposite )
+	return;
+
+    _compositeViewDependent = true;
+    _compositeViewOrigin = viewOrigin;
+    _compositeViewOpposite = viewOpposite;
+    _compositeViewLevel = level;
+
+    if ( !_useShaders )
+	setUpdateVar( _updateSetupStateSet, true );
+}
+
+
+void LayeredTexture::clearCompositeViewRegion()
 {
-public:
-    		PowerEncodingThread(ThreadGroup<PowerEncodingThread>& tg)
-		    : GroupThread<PowerEncodingThread>(tg)
-		{}
+    if ( !_compositeViewDependent )
+	return;
 
-    void	set(unsigned char* dataPtr,
-		    int pixelSizeInBytes,int nrPowerChannels,
-		    pixel_int startNr,pixel_int stopNr,
-		    OpenThreads::BlockCount& ready)
-		{
-		    beginSetFunction( &ready );
+    _compositeViewDependent = false;
+    _compositeViewLevel = Vec2i( 0, 0 );
 
-		    _dataPtr = dataPtr;
-		    _pixelSizeInBytes = pixelSizeInBytes;
-		    _nrPowerChannels = nrPowerChannels;
-		    _startNr = startNr;
-		    _stopNr = stopNr;
+    if ( !_useShaders )
+	setUpdateVar( _updateSetupStateSet, true );
+}
 
-		    endSetFunction();
-		}
 
-protected:
+bool LayeredTexture::hasCompositeViewRegion() const
+{
+    return _compositeViewDependent;
+}
 
-    void		doWork();
 
-    unsigned char*	_dataPtr;
-    pixel_int		_startNr;
-    pixel_int		_stopNr;
-    int			_pixelSizeInBytes;
-    int			_nrPowerChannels;
-};
+//============================================================================
 
 
-void PowerEncodingThread::doWork()
+/* Squared base channel values, as one rounded byte or as two bytes of
+   increasing precision. Built once at start-up. */
+
+struct PowerLuts
 {
-    const int step = _pixelSizeInBytes;
-    unsigned char* ptr = _dataPtr + _startNr*step;
-    const unsigned char* endPtr = _dataPtr + _stopNr*step;
+			PowerLuts()
+			{
+			    for ( int idx=0; idx<256; idx++ )
+			    {
+				const float val = idx*idx/255.0f;
+				_single[idx] = (unsigned char) floor( 0.5 + val );
+				_high[idx] = (unsigned char) floor( val );
+				_low[idx] = (unsigned char) floor( 0.5 + (val-_high[idx])*255.0f );
+			    }
+			}
+
+    unsigned char	_single[256];
+    unsigned char	_high[256];
+    unsigned char	_low[256];
+};
+
+static const PowerLuts powerLuts;
 
-    unsigned char lut1[256];
 
-    if ( _nrPowerChannels==2 )
+template <int NrPowerChannels>
+static void encodePowerPixels( unsigned char* ptr, pixel_int step, pixel_int nrPixels )
+{
+    const unsigned char* lut1 = NrPowerChannels==2 ? powerLuts._high : powerLuts._single;
+    const unsigned char* lut2 = powerLuts._low;
+
+    // Four independent pixels per iteration hide the table load latency
+    for ( ; nrPixels>=4; nrPixels-=4 )
     {
-	unsigned char lut2[256];
+	const unsigned char v0 = ptr[0];
+	const unsigned char v1 = ptr[step];
+	const unsigned char v2 = ptr[2*step];
+	const unsigned char v3 = ptr[3*step];
 
-	for ( int idx=0; idx<256; idx++ )
-	{
-	    const float val = idx*idx/255.0f;
-	    lut1[idx] = (unsigned char) floor( val );
-	    lut2[idx] = (unsigned char) floor( 0.5 + (val-lut1[idx])*255.0f );
-	}
+	ptr[1] = lut1[v0];
+	ptr[step+1] = lut1[v1];
+	ptr[2*step+1] = lut1[v2];
+	ptr[3*step+1] = lut1[v3];
 
-	while ( ptr < endPtr )
+	if ( NrPowerChannels==2 )
 	{
-	    *(ptr+1) = lut1[*ptr];
-	    *(ptr+2) = lut2[*ptr];
-	    ptr += step;
+	    ptr[2] = lut2[v0];
+	    ptr[step+2] = lut2[v1];
+	    ptr[2*step+2] = lut2[v2];
+	    ptr[3*step+2] = lut2[v3];
 	}
+
+	ptr += 4*step;
     }
-    else
+
+    for ( ; nrPixels>0; nrPixels-- )
     {
-	for ( int idx=0; idx<256; idx++ )
-	{
-	    const float val = idx*idx/255.0f;
-	    lut1[idx] = (unsigned char) floor( 0.5 + val );
-	}
+	ptr[1] = lut1[*ptr];
+	if ( NrPowerChannels==2 )
+	    ptr[2] = lut2[*ptr];
 
-	while ( ptr < endPtr )
-	{
-	    *(ptr+1) = lut1[*ptr];
-	    ptr += step;
-	}
+	ptr += step;
     }
 }
 
 
-int LayeredTexture::encodeBaseChannelPower( osg::Image& image, int nrPowerChannels )
+/* Encodes the squared base channel value in one or two of the next byte
+   channels of a rectangle of pixels. Items are the rectangle pixels in
+   row-major order, for parallelFor(.) */
+
+class PowerEncodingTask : public ParallelForBody
 {
-    if ( nrPowerChannels<1 )
+public:
+		PowerEncodingTask(unsigned char* dataPtr,pixel_int xStep,
+				  pixel_int yStep,pixel_int xSize,
+				  int nrPowerChannels);
+
+    void	run(size_t start,size_t stop);
+
+protected:
+
+    unsigned char*	_dataPtr;
+    pixel_int		_xStep;
+    pixel_int		_yStep;
+    pixel_int		_xSize;
+    int			_nrPowerChannels;
+};
+
+
+PowerEncodingTask::PowerEncodingTask( unsigned char* dataPtr, pixel_int xStep, pixel_int yStep, pixel_int xSize, int nrPowerChannels )
+    : _dataPtr( dataPtr )
+    , _xStep( xStep )
+    , _yStep( yStep )
+    , _xSize( xSize )
+    , _nrPowerChannels( nrPowerChannels )
+{}
+
+
+void PowerEncodingTask::run( size_t start, size_t stop )
+{
+    while ( start<stop )
+    {
+	const size_t y = start / _xSize;
+	const size_t x = start % _xSize;
+	const size_t nrPixels = std::min( stop-start, size_t(_xSize-x) );
+
+	unsigned char* ptr = _dataPtr + y*_yStep + x*_xStep;
+
+	if ( _nrPowerChannels==2 )
+	    encodePowerPixels<2>( ptr, _xStep, nrPixels );
+	else
+	    encodePowerPixels<1>( ptr, _xStep, nrPixels );
+
+	start += nrPixels;
+    }
+}
+
+
+static int getMaxPowerChannels( const osg::Image& image )
+{
+    if ( image.getDataType()!=GL_UNSIGNED_BYTE )
 	return 0;
 
     const int pixelSizeInBytes  = image.getPixelSizeInBits()/8;
-    int maxPowerChannels = pixelSizeInBytes>2 ? 2 : pixelSizeInBytes-1;
-    if ( image.getDataType()!=GL_UNSIGNED_BYTE )
-	maxPowerChannels = 0;
+    return pixelSizeInBytes>2 ? 2 : pixelSizeInBytes-1;
+}
+
+
+int LayeredTexture::encodeBaseChannelPower( osg::Image& image, int nrPowerChannels )
+{
+    if ( nrPowerChannels<1 )
+	return 0;
 
+    const int maxPowerChannels = getMaxPowerChannels( image );
     if ( nrPowerChannels>maxPowerChannels )
 	nrPowerChannels = maxPowerChannels;
 
@@ -3647,44 +7029,44 @@ int LayeredTexture::encodeBaseChannelPower( osg::Image& image, int nrPowerChanne
 	return 0;
     }
 
+    const int pixelSizeInBytes  = image.getPixelSizeInBits()/8;
     const pixel_int nrPixels = image.getTotalSizeInBytes() / pixelSizeInBytes;
-    const pixel_int maxTasks = nrPixels/1024;
-
-    int nrTasks = OpenThreads::GetNumberOfProcessors();
 
-    if ( nrTasks>maxTasks )
-	nrTasks = maxTasks;
-    if ( nrTasks<1 )
-	nrTasks = 1;
+    PowerEncodingTask task( image.data(), pixelSizeInBytes, 0, nrPixels, nrPowerChannels );
+    parallelFor( nrPixels, task, 1024 );
 
-    if ( !_powerEncodingThreads )
-	_powerEncodingThreads = ThreadGroup<PowerEncodingThread>::getInst();
+    return nrPowerChannels;
+}
 
-    std::vector<osg::ref_ptr<PowerEncodingThread> > tasks;
-    OpenThreads::BlockCount readyCount( nrTasks );
-    readyCount.reset();
 
-    pixel_int remainder = nrPixels%nrTasks;
-    pixel_int start = 0;
+void LayeredTexture::encodeBaseChannelPower( osg::Image& image, int nrPowerChannels, const Vec2i& origin, const Vec2i& size, int sliceNr, ImageDataOrder dataOrder )
+{
+    if ( nrPowerChannels<1 || nrPowerChannels>getMaxPowerChannels(image) )
+	return;
 
-    while ( start<nrPixels )
+    // Clip to the (permuted) image slice
+    Vec2i start( origin ), stop( origin+size );
+    const Vec2i imageSize( image.s(), image.t() );
+    for ( int dim=0; dim<=1; dim++ )
     {
-	pixel_int stop = start + nrPixels/nrTasks;
-	if ( remainder )
-	    remainder--;
-	else
-	    stop--;
+	start[dim] = std::max( start[dim], 0 );
+	stop[dim] = std::min( stop[dim], imageSize[dim] );
+	if ( start[dim]>=stop[dim] )
+	    return;
+    }
 
-	osg::ref_ptr<PowerEncodingThread> task = _powerEncodingThreads->getThread();
-	task->set( image.data(), pixelSizeInBytes, nrPowerChannels, start, stop, readyCount );
+    if ( sliceNr>=image.r() )
+	sliceNr = image.r()-1;
 
-	tasks.push_back( task.get() );
+    pixel_int xStep, yStep, zStep;
+    getImageSteps( image, dataOrder, xStep, yStep, zStep );
+    unsigned char* dataPtr = image.data() + start.x()*xStep + start.y()*yStep + sliceNr*zStep;
 
-	start = stop+1;
-    }
+    const int xSize = stop.x()-start.x();
+    const pixel_int nrPixels = pixel_int(xSize) * (stop.y()-start.y());
 
-    readyCount.block();
-    return nrPowerChannels;
+    PowerEncodingTask task( dataPtr, xStep, yStep, xSize, nrPowerChannels );
+    parallelFor( nrPixels, task, 1024 );
 }
 
 
@@ -0,0 +1,194 @@
+/* osgGeo - A collection of geoscientific extensions to OpenSceneGraph.
+Copyright 2011 dGB Beheer B.V.
+
+osgGeo is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+
+$Id$
+
+*/
+
+
+#include <osgGeo/MappedImage>
+#include <iostream>
+
+#if defined(_MSC_VER) || defined(_WIN32)
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+
+namespace osgGeo
+{
+
+
+MappedImage::MappedImage()
+    : _headerOffset( 0 )
+    , _dataOrder( STR )
+    , _mapping( 0 )
+    , _mappingSize( 0 )
+{
+    _fileDims[0] = _fileDims[1] = _fileDims[2] = 0;
+}
+
+
+MappedImage::MappedImage( const MappedImage& mi, const osg::CopyOp& co )
+    : osg::Image()
+    , _headerOffset( 0 )
+    , _dataOrder( STR )
+    , _mapping( 0 )
+    , _mappingSize( 0 )
+{
+    _fileDims[0] = _fileDims[1] = _fileDims[2] = 0;
+
+    // Copying the data would defeat the purpose, so map the file again
+    setName( mi.getName() );
+    if ( mi.isOpen() )
+    {
+	open( mi._fileName.c_str(), mi._headerOffset, mi._fileDims[0],
+	      mi._fileDims[1], mi._fileDims[2], mi.getPixelFormat(),
+	      mi.getDataType(), mi._dataOrder );
+    }
+}
+
+
+MappedImage::~MappedImage()
+{
+    close();
+}
+
+
+bool MappedImage::open( const char* fileName, unsigned long long headerOffset, int s, int t, int r, GLenum pixelFormat, GLenum dataType, ImageDataOrder dataOrder )
+{
+    close();
+
+    const unsigned int pixelSizeInBits = osg::Image::computePixelSizeInBits( pixelFormat, dataType );
+    if ( !fileName || s<1 || t<1 || r<1 || !pixelSizeInBits || pixelSizeInBits%8 )
+    {
+	std::cerr << "Invalid layout of mapped image" << std::endl;
+	return false;
+    }
+
+    const unsigned long long dataSize = (unsigned long long) s * t * r * (pixelSizeInBits/8);
+
+    unsigned long long fileSize = 0;
+    unsigned long long pageSize = 0;
+    void* mapping = 0;
+
+#if defined(_MSC_VER) || defined(_WIN32)
+    HANDLE file = CreateFileA( fileName, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, 0 );
+    if ( file==INVALID_HANDLE_VALUE )
+    {
+	std::cerr << "Cannot open image file: " << fileName << std::endl;
+	return false;
+    }
+
+    LARGE_INTEGER size;
+    if ( GetFileSizeEx(file,&size) )
+	fileSize = size.QuadPart;
+
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo( &systemInfo );
+    pageSize = systemInfo.dwAllocationGranularity;
+#else
+    const int file = ::open( fileName, O_RDONLY );
+    if ( file<0 )
+    {
+	std::cerr << "Cannot open image file: " << fileName << std::endl;
+	return false;
+    }
+
+    struct stat status;
+    if ( !fstat(file,&status) )
+	fileSize = status.st_size;
+
+    pageSize = sysconf( _SC_PAGESIZE );
+#endif
+
+    // Mappings start at a page boundary
+    const unsigned long long mappingOffset = headerOffset - headerOffset%pageSize;
+    const unsigned long long mappingSize = dataSize + headerOffset - mappingOffset;
+
+    if ( headerOffset+dataSize > fileSize )
+	std::cerr << "Image file too small: " << fileName << std::endl;
+    else if ( mappingSize != (unsigned long long) (size_t) mappingSize )
+	std::cerr << "Image file too large to map: " << fileName << std::endl;
+    else
+    {
+	/* Copy-on-write keeps the file untouched by writes through the image.
+	   Pages that are only read stay clean, so they are never swapped. */
+#if defined(_MSC_VER) || defined(_WIN32)
+	HANDLE fileMapping = CreateFileMappingA( file, 0, PAGE_WRITECOPY, 0, 0, 0 );
+	if ( fileMapping )
+	{
+	    mapping = MapViewOfFile( fileMapping, FILE_MAP_COPY, DWORD(mappingOffset>>32), DWORD(mappingOffset&0xFFFFFFFF), SIZE_T(mappingSize) );
+	    CloseHandle( fileMapping );	    // Kept open by the view
+	}
+#else
+	mapping = mmap( 0, size_t(mappingSize), PROT_READ|PROT_WRITE, MAP_PRIVATE, file, off_t(mappingOffset) );
+	if ( mapping==MAP_FAILED )
+	    mapping = 0;
+#endif
+	if ( !mapping )
+	    std::cerr << "Cannot map image file: " << fileName << std::endl;
+    }
+
+#if defined(_MSC_VER) || defined(_WIN32)
+    CloseHandle( file );
+#else
+    ::close( file );
+#endif
+
+    if ( !mapping )
+	return false;
+
+    _mapping = mapping;
+    _mappingSize = mappingSize;
+    _fileName = fileName;
+    _headerOffset = headerOffset;
+    _fileDims[0] = s; _fileDims[1] = t; _fileDims[2] = r;
+    _dataOrder = dataOrder;
+
+    unsigned char* data = (unsigned char*) mapping + (headerOffset-mappingOffset);
+    setImage( s, t, r, pixelFormat, pixelFormat, dataType, data, osg::Image::NO_DELETE, 1 );
+    return true;
+}
+
+
+void MappedImage::close()
+{
+    if ( !_mapping )
+	return;
+
+    setImage( 0, 0, 0, 0, 0, 0, 0, osg::Image::NO_DELETE );
+
+#if defined(_MSC_VER) || defined(_WIN32)
+    UnmapViewOfFile( _mapping );
+#else
+    munmap( _mapping, size_t(_mappingSize) );
+#endif
+
+    _mapping = 0;
+    _mappingSize = 0;
+    _fileDims[0] = _fileDims[1] = _fileDims[2] = 0;
+    _fileName.clear();
+    _headerOffset = 0;
+    _dataOrder = STR;
+}
+
+
+} //namespace
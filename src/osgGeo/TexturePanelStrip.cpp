@@ -25,12 +25,14 @@ $Id$
 #include <osgGeo/LayeredTexture>
 #include <osgGeo/ComputeBoundsVisitor>
 #include <osgGeo/Vec2i>
+#include <osgGeo/ThreadGroup>
 
 #include <osg/Geometry>
 #include <osg/LightModel>
 #include <osg/Version>
 #include <osgUtil/CullVisitor>
 #include <osgUtil/IntersectionVisitor>
+#include <algorithm>
 #include <iostream>
 
 namespace osgGeo
@@ -108,6 +110,7 @@ public:
     {}
 
     virtual void requestRedraw() const		{ _tpsn.forceRedraw(); }
+    virtual void cancelBackgroundWork() const	{ _tpsn.interruptTilingJob(); }
 
 protected:
     TexturePanelStripNode&	_tpsn;
@@ -117,6 +120,101 @@ protected:
 //============================================================================
 
 
+/* Texture part of a tile, which survives retiling as long as the layered
+   texture itself has not been retiled. */
+
+class TexturePanelStripNode::TileCutout : public osg::Referenced
+{
+public:
+    osg::Vec2					_origin;
+    osg::Vec2					_opposite;
+    osg::ref_ptr<osg::StateSet>			_stateset;
+    std::vector<LayeredTexture::TextureCoordData> _tcData;
+};
+
+
+//============================================================================
+
+
+/* Builds new tiles on the ThreadPool, in a private node holding a copy of
+   the input at the time of the request. That node shares the layered
+   texture, but does not register as its callback. The texture's read lock
+   is held while tiling, as layer changes wait for the job to be cancelled. */
+
+class TexturePanelStripNode::TilingJob : public ThreadPoolTask
+{
+public:
+			TilingJob(TexturePanelStripNode&);
+			~TilingJob()		{ cancel(); }
+
+    void		start()			{ _group.submit( *this ); }
+    void		execute();
+    void		cancel();
+    void		finish()		{ _group.wait(); }
+    bool		isDone() const		{ return _done>0; }
+    bool		isCancelled() const	{ return _cancelled>0; }
+
+    osg::ref_ptr<TexturePanelStripNode>	_tiling;
+
+protected:
+
+    OpenThreads::Atomic			_cancelled;
+    OpenThreads::Atomic			_done;
+    TaskGroup				_group;
+};
+
+
+TexturePanelStripNode::TilingJob::TilingJob( TexturePanelStripNode& node )
+    : _tiling( new TexturePanelStripNode )
+{
+    TexturePanelStripNode& tiling = *_tiling;
+    tiling._texture = node._texture;
+    tiling._textureBrickSize = node._textureBrickSize;
+    tiling._isBrickSizeStrict = node._isBrickSizeStrict;
+    *tiling._pathCoords = *node._pathCoords;
+    *tiling._pathTexOffsets = *node._pathTexOffsets;
+    tiling._pathTextureShift = node._pathTextureShift;
+    tiling._pathTexShiftStartIdx = node._pathTexShiftStartIdx;
+    tiling._top = node._top;
+    tiling._bottom = node._bottom;
+    tiling._validZRangeOffsets = node._validZRangeOffsets;
+    tiling._topTexOffset = node._topTexOffset;
+    tiling._bottomTexOffset = node._bottomTexOffset;
+    tiling._zTextureShift = node._zTextureShift;
+    tiling._swapTextureAxes = node._swapTextureAxes;
+    tiling._smoothNormals = node._smoothNormals;
+    *tiling._panelWidths = *node._panelWidths;
+    *tiling._panelNormals = *node._panelNormals;
+    *tiling._knotNormals = *node._knotNormals;
+    tiling._altTileMode = node._altTileMode;
+}
+
+
+void TexturePanelStripNode::TilingJob::cancel()
+{
+    _cancelled.exchange( 1 );
+    finish();
+}
+
+
+void TexturePanelStripNode::TilingJob::execute()
+{
+    if ( _cancelled )
+	return;
+
+    _tiling->_texture->readLock();
+    const bool done = !_cancelled && _tiling->createTiling( &_cancelled );
+    _tiling->_texture->readUnLock();
+
+    // Picked up by the update traversal, as workers leave the scene alone
+    if ( done )
+	_done.exchange( 1 );
+}
+
+
+//============================================================================
+
+
 TexturePanelStripNode::TexturePanelStripNode()
     : _texture( 0 )
     , _textureBrickSize( 64 )
@@ -139,6 +237,13 @@ TexturePanelStripNode::TexturePanelStripNode()
     , _needsUpdate( false )
     , _frozen( false )
     , _isRedrawing( false )
+    , _tilingTexelSizeRatio( 0.0f )
+    , _tilingRetilingNr( -1 )
+    , _nrTilingUpdates( 0 )
+    , _nrGeometryUpdates( 0 )
+    , _asyncTiling( false )
+    , _tilingJob( 0 )
+    , _nrCancelledTilings( 0 )
     , _altTileMode( 0 )
 {
     setUpdateVar( _needsUpdate, true );
@@ -178,6 +283,13 @@ TexturePanelStripNode::TexturePanelStripNode( const TexturePanelStripNode& node,
     , _needsUpdate( false )
     , _frozen( false )
     , _isRedrawing( false )
+    , _tilingTexelSizeRatio( 0.0f )
+    , _tilingRetilingNr( -1 )
+    , _nrTilingUpdates( 0 )
+    , _nrGeometryUpdates( 0 )
+    , _asyncTiling( node._asyncTiling )
+    , _tilingJob( 0 )
+    , _nrCancelledTilings( 0 )
     , _altTileMode( 0 )
 {
     setUpdateVar( _needsUpdate, true );
@@ -203,6 +315,7 @@ TexturePanelStripNode::TexturePanelStripNode( const TexturePanelStripNode& node,
 
 TexturePanelStripNode::~TexturePanelStripNode()
 {
+    cancelTilingJob( false );
     cleanUp();
     setTexture( 0 );
 }
@@ -221,6 +334,7 @@ void TexturePanelStripNode::cleanUp()
 	(*it)->unref();
 
     _statesets.clear();
+    _tileCutouts.clear();
 
     _compositeCutoutOrigins.clear();
     _compositeCutoutSizes.clear();
@@ -236,6 +350,7 @@ void TexturePanelStripNode::setTexture( osgGeo::LayeredTexture* lt )
 	_texture->removeCallback( _textureCallbackHandler );
     
     _texture = lt;
+    _tilingRetilingNr = -1;
 
     if ( _texture )
 	_texture->addCallback( _textureCallbackHandler );
@@ -455,12 +570,18 @@ void TexturePanelStripNode::traverse( osg::NodeVisitor& nv )
     if ( nv.getVisitorType()==osg::NodeVisitor::UPDATE_VISITOR )
     {
 	forceRedraw( false );
+	finishTilingJobIfDone();
 
 	if ( _texture && _texture->needsRetiling() )
 	    setUpdateVar( _needsUpdate, true );
 
 	if ( !_frozen && _needsUpdate && updateGeometry() )
 	    setUpdateVar( _needsUpdate, false );
+
+	// Pending jobs are polled, as they cannot request an update
+	const bool compositing = _texture && _texture->checkCompositeJob();
+	if ( _tilingJob || compositing )
+	    forceRedraw( true );
     }
     else if ( nv.getVisitorType()==osg::NodeVisitor::CULL_VISITOR )
     {
@@ -660,17 +781,97 @@ float TexturePanelStripNode::getTexelSizeRatio() const
 
 bool TexturePanelStripNode::updateGeometry()
 {
-    cleanUp();
+    cancelTilingJob( false );
 
     int nrKnots = _pathTexOffsets->size();
     if ( nrKnots>(int)_pathCoords->size() )
 	nrKnots = _pathCoords->size();
 
     if ( !_texture || nrKnots<2 )
+    {
+	cleanUp();
 	return false;
+    }
+
+    if ( updateTileGeometries() )
+    {
+	_nrGeometryUpdates++;
+	return true;
+    }
 
     _texture->reInitTiling( getTexelSizeRatio() );
 
+    if ( _asyncTiling )
+    {
+	// Current tiles stay on display until the job has finished
+	_tilingJob = new TilingJob( *this );
+	_tilingJob->_tiling->_tilingRetilingNr = _texture->getNrRetilings();
+	_tilingJob->start();
+	return true;
+    }
+
+    cleanUp();
+    createTiling();
+    _tilingRetilingNr = _texture->getNrRetilings();
+    _nrTilingUpdates++;
+    return true;
+}
+
+
+bool TexturePanelStripNode::updateTileGeometries()
+{
+    // Other tilings of the layered texture may have released its tiles
+    if ( _tileCutouts.empty() || _texture->needsRetiling() ||
+	 _texture->getNrRetilings()!=_tilingRetilingNr )
+	return false;
+
+    const float ratio = getTexelSizeRatio();
+    if ( fabs(ratio-_tilingTexelSizeRatio) > 1e-6*fabs(_tilingTexelSizeRatio) )
+	return false;
+
+    std::vector<osg::ref_ptr<TileCutout> > cutouts;
+    cutouts.swap( _tileCutouts );
+
+    TileCutoutMap reusable;
+    for ( unsigned int idx=0; idx<cutouts.size(); idx++ )
+    {
+	const TileCutout& cutout = *cutouts[idx];
+	reusable[std::make_pair(cutout._origin,cutout._opposite)] = cutouts[idx].get();
+    }
+
+    cleanUp();
+    if ( createTiling(0,&reusable) )
+	return true;
+
+    cleanUp();
+    return false;
+}
+
+
+TexturePanelStripNode::TileCutout* TexturePanelStripNode::getTileCutout( const osg::Vec2& origin, const osg::Vec2& opposite, const TileCutoutMap* reusable ) const
+{
+    if ( reusable )
+    {
+	TileCutoutMap::const_iterator it = reusable->find( std::make_pair(origin,opposite) );
+	return it==reusable->end() ? 0 : it->second;
+    }
+
+    TileCutout* cutout = new TileCutout;
+    cutout->_origin = origin;
+    cutout->_opposite = opposite;
+    cutout->_stateset = _texture->createCutoutStateSet( origin, opposite, cutout->_tcData );
+    return cutout;
+}
+
+
+bool TexturePanelStripNode::createTiling( const OpenThreads::Atomic* cancelled, const TileCutoutMap* reusable )
+{
+    _tilingTexelSizeRatio = getTexelSizeRatio();
+
+    int nrKnots = _pathTexOffsets->size();
+    if ( nrKnots>(int)_pathCoords->size() )
+	nrKnots = _pathCoords->size();
+
     std::vector<float> xTicks, yTicks, zCoords, zOffsets;
     _texture->planTiling(_textureBrickSize, xTicks, yTicks, _isBrickSizeStrict);
     finalizeZTiling( (_swapTextureAxes ? xTicks : yTicks), zCoords, zOffsets );
@@ -694,6 +895,9 @@ bool TexturePanelStripNode::updateGeometry()
 
     for ( int sIdx=1; sIdx<=sLast; sIdx++ )
     {
+	if ( cancelled && *cancelled )
+	    return false;
+
 	if ( sIdx!=sLast && calcPathTexOffset(0)>sOrigins[sIdx]-EPS )
 	    continue;
 
@@ -745,6 +949,9 @@ bool TexturePanelStripNode::updateGeometry()
 
 	for ( unsigned int zIdx=1; zIdx<zCoords.size(); zIdx++ )
 	{
+	    if ( cancelled && *cancelled )
+		return false;
+
 	    osg::ref_ptr<osg::Vec3Array> coords = new osg::Vec3Array;
 	    osg::ref_ptr<osg::Vec3Array> normals = new osg::Vec3Array;
 	    osg::ref_ptr<osg::Geometry> geometry = new osg::Geometry;
@@ -763,7 +970,6 @@ bool TexturePanelStripNode::updateGeometry()
 		}
 	    }
 
-	    std::vector<LayeredTexture::TextureCoordData> tcData;
 	    osg::Vec2f origin, opposite;
 	    if ( _swapTextureAxes )
 	    {
@@ -776,7 +982,14 @@ bool TexturePanelStripNode::updateGeometry()
 		opposite = osg::Vec2f( lastOffset, zOffsets[zIdx] );
 	    }
 
-	    osg::ref_ptr<osg::StateSet> stateset = _texture->createCutoutStateSet( origin, opposite, tcData );
+	    if ( _texture->isCutoutEmpty(origin,opposite) )
+		continue;
+
+	    osg::ref_ptr<TileCutout> cutout = getTileCutout( origin, opposite, reusable );
+	    if ( !cutout )
+		return false;
+
+	    const std::vector<LayeredTexture::TextureCoordData>& tcData = cutout->_tcData;
 
 	    std::vector<LayeredTexture::TextureCoordData>::const_iterator it = tcData.begin();
 	    for ( ; it!=tcData.end(); it++ )
@@ -820,8 +1033,9 @@ bool TexturePanelStripNode::updateGeometry()
 	    {
 		geometry->ref();
 		_geometries.push_back( geometry );
-		stateset->ref();
-		_statesets.push_back( stateset );
+		cutout->_stateset->ref();
+		_statesets.push_back( cutout->_stateset.get() );
+		_tileCutouts.push_back( cutout );
 
 		_compositeCutoutOrigins.push_back( tcData.size() ? tcData.begin()->_cutoutOrigin : Vec2i(0,0) );
 		_compositeCutoutSizes.push_back( tcData.size() ? tcData.begin()->_cutoutSize : Vec2i(0,0) );
@@ -857,4 +1071,89 @@ const std::vector<Vec2i>& TexturePanelStripNode::getCompositeCutoutSizes() const
 { return _compositeCutoutSizes; }
 
 
+void TexturePanelStripNode::cancelTilingJob( bool restart )
+{
+    if ( !_tilingJob )
+	return;
+
+    TilingJob* job = _tilingJob;
+    _tilingJob = 0;
+    if ( !job->isDone() || job->isCancelled() )
+	_nrCancelledTilings++;
+
+    delete job;
+
+    if ( restart )
+	setUpdateVar( _needsUpdate, true );
+}
+
+
+void TexturePanelStripNode::interruptTilingJob()
+{
+    // Layer changes wait for the job before taking the texture's write lock
+    if ( !_tilingJob )
+	return;
+
+    _tilingJob->cancel();
+    setUpdateVar( _needsUpdate, true );
+}
+
+
+void TexturePanelStripNode::finishTilingJobIfDone()
+{
+    // Interrupted jobs may have read changing layer data
+    if ( !_tilingJob || !_tilingJob->isDone() || _tilingJob->isCancelled() )
+	return;
+
+    TilingJob* job = _tilingJob;
+    _tilingJob = 0;
+    job->finish();
+
+    // Swaps in all at once, leaving the old tiles to the job
+    TexturePanelStripNode& tiling = *job->_tiling;
+    _geometries.swap( tiling._geometries );
+    _statesets.swap( tiling._statesets );
+    _compositeCutoutOrigins.swap( tiling._compositeCutoutOrigins );
+    _compositeCutoutSizes.swap( tiling._compositeCutoutSizes );
+    _tileCutouts.swap( tiling._tileCutouts );
+    std::swap( _tilingTexelSizeRatio, tiling._tilingTexelSizeRatio );
+    std::swap( _tilingRetilingNr, tiling._tilingRetilingNr );
+
+    _nrTilingUpdates++;
+
+    delete job;
+}
+
+
+void TexturePanelStripNode::setAsyncTiling( bool yn )
+{
+    if ( _asyncTiling==yn )
+	return;
+
+    _asyncTiling = yn;
+    if ( !yn )
+	cancelTilingJob();
+}
+
+
+bool TexturePanelStripNode::isAsyncTiling() const
+{ return _asyncTiling; }
+
+
+bool TexturePanelStripNode::isTilingInProgress() const
+{ return _tilingJob!=0; }
+
+
+int TexturePanelStripNode::getNrCancelledTilings() const
+{ return _nrCancelledTilings; }
+
+
+int TexturePanelStripNode::getNrTilingUpdates() const
+{ return _nrTilingUpdates; }
+
+
+int TexturePanelStripNode::getNrGeometryUpdates() const
+{ return _nrGeometryUpdates; }
+
+
 } //namespace osgGeo
@@ -22,13 +22,22 @@ $Id$
 #include <osgGeo/TexturePlane>
 #include <osgGeo/ComputeBoundsVisitor>
 #include <osgGeo/LayeredTexture>
+#include <osgGeo/ThreadGroup>
 #include <osgUtil/CullVisitor>
 #include <osgUtil/IntersectionVisitor>
+#include <OpenThreads/ScopedLock>
+#include <osg/FrameStamp>
 #include <osg/Geometry>
 #include <osg/LightModel>
 #include <osg/Matrix>
+#include <osg/Transform>
+#include <osg/Uniform>
 #include <osgGeo/Vec2i>
 #include <osg/Version>
+#include <osg/Viewport>
+#include <algorithm>
+#include <cfloat>
+#include <cstdio>
 
 
 namespace osgGeo
@@ -110,6 +119,11 @@ public:
     {}
 
     virtual void requestRedraw() const		{ _tpn.forceRedraw(); }
+    virtual void cancelBackgroundWork() const
+		{
+		    _tpn.interruptTilingJob();
+		    _tpn.interruptLODJob();
+		}
 
 protected:
     TexturePlaneNode&	_tpn;
@@ -119,6 +133,206 @@ protected:
 //============================================================================
 
 
+/* Node of the adaptive tiling quadtree. A tile at level n covers 2^n by 2^n
+   bricks of the full resolution tiling plan and samples the data layers
+   reduced 2^n times. Split tiles keep their own StateSet, so that merging
+   them back is immediate. */
+
+class TexturePlaneNode::LODTile : public osg::Referenced
+{
+public:
+			LODTile(int level,int sIdx,int tIdx)
+			    : _level( level )
+			    , _sIdx( sIdx )
+			    , _tIdx( tIdx )
+			{}
+
+    bool		isSplit() const		{ return !_children.empty(); }
+    int			getNrTiles() const;
+    LODTileKey		getKey() const
+			{ return LODTileKey( _level, _sIdx, _tIdx ); }
+
+    const int				_level;
+    const int				_sIdx;
+    const int				_tIdx;
+    osg::Vec3				_corners[4];
+    osg::BoundingBox			_box;
+    osg::Vec2f				_nrTexels;
+    osg::ref_ptr<osg::StateSet>		_stateset;	// Null if empty
+    std::vector<osg::Geometry*>		_geometries;
+    std::vector<osg::ref_ptr<LODTile> >	_children;
+
+protected:
+			~LODTile();
+};
+
+
+TexturePlaneNode::LODTile::~LODTile()
+{
+    for ( unsigned int idx=0; idx<_geometries.size(); idx++ )
+	_geometries[idx]->unref();
+}
+
+
+int TexturePlaneNode::LODTile::getNrTiles() const
+{
+    int nrTiles = _stateset ? 1 : 0;
+    for ( unsigned int idx=0; idx<_children.size(); idx++ )
+	nrTiles += _children[idx]->getNrTiles();
+
+    return nrTiles;
+}
+
+
+//============================================================================
+
+
+/* Texture part of a uniform tile, which survives retiling as long as the
+   layered texture itself has not been retiled. */
+
+class TexturePlaneNode::TileCutout : public osg::Referenced
+{
+public:
+    osg::Vec2					_origin;
+    osg::Vec2					_opposite;
+    osg::ref_ptr<osg::StateSet>			_stateset;
+    std::vector<LayeredTexture::TextureCoordData> _tcData;
+};
+
+
+//============================================================================
+
+
+/* Builds a new tiling on the ThreadPool, in a private copy of the node that
+   holds its input at the time of the request. The copy shares the layered
+   texture, whose read lock is held while tiling. Layer changes cancel the
+   job and wait for it before touching any layer data. */
+
+class TexturePlaneNode::TilingJob : public ThreadPoolTask
+{
+public:
+			TilingJob(TexturePlaneNode&,bool localGeometries);
+			~TilingJob()		{ cancel(); }
+
+    void		start()			{ _group.submit( *this ); }
+    void		execute();
+    void		cancel();
+    void		finish()		{ _group.wait(); }
+    bool		isDone() const		{ return _done>0; }
+    bool		isCancelled() const	{ return _cancelled>0; }
+
+    osg::ref_ptr<TexturePlaneNode>	_tiling;
+
+protected:
+
+    OpenThreads::Atomic			_cancelled;
+    OpenThreads::Atomic			_done;
+    TaskGroup				_group;
+};
+
+
+TexturePlaneNode::TilingJob::TilingJob( TexturePlaneNode& node, bool localGeometries )
+    : _tiling( new TexturePlaneNode(node,osg::CopyOp::SHALLOW_COPY) )
+{
+    _tiling->_localGeometries = localGeometries;
+    _tiling->_viewDependentComposite = false;
+}
+
+
+void TexturePlaneNode::TilingJob::cancel()
+{
+    _cancelled.exchange( 1 );
+    finish();
+}
+
+
+void TexturePlaneNode::TilingJob::execute()
+{
+    if ( _cancelled )
+	return;
+
+    _tiling->_texture->readLock();
+    const bool done = !_cancelled && _tiling->createTiling( &_cancelled );
+    _tiling->_texture->readUnLock();
+
+    // Picked up by the update traversal, as workers leave the scene alone
+    if ( done )
+	_done.exchange( 1 );
+}
+
+
+//============================================================================
+
+
+/* Creates the children of LOD tiles to be split on the ThreadPool, in a
+   private copy of the node like the TilingJob. The parents stay on display
+   until the update traversal attaches their children. */
+
+class TexturePlaneNode::LODSplitJob : public ThreadPoolTask
+{
+public:
+			LODSplitJob(TexturePlaneNode&,
+				std::vector<osg::ref_ptr<LODTile> >& parents);
+			~LODSplitJob()		{ cancel(); }
+
+    void		start()			{ _group.submit( *this ); }
+    void		execute();
+    void		cancel();
+    void		finish()		{ _group.wait(); }
+    bool		isDone() const		{ return _done>0; }
+    bool		isCancelled() const	{ return _cancelled>0; }
+
+    std::vector<osg::ref_ptr<LODTile> >			_parents;
+    std::vector<std::vector<osg::ref_ptr<LODTile> > >	_children;
+
+protected:
+
+    osg::ref_ptr<TexturePlaneNode>	_splitter;
+    OpenThreads::Atomic			_cancelled;
+    OpenThreads::Atomic			_done;
+    TaskGroup				_group;
+};
+
+
+TexturePlaneNode::LODSplitJob::LODSplitJob( TexturePlaneNode& node, std::vector<osg::ref_ptr<LODTile> >& parents )
+    : _children( parents.size() )
+    , _splitter( new TexturePlaneNode(node,osg::CopyOp::SHALLOW_COPY) )
+{
+    _parents.swap( parents );
+    _splitter->_localGeometries = node._localGeometries;
+    _splitter->_sOrigins = node._sOrigins;
+    _splitter->_tOrigins = node._tOrigins;
+    _splitter->_viewDependentComposite = false;
+}
+
+
+void TexturePlaneNode::LODSplitJob::cancel()
+{
+    _cancelled.exchange( 1 );
+    finish();
+}
+
+
+void TexturePlaneNode::LODSplitJob::execute()
+{
+    if ( _cancelled )
+	return;
+
+    _splitter->_texture->readLock();
+    for ( unsigned int idx=0; idx<_parents.size() && !_cancelled; idx++ )
+	_splitter->createLODChildren( *_parents[idx], _children[idx] );
+    _splitter->_texture->readUnLock();
+
+    if ( _cancelled )
+	return;
+
+    _done.exchange( 1 );
+}
+
+
+//============================================================================
+
+
 TexturePlaneNode::TexturePlaneNode()
     : _center( 0, 0, 0 )
     , _width( 1, 1, 0 )
@@ -129,6 +343,27 @@ TexturePlaneNode::TexturePlaneNode()
     , _swapTextureAxes( false )
     , _textureShift( 0.0f, 0.0f )
     , _textureGrowth( 0.0f, 0.0f )
+    , _viewDependentComposite( false )
+    , _cameraViewsChanged( false )
+    , _tilingOrigin( 0.0f, 0.0f )
+    , _tilingOpposite( 0.0f, 0.0f )
+    , _localGeometries( false )
+    , _tilingWidth( 0.0f, 0.0f, 0.0f )
+    , _tilingTexelSizeRatio( 0.0f )
+    , _tilingRetilingNr( -1 )
+    , _nrTilingUpdates( 0 )
+    , _nrPlacementUpdates( 0 )
+    , _nrGeometryUpdates( 0 )
+    , _lastCullCamera( 0 )
+    , _adaptiveTiling( false )
+    , _lodCulled( false )
+    , _lodJob( 0 )
+    , _nrTileSplits( 0 )
+    , _nrTileMerges( 0 )
+    , _asyncTiling( false )
+    , _tilingJob( 0 )
+    , _nrCancelledTilings( 0 )
+    , _needsPlacementUpdate( false )
     , _frozen( false )
     , _isRedrawing( false )
     , _disperseFactor( 0 )
@@ -139,6 +374,11 @@ TexturePlaneNode::TexturePlaneNode()
     osg::ref_ptr<osg::LightModel> lightModel = new osg::LightModel;
     lightModel->setTwoSided( true );
     getOrCreateStateSet()->setAttributeAndModes( lightModel.get() );
+    // Placement transform may scale the normals
+    getOrCreateStateSet()->setMode( GL_NORMALIZE, osg::StateAttribute::ON );
+
+    _placementStateSet = new osg::StateSet;
+    _placementStateSet->setDataVariance( DYNAMIC );
     setDataVariance( DYNAMIC );
 
     _boundingGeometry = new BoundingGeometry( *this );
@@ -159,6 +399,27 @@ TexturePlaneNode::TexturePlaneNode( const TexturePlaneNode& node, const osg::Cop
     , _swapTextureAxes( node._swapTextureAxes )
     , _textureShift( node._textureShift )
     , _textureGrowth( node._textureGrowth )
+    , _viewDependentComposite( node._viewDependentComposite )
+    , _cameraViewsChanged( false )
+    , _tilingOrigin( node._tilingOrigin )
+    , _tilingOpposite( node._tilingOpposite )
+    , _localGeometries( false )
+    , _tilingWidth( 0.0f, 0.0f, 0.0f )
+    , _tilingTexelSizeRatio( 0.0f )
+    , _tilingRetilingNr( -1 )
+    , _nrTilingUpdates( 0 )
+    , _nrPlacementUpdates( 0 )
+    , _nrGeometryUpdates( 0 )
+    , _lastCullCamera( 0 )
+    , _adaptiveTiling( node._adaptiveTiling )
+    , _lodCulled( false )
+    , _lodJob( 0 )
+    , _nrTileSplits( 0 )
+    , _nrTileMerges( 0 )
+    , _asyncTiling( node._asyncTiling )
+    , _tilingJob( 0 )
+    , _nrCancelledTilings( 0 )
+    , _needsPlacementUpdate( false )
     , _frozen( false )
     , _isRedrawing( false )
     , _disperseFactor( node._disperseFactor )
@@ -167,6 +428,9 @@ TexturePlaneNode::TexturePlaneNode( const TexturePlaneNode& node, const osg::Cop
     setUpdateVar( _needsUpdate, true );
     setUpdateVar( _frozen, node._frozen );
 
+    _placementStateSet = new osg::StateSet;
+    _placementStateSet->setDataVariance( DYNAMIC );
+
     if ( node._texture )
     {
         if ( co.getCopyFlags()==osg::CopyOp::DEEP_COPY_ALL )
@@ -184,6 +448,7 @@ TexturePlaneNode::TexturePlaneNode( const TexturePlaneNode& node, const osg::Cop
 
 TexturePlaneNode::~TexturePlaneNode()
 {
+    cancelTilingJob( false );
     cleanUp();
     setLayeredTexture( 0 );
 }
@@ -191,6 +456,9 @@ TexturePlaneNode::~TexturePlaneNode()
 
 void TexturePlaneNode::cleanUp()
 {
+    cancelLODJob();
+    clearLODRequests();
+
     for ( std::vector<osg::Geometry*>::iterator it = _geometries.begin();
 	  it!=_geometries.end();
 	  it++ )
@@ -204,6 +472,14 @@ void TexturePlaneNode::cleanUp()
 	(*it)->unref();
 
     _statesets.clear();
+
+    _tileCutouts.clear();
+    _tileBoxes.clear();
+    _boundingNodes.clear();
+
+    _lodTiles.clear();
+    _sOrigins.clear();
+    _tOrigins.clear();
 }
 
 
@@ -236,8 +512,30 @@ void TexturePlaneNode::traverse( osg::NodeVisitor& nv )
     {
 	forceRedraw( false );
 
-	if ( !_frozen && needsUpdate() )
-	    updateGeometry();
+	if ( !_frozen )
+	{
+	    finishTilingJobIfDone();
+
+	    if ( _viewDependentComposite && _texture )
+		applyCompositeViewRegions();
+
+	    if ( needsUpdate() )
+		updateGeometry();
+	    else if ( _needsPlacementUpdate )
+		_nrPlacementUpdates++;
+
+	    updatePlacement();
+
+	    if ( _adaptiveTiling )
+		updateLODTiles();
+	}
+
+	// Pending jobs and cull requests are polled, as workers and cull
+	// traversals cannot request an update
+	const bool compositing = _texture && _texture->checkCompositeJob();
+	if ( _tilingJob || _adaptiveTiling || compositing ||
+	     (_viewDependentComposite && _texture) )
+	    forceRedraw( true );
     }
     else if ( nv.getVisitorType()==osg::NodeVisitor::CULL_VISITOR )
     {
@@ -246,28 +544,37 @@ void TexturePlaneNode::traverse( osg::NodeVisitor& nv )
 	if ( getStateSet() )
 	    cv->pushStateSet( getStateSet() );
 
+	if ( _viewDependentComposite && _texture )
+	    updateCompositeViewRegion( *cv );
+
 	if ( _texture && _texture->getSetupStateSet() )
 	    cv->pushStateSet( _texture->getSetupStateSet() );
 
-	int geometryIdx = 0;
-	for ( unsigned int idx=0; idx<_statesets.size(); idx++ )
-	{
-	    cv->pushStateSet( _statesets[idx] );
+	cv->pushStateSet( _placementStateSet.get() );
 
-	    for ( unsigned int count=_nrQuadsPerBrickSide*_nrQuadsPerBrickSide; count>0; count-- )
-	    {
-#if OSG_MIN_VERSION_REQUIRED(3,3,2)
-		const osg::BoundingBox bb = _geometries[geometryIdx]->getBoundingBox();
-#else
-		const osg::BoundingBox bb = _geometries[geometryIdx]->getBound();
-#endif
-		const float depth = cv->getDistanceFromEyePoint(bb.center(),false);
-		cv->addDrawableAndDepth( _geometries[geometryIdx], cv->getModelViewMatrix(), depth );
-		geometryIdx++;
-	    }
+	const bool hasPlacement = !_placement.isIdentity();
+	if ( hasPlacement )
+	{
+	    osg::ref_ptr<osg::RefMatrix> modelView = new osg::RefMatrix( _placement * (*cv->getModelViewMatrix()) );
+	    cv->pushModelViewMatrix( modelView.get(), osg::Transform::RELATIVE_RF );
+	}
 
-	    cv->popStateSet();
+	// Vertex offsets may displace tiles beyond their flat bounds
+	CameraCull cull;
+	if ( _adaptiveTiling )
+	{
+	    for ( unsigned int idx=0; idx<_lodTiles.size(); idx++ )
+		cullLODTile( *cv, *_lodTiles[idx], _localGeometries, cull );
 	}
+	else if ( !_boundingNodes.empty() )
+	    cullTiles( *cv, 0, _localGeometries, cull._nrCulledTiles );
+
+	storeCameraCull( *cv, cull );
+
+	if ( hasPlacement )
+	    cv->popModelViewMatrix();
+
+	cv->popStateSet();
 
 	if ( _texture && _texture->getSetupStateSet() )
 	    cv->popStateSet();
@@ -364,227 +671,1312 @@ float TexturePlaneNode::getTexelSizeRatio() const
 }
 
 
-bool TexturePlaneNode::updateGeometry()
+osg::Vec3 TexturePlaneNode::getNormal() const
 {
-    if ( !_texture ) 
-	return false;
+    const char thinDim = getThinDim();
+    const osg::Vec3 normal = thinDim==2 ? osg::Vec3( 0.0f, 0.0f, getSense() ) :
+			     thinDim==1 ? osg::Vec3( 0.0f,-getSense(), 0.0f ) :
+					  osg::Vec3( getSense(), 0.0f, 0.0f ) ;
+    if ( _localGeometries )
+	return normal;
 
     osg::Matrix rotMat;
     rotMat.makeRotate( _rotation );
+    return rotMat.preMult( normal );
+}
 
-    cleanUp();
-    _texture->reInitTiling( getTexelSizeRatio() );
 
-    std::vector<float> sOrigins, tOrigins;
-    _texture->planTiling( _textureBrickSize, sOrigins, tOrigins, _isBrickSizeStrict );
+void TexturePlaneNode::getTileCorners( const osg::Vec2f& origin, const osg::Vec2f& opposite, osg::Vec3* corners )
+{
+    osg::Matrix rotMat;
+    rotMat.makeRotate( _rotation );
 
-    finalizeTiling( sOrigins, 0 );
-    finalizeTiling( tOrigins, 1 );
+    float ds = opposite.x()-origin.x();
+    float dt = opposite.y()-origin.y();
 
-    const int nrs = sOrigins.size()-1;
-    const int nrt = tOrigins.size()-1;
+    if ( _disperseFactor )
+    {
+	if (_disperseFactor < 0 ) _disperseFactor = 0;
+	if (_disperseFactor > 50 ) _disperseFactor = 50;
+	ds *= 1.0f - _disperseFactor*0.01f;
+	dt *= 1.0f - _disperseFactor*0.01f;
+    }
 
-    osg::ref_ptr<osg::Vec3Array> normals = new osg::Vec3Array;
-    osg::ref_ptr<osg::Vec4Array> colors = new osg::Vec4Array;
+    corners[0] = osg::Vec3( origin.x(), origin.y(), 0.0f );
+    corners[1] = osg::Vec3( origin.x()+ds, origin.y(), 0.0f );
+    corners[2] = osg::Vec3( origin.x()+ds, origin.y()+dt, 0.0f);
+    corners[3] = osg::Vec3( origin.x(), origin.y()+dt, 0.0f );
 
-    const char thinDim = getThinDim();
-    const osg::Vec3 normal = thinDim==2 ? osg::Vec3( 0.0f, 0.0f, getSense() ) :
-			     thinDim==1 ? osg::Vec3( 0.0f,-getSense(), 0.0f ) :
-					  osg::Vec3( getSense(), 0.0f, 0.0f ) ;
+    for ( int idx=0; idx<4; idx++ )
+    {
+	corners[idx].x() -= _tilingOrigin.x();
+	corners[idx].y() -= _tilingOrigin.y();
+	corners[idx].x() /= _tilingOpposite.x() - _tilingOrigin.x();
+	corners[idx].y() /= _tilingOpposite.y() - _tilingOrigin.y();
+	const osg::Vec2 relPos( corners[idx].x()-0.5f, corners[idx].y()-0.5f );
+	corners[idx] = _localGeometries ? getLocalPlaneCoord( relPos ) : getPlaneCoord( relPos, rotMat );
+    }
+}
 
-    normals->push_back( rotMat.preMult(normal) );
+
+static void createTileGeometries( const osg::Vec3* corners, const osg::Vec3& normal, int nrQuadsPerBrickSide, const std::vector<LayeredTexture::TextureCoordData>& tcData, std::vector<osg::Geometry*>& geometries )
+{
+    osg::ref_ptr<osg::Vec3Array> normals = new osg::Vec3Array;
+    osg::ref_ptr<osg::Vec4Array> colors = new osg::Vec4Array;
+    normals->push_back( normal );
     colors->push_back( osg::Vec4(1.0f,1.0f,1.0f,1.0f) );
 
-    for ( int ids=0; ids<nrs; ids++ )
+    osg::ref_ptr<osg::Vec3Array> coords = new osg::Vec3Array( 4 );
+    for ( int idx=0; idx<4; idx++ )
+	(*coords)[idx] = corners[idx];
+
+    for ( int i=0; i<nrQuadsPerBrickSide; i++ )
     {
-	for ( int idt=0; idt<nrt; idt++ )
+	for ( int j=0; j<nrQuadsPerBrickSide; j++ )
 	{
-	    float ds = sOrigins[ids+1]-sOrigins[ids];
-	    float dt = tOrigins[idt+1]-tOrigins[idt];
+	    osg::ref_ptr<osg::Geometry> geometry = new osg::Geometry;
+	    geometry->ref();
 
-	    if ( _disperseFactor )
+	    if ( nrQuadsPerBrickSide>1 )
 	    {
-		if (_disperseFactor < 0 ) _disperseFactor = 0;
-		if (_disperseFactor > 50 ) _disperseFactor = 50;
-		ds *= 1.0f - _disperseFactor*0.01f;
-		dt *= 1.0f - _disperseFactor*0.01f;
-	    }
-
-	    osg::ref_ptr<osg::Vec3Array> coords = new osg::Vec3Array( 4 );
+		osg::ref_ptr<osg::Vec3Array> crds = new osg::Vec3Array( 4 );
 
-	    (*coords)[0] = osg::Vec3( sOrigins[ids], tOrigins[idt], 0.0f );
-	    (*coords)[1] = osg::Vec3( sOrigins[ids]+ds, tOrigins[idt], 0.0f );
-	    (*coords)[2] = osg::Vec3( sOrigins[ids]+ds, tOrigins[idt]+dt, 0.0f);
-	    (*coords)[3] = osg::Vec3( sOrigins[ids], tOrigins[idt]+dt, 0.0f );
+#define SET_COORD(idx,i,j,n) \
+    (*crds)[idx] = ((*coords)[0]*(n-i)*(n-j)+(*coords)[1]*i*(n-j)+(*coords)[2]*i*j+(*coords)[3]*(n-i)*j)/(n*n);
+		SET_COORD(0,i,j,nrQuadsPerBrickSide); i++;
+		SET_COORD(1,i,j,nrQuadsPerBrickSide); j++;
+		SET_COORD(2,i,j,nrQuadsPerBrickSide); i--;
+		SET_COORD(3,i,j,nrQuadsPerBrickSide); j--;
+		geometry->setVertexArray( crds.get() );
+
+		for ( std::vector<LayeredTexture::TextureCoordData>::const_iterator it = tcData.begin();
+		      it!=tcData.end();
+		      it++ )
+		{
+		    osg::ref_ptr<osg::Vec2Array> tCoords = new osg::Vec2Array( 4 );
 
-	    for ( int idx=0; idx<4; idx++ )
+#define SET_TEX_COORD(idx,i,j,n) \
+    (*tCoords)[idx] = (it->_tc00*(n-i)*(n-j)+it->_tc01*i*(n-j)+it->_tc11*i*j+it->_tc10*(n-i)*j)/(n*n);
+		    SET_TEX_COORD(0,i,j,nrQuadsPerBrickSide); i++;
+		    SET_TEX_COORD(1,i,j,nrQuadsPerBrickSide); j++;
+		    SET_TEX_COORD(2,i,j,nrQuadsPerBrickSide); i--;
+		    SET_TEX_COORD(3,i,j,nrQuadsPerBrickSide); j--;
+		    geometry->setTexCoordArray( it->_textureUnit, tCoords.get() );
+		}
+	    }
+	    else
 	    {
-		(*coords)[idx].x() -= sOrigins[0];
-		(*coords)[idx].y() -= tOrigins[0];
-		(*coords)[idx].x() /= sOrigins[nrs] - sOrigins[0];
-		(*coords)[idx].y() /= tOrigins[nrt] - tOrigins[0];
-		(*coords)[idx] -= osg::Vec3( 0.5f, 0.5f, 0.0f );
-
-		if ( _swapTextureAxes )
-		    (*coords)[idx] = osg::Vec3( (*coords)[idx].y(), (*coords)[idx].x(), 0.0f );
-
-		if ( thinDim==0 )
-		    (*coords)[idx] = osg::Vec3( 0.0f, (*coords)[idx].x(), (*coords)[idx].y() );
-		else if ( thinDim==1 )
-		    (*coords)[idx] = osg::Vec3( (*coords)[idx].x(), 0.0f, (*coords)[idx].y() );
-
-		(*coords)[idx].x() *= _width.x();
-		(*coords)[idx].y() *= _width.y();
-		(*coords)[idx].z() *= _width.z();
-		(*coords)[idx] = rotMat.preMult((*coords)[idx]) + _center;
+		geometry->setVertexArray( coords.get() );
+
+		for ( std::vector<LayeredTexture::TextureCoordData>::const_iterator it = tcData.begin();
+		      it!=tcData.end();
+		      it++ )
+		{
+		    osg::ref_ptr<osg::Vec2Array> tCoords = new osg::Vec2Array( 4 );
+		    (*tCoords)[0] = it->_tc00;
+		    (*tCoords)[1] = it->_tc01;
+		    (*tCoords)[2] = it->_tc11;
+		    (*tCoords)[3] = it->_tc10;
+		    geometry->setTexCoordArray( it->_textureUnit, tCoords.get() );
+		}
 	    }
 
-	    std::vector<LayeredTexture::TextureCoordData> tcData;
-	    osg::Vec2f origin( sOrigins[ids], tOrigins[idt] );
-	    osg::Vec2f opposite( sOrigins[ids+1], tOrigins[idt+1] );
-	    osg::ref_ptr<osg::StateSet> stateset = _texture->createCutoutStateSet( origin, opposite, tcData );
-	    stateset->ref();
-	    _statesets.push_back( stateset );
+	    geometry->setNormalArray( normals.get() );
+	    geometry->setNormalBinding( osg::Geometry::BIND_OVERALL );
+	    geometry->setColorArray( colors.get() );
+	    geometry->setColorBinding( osg::Geometry::BIND_OVERALL );
+	    geometry->addPrimitiveSet( new osg::DrawArrays(GL_QUADS,0,4) );
 
-	    for ( int i=0; i<_nrQuadsPerBrickSide; i++ )
-	    {
-		for ( int j=0; j<_nrQuadsPerBrickSide; j++ )
-		{
-		    osg::ref_ptr<osg::Geometry> geometry = new osg::Geometry;
-		    geometry->ref();
+	    // Precalculate bounding sphere for (multi-threaded) cull traversal
+	    geometry->getBound();
 
-		    if ( _nrQuadsPerBrickSide>1 )
-		    {
-			osg::ref_ptr<osg::Vec3Array> crds = new osg::Vec3Array( 4 );
+	    geometries.push_back( geometry );
+	}
+    }
+}
 
-#define SET_COORD(idx,i,j,n) \
-    (*crds)[idx] = ((*coords)[0]*(n-i)*(n-j)+(*coords)[1]*i*(n-j)+(*coords)[2]*i*j+(*coords)[3]*(n-i)*j)/(n*n);
-			SET_COORD(0,i,j,_nrQuadsPerBrickSide); i++;
-			SET_COORD(1,i,j,_nrQuadsPerBrickSide); j++;
-			SET_COORD(2,i,j,_nrQuadsPerBrickSide); i--;
-			SET_COORD(3,i,j,_nrQuadsPerBrickSide); j--;
-			geometry->setVertexArray( crds.get() );
-
-			for ( std::vector<LayeredTexture::TextureCoordData>::iterator it = tcData.begin();
-			      it!=tcData.end();
-			      it++ )
-			{
-			    osg::ref_ptr<osg::Vec2Array> tCoords = new osg::Vec2Array( 4 );
 
-#define SET_TEX_COORD(idx,i,j,n) \
-    (*tCoords)[idx] = (it->_tc00*(n-i)*(n-j)+it->_tc01*i*(n-j)+it->_tc11*i*j+it->_tc10*(n-i)*j)/(n*n);
-			    SET_TEX_COORD(0,i,j,_nrQuadsPerBrickSide); i++;
-			    SET_TEX_COORD(1,i,j,_nrQuadsPerBrickSide); j++;
-			    SET_TEX_COORD(2,i,j,_nrQuadsPerBrickSide); i--;
-			    SET_TEX_COORD(3,i,j,_nrQuadsPerBrickSide); j--;
-			    geometry->setTexCoordArray( it->_textureUnit, tCoords.get() );
-			}
-		    }
-		    else
-		    {
-			geometry->setVertexArray( coords.get() );
-
-			for ( std::vector<LayeredTexture::TextureCoordData>::iterator it = tcData.begin();
-			      it!=tcData.end();
-			      it++ )
-			{
-			    osg::ref_ptr<osg::Vec2Array> tCoords = new osg::Vec2Array( 4 );
-			    (*tCoords)[0] = it->_tc00;
-			    (*tCoords)[1] = it->_tc01;
-			    (*tCoords)[2] = it->_tc11;
-			    (*tCoords)[3] = it->_tc10;
-			    geometry->setTexCoordArray( it->_textureUnit, tCoords.get() );
-			}
-		    }
+bool TexturePlaneNode::updateGeometry()
+{
+    if ( !_texture ) 
+	return false;
 
-		    geometry->setNormalArray( normals.get() );
-		    geometry->setNormalBinding( osg::Geometry::BIND_OVERALL );
-		    geometry->setColorArray( colors.get() );
-		    geometry->setColorBinding( osg::Geometry::BIND_OVERALL );
-		    geometry->addPrimitiveSet( new osg::DrawArrays(GL_QUADS,0,4) );
+    cancelTilingJob( false );
+    // Vertex offset shading needs the vertices in their true position
+    const bool localGeometries = !_texture->isDataLayerOK( _texture->getVertexOffsetLayerID() );
 
-		    // Precalculate bounding sphere for (multi-threaded) cull traversal
-		    geometry->getBound();
+    if ( updateTileGeometries(localGeometries) )
+    {
+	_nrGeometryUpdates++;
+	setUpdateVar( _needsUpdate, false );
+	return true;
+    }
 
-		    _geometries.push_back( geometry );
-		}
-	    }
-	}
+    _texture->reInitTiling( getTexelSizeRatio() );
+
+    if ( _asyncTiling )
+    {
+	// Current tiles stay on display until the job has finished
+	_tilingJob = new TilingJob( *this, localGeometries );
+	_tilingJob->_tiling->_tilingRetilingNr = _texture->getNrRetilings();
+	_tilingJob->start();
+	setUpdateVar( _needsUpdate, false );
+	return true;
     }
 
+    _localGeometries = localGeometries;
+    createTiling();
+    _tilingRetilingNr = _texture->getNrRetilings();
+    _nrTilingUpdates++;
+
     setUpdateVar( _needsUpdate, false );
     return true;
 }
 
 
-osg::BoundingSphere TexturePlaneNode::computeBound() const
-{ return _boundingGeometry->getBound(); }
-
-
-void TexturePlaneNode::setCenter( const osg::Vec3& center )
+bool TexturePlaneNode::updateTileGeometries( bool localGeometries )
 {
-    _center = center;
-    _boundingGeometry->update();
-    setUpdateVar( _needsUpdate, true );
-}
-
+    // Other tilings of the layered texture may have released its tiles
+    if ( _tileCutouts.empty() || localGeometries!=_localGeometries ||
+	 _texture->needsRetiling() ||
+	 _texture->getNrRetilings()!=_tilingRetilingNr )
+	return false;
 
-const osg::Vec3& TexturePlaneNode::getCenter() const
-{ return _center; }
+    const float ratio = getTexelSizeRatio();
+    if ( fabs(ratio-_tilingTexelSizeRatio) > 1e-6*fabs(_tilingTexelSizeRatio) )
+	return false;
 
+    std::vector<osg::ref_ptr<TileCutout> > cutouts;
+    cutouts.swap( _tileCutouts );
 
-void TexturePlaneNode::setRotation( const osg::Quat& quaternion )
-{
-    _rotation = quaternion;
-    _boundingGeometry->update(); 
-    setUpdateVar( _needsUpdate, true );
-}
+    TileCutoutMap reusable;
+    for ( unsigned int idx=0; idx<cutouts.size(); idx++ )
+    {
+	const TileCutout& cutout = *cutouts[idx];
+	reusable[std::make_pair(cutout._origin,cutout._opposite)] = cutouts[idx].get();
+    }
 
+    if ( createTiling(0,&reusable) )
+	return true;
 
-const osg::Quat& TexturePlaneNode::getRotation() const
-{ return _rotation; }
+    cleanUp();
+    return false;
+}
 
 
-void TexturePlaneNode::setTextureBrickSize( short sz, bool strict )
+TexturePlaneNode::TileCutout* TexturePlaneNode::getTileCutout( const osg::Vec2& origin, const osg::Vec2& opposite, const TileCutoutMap* reusable ) const
 {
-    if ( sz > 0 )
-	_textureBrickSize = sz;
+    if ( reusable )
+    {
+	TileCutoutMap::const_iterator it = reusable->find( std::make_pair(origin,opposite) );
+	return it==reusable->end() ? 0 : it->second;
+    }
 
-    _isBrickSizeStrict = strict;
+    TileCutout* cutout = new TileCutout;
+    cutout->_origin = origin;
+    cutout->_opposite = opposite;
+    cutout->_stateset = _texture->createCutoutStateSet( origin, opposite, cutout->_tcData );
+    return cutout;
 }
 
-    
-short TexturePlaneNode::getTextureBrickSize() const
-{ return _textureBrickSize; }
-
 
-void TexturePlaneNode::setWidth( const osg::Vec3& width )
+bool TexturePlaneNode::createTiling( const OpenThreads::Atomic* cancelled, const TileCutoutMap* reusable )
 {
-    _width = width;
-    _boundingGeometry->update();
-    setUpdateVar( _needsUpdate, true );
-}
+    cleanUp();
 
+    _tilingWidth = _width;
+    _tilingTexelSizeRatio = getTexelSizeRatio();
 
-const osg::Vec3& TexturePlaneNode::getWidth() const
-{ return _width; }
+    std::vector<float> sOrigins, tOrigins;
+    _texture->planTiling( _textureBrickSize, sOrigins, tOrigins, _isBrickSizeStrict );
 
+    finalizeTiling( sOrigins, 0 );
+    finalizeTiling( tOrigins, 1 );
 
-float TexturePlaneNode::getSense() const 
-{
-    float sense = _width.x()<0 ? -1.0f : 1.0f;
-    sense = _width.y()<0 ? -sense : sense;
-    sense = _width.z()<0 ? -sense : sense;
-    return _swapTextureAxes ? -sense :  sense;
-}
+    const int nrs = sOrigins.size()-1;
+    const int nrt = tOrigins.size()-1;
+
+    _tilingOrigin = osg::Vec2( sOrigins.front(), tOrigins.front() );
+    _tilingOpposite = osg::Vec2( sOrigins.back(), tOrigins.back() );
+
+    if ( _adaptiveTiling )
+    {
+	if ( reusable )
+	    return false;
+
+	_sOrigins = sOrigins;
+	_tOrigins = tOrigins;
+
+	// Coarsest level has a single root, as far as all layers can reduce
+	const int maxLevel = _texture->getMaxResolutionLevel();
+	int level = 0;
+	while ( level<maxLevel && ((nrs-1)>>level || (nrt-1)>>level) )
+	    level++;
+
+	const int step = 1 << level;
+	for ( int ids=0; ids*step<nrs; ids++ )
+	{
+	    for ( int idt=0; idt*step<nrt; idt++ )
+	    {
+		if ( cancelled && *cancelled )
+		    return false;
+
+		_lodTiles.push_back( createLODTile(level,ids,idt) );
+	    }
+	}
+
+	return true;
+    }
+
+    const osg::Vec3 normal = getNormal();
+
+    for ( int ids=0; ids<nrs; ids++ )
+    {
+	for ( int idt=0; idt<nrt; idt++ )
+	{
+	    if ( cancelled && *cancelled )
+		return false;
+
+	    osg::Vec2f origin( sOrigins[ids], tOrigins[idt] );
+	    osg::Vec2f opposite( sOrigins[ids+1], tOrigins[idt+1] );
+	    if ( _texture->isCutoutEmpty(origin,opposite) )
+		continue;
+
+	    osg::ref_ptr<TileCutout> cutout = getTileCutout( origin, opposite, reusable );
+	    if ( !cutout )
+		return false;
+
+	    osg::Vec3 corners[4];
+	    getTileCorners( origin, opposite, corners );
+
+	    cutout->_stateset->ref();
+	    _statesets.push_back( cutout->_stateset.get() );
+	    _tileCutouts.push_back( cutout );
+
+	    createTileGeometries( corners, normal, _nrQuadsPerBrickSide, cutout->_tcData, _geometries );
+	}
+    }
+
+    buildTileHierarchy();
+    return true;
+}
+
+
+void TexturePlaneNode::cancelTilingJob( bool restart )
+{
+    if ( !_tilingJob )
+	return;
+
+    TilingJob* job = _tilingJob;
+    _tilingJob = 0;
+    if ( !job->isDone() || job->isCancelled() )
+	_nrCancelledTilings++;
+
+    delete job;
+
+    if ( restart )
+	setUpdateVar( _needsUpdate, true );
+}
+
+
+void TexturePlaneNode::interruptTilingJob()
+{
+    // Layer changes wait for the job before taking the texture's write lock
+    if ( !_tilingJob )
+	return;
+
+    _tilingJob->cancel();
+    setUpdateVar( _needsUpdate, true );
+}
+
+
+void TexturePlaneNode::finishTilingJobIfDone()
+{
+    // Interrupted jobs may have read changing layer data
+    if ( !_tilingJob || !_tilingJob->isDone() || _tilingJob->isCancelled() )
+	return;
+
+    TilingJob* job = _tilingJob;
+    _tilingJob = 0;
+    job->finish();
+
+    // Swaps in all at once, leaving the old tiles to the job
+    TexturePlaneNode& tiling = *job->_tiling;
+    _geometries.swap( tiling._geometries );
+    _statesets.swap( tiling._statesets );
+    _tileCutouts.swap( tiling._tileCutouts );
+    _tileBoxes.swap( tiling._tileBoxes );
+    _boundingNodes.swap( tiling._boundingNodes );
+    _lodTiles.swap( tiling._lodTiles );
+    _sOrigins.swap( tiling._sOrigins );
+    _tOrigins.swap( tiling._tOrigins );
+    std::swap( _tilingOrigin, tiling._tilingOrigin );
+    std::swap( _tilingOpposite, tiling._tilingOpposite );
+    std::swap( _localGeometries, tiling._localGeometries );
+    std::swap( _tilingWidth, tiling._tilingWidth );
+    std::swap( _tilingTexelSizeRatio, tiling._tilingTexelSizeRatio );
+    std::swap( _tilingRetilingNr, tiling._tilingRetilingNr );
+
+    // Requests and splits in progress refer to the old LOD tiles
+    cancelLODJob();
+    clearLODRequests();
+    _nrTilingUpdates++;
+    delete job;
+}
+
+
+void TexturePlaneNode::setAsyncTiling( bool yn )
+{
+    if ( _asyncTiling==yn )
+	return;
+
+    _asyncTiling = yn;
+    if ( !yn )
+	cancelTilingJob();
+}
+
+
+bool TexturePlaneNode::isAsyncTiling() const
+{ return _asyncTiling; }
+
+
+bool TexturePlaneNode::isTilingInProgress() const
+{ return _tilingJob!=0; }
+
+
+bool TexturePlaneNode::isTilingLocal() const
+{ return _tilingJob ? _tilingJob->_tiling->_localGeometries : _localGeometries; }
+
+
+int TexturePlaneNode::getNrCancelledTilings() const
+{ return _nrCancelledTilings; }
+
+
+void TexturePlaneNode::addTile( osgUtil::CullVisitor& cv, osg::StateSet* stateset, osg::Geometry* const* geometries, int nrGeometries )
+{
+    cv.pushStateSet( stateset );
+
+    for ( int idx=0; idx<nrGeometries; idx++ )
+    {
+#if OSG_MIN_VERSION_REQUIRED(3,3,2)
+	const osg::BoundingBox bb = geometries[idx]->getBoundingBox();
+#else
+	const osg::BoundingBox bb = geometries[idx]->getBound();
+#endif
+	const float depth = cv.getDistanceFromEyePoint(bb.center(),false);
+	cv.addDrawableAndDepth( geometries[idx], cv.getModelViewMatrix(), depth );
+    }
+
+    cv.popStateSet();
+}
+
+
+void TexturePlaneNode::cullTiles( osgUtil::CullVisitor& cv, int nodeIdx, bool doCull, int& nrCulled )
+{
+    const BoundingNode& node = _boundingNodes[nodeIdx];
+
+    // Culling set covers frustum as well as small feature culling
+    if ( doCull && cv.getCurrentCullingSet().isCulled(node._box) )
+    {
+	nrCulled += node._nrTiles;
+	return;
+    }
+
+    if ( node._children[0]<0 )
+    {
+	const int tileIdx = -1-node._children[0];
+	const int nrQuads = _nrQuadsPerBrickSide * _nrQuadsPerBrickSide;
+	addTile( cv, _statesets[tileIdx], &_geometries[tileIdx*nrQuads], nrQuads );
+	return;
+    }
+
+    // Skips the frustum planes fully containing this node for its children
+    if ( doCull )
+	cv.getCurrentCullingSet().pushCurrentMask();
+
+    cullTiles( cv, node._children[0], doCull, nrCulled );
+    cullTiles( cv, node._children[1], doCull, nrCulled );
+
+    if ( doCull )
+	cv.getCurrentCullingSet().popCurrentMask();
+}
+
+
+struct TileCenterLess
+{
+		TileCenterLess(const std::vector<osg::BoundingBox>& boxes,
+			       int dim)
+		    : _boxes( boxes )
+		    , _dim( dim )
+		{}
+
+    bool	operator()(int idx0,int idx1) const
+		{
+		    return _boxes[idx0].center()[_dim] <
+			   _boxes[idx1].center()[_dim];
+		}
+
+    const std::vector<osg::BoundingBox>&	_boxes;
+    const int					_dim;
+};
+
+
+int TexturePlaneNode::addBoundingNodes( std::vector<int>& tileIdxs, int first, int last )
+{
+    const int nodeIdx = _boundingNodes.size();
+    _boundingNodes.push_back( BoundingNode() );
+
+    osg::BoundingBox box;
+    for ( int idx=first; idx<=last; idx++ )
+	box.expandBy( _tileBoxes[tileIdxs[idx]] );
+
+    int children[2] = { -1-tileIdxs[first], -1 };
+
+    if ( first<last )
+    {
+	// Median split along the longest extent of the box
+	const osg::Vec3 extent = box._max - box._min;
+	int dim = extent.x()>extent.y() ? 0 : 1;
+	if ( extent.z()>extent[dim] )
+	    dim = 2;
+
+	const int mid = (first+last) / 2;
+	std::nth_element( tileIdxs.begin()+first, tileIdxs.begin()+mid,
+			  tileIdxs.begin()+last+1,
+			  TileCenterLess(_tileBoxes,dim) );
+
+	children[0] = addBoundingNodes( tileIdxs, first, mid );
+	children[1] = addBoundingNodes( tileIdxs, mid+1, last );
+    }
+
+    BoundingNode& node = _boundingNodes[nodeIdx];
+    node._box = box;
+    node._children[0] = children[0];
+    node._children[1] = children[1];
+    node._nrTiles = last-first+1;
+    return nodeIdx;
+}
+
+
+void TexturePlaneNode::buildTileHierarchy()
+{
+    _tileBoxes.clear();
+    _boundingNodes.clear();
+
+    const int nrQuads = _nrQuadsPerBrickSide * _nrQuadsPerBrickSide;
+    const int nrTiles = _statesets.size();
+    std::vector<int> tileIdxs;
+
+    for ( int tileIdx=0; tileIdx<nrTiles; tileIdx++ )
+    {
+	osg::BoundingBox box;
+	for ( int idx=tileIdx*nrQuads; idx<(tileIdx+1)*nrQuads; idx++ )
+	{
+#if OSG_MIN_VERSION_REQUIRED(3,3,2)
+	    box.expandBy( _geometries[idx]->getBoundingBox() );
+#else
+	    box.expandBy( _geometries[idx]->getBound() );
+#endif
+	}
+
+	_tileBoxes.push_back( box );
+	tileIdxs.push_back( tileIdx );
+    }
+
+    if ( !tileIdxs.empty() )
+	addBoundingNodes( tileIdxs, 0, tileIdxs.size()-1 );
+}
+
+
+int TexturePlaneNode::getNrTiles() const
+{
+    if ( !_adaptiveTiling )
+	return _statesets.size();
+
+    int nrTiles = 0;
+    for ( unsigned int idx=0; idx<_lodTiles.size(); idx++ )
+	nrTiles += _lodTiles[idx]->getNrTiles();
+
+    return nrTiles;
+}
+
+
+int TexturePlaneNode::getNrCulledTiles( const osg::Camera* camera ) const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _cameraCullLock );
+
+    CameraCullMap::const_iterator it = _cameraCulls.find( camera ? camera : _lastCullCamera );
+    return it!=_cameraCulls.end() ? it->second._nrCulledTiles : 0;
+}
+
+
+void TexturePlaneNode::storeCameraCull( osgUtil::CullVisitor& cv, CameraCull& cull )
+{
+    cull._frameNr = cv.getFrameStamp() ? cv.getFrameStamp()->getFrameNumber() : 0;
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _cameraCullLock );
+
+    // Cameras that stopped drawing us are forgotten
+    CameraCullMap::iterator it = _cameraCulls.begin();
+    while ( it!=_cameraCulls.end() )
+    {
+	if ( it->second._frameNr+1<cull._frameNr )
+	    _cameraCulls.erase( it++ );
+	else
+	    it++;
+    }
+
+    CameraCull& stored = _cameraCulls[cv.getCurrentCamera()];
+    stored._nrCulledTiles = cull._nrCulledTiles;
+    stored._frameNr = cull._frameNr;
+    stored._keepRequests.swap( cull._keepRequests );
+    stored._splitRequests.swap( cull._splitRequests );
+
+    _lastCullCamera = cv.getCurrentCamera();
+    if ( _adaptiveTiling )
+	_lodCulled = true;
+}
+
+
+void TexturePlaneNode::updatePlacement()
+{
+    _placement.makeIdentity();
+
+    if ( _localGeometries )
+    {
+	osg::Vec3 scale( fabs(_width.x()), fabs(_width.y()), fabs(_width.z()) );
+	scale[getThinDim()] = 1.0f;
+
+	// Same sense of rotation as rotMat.preMult(.) in getPlaneCoord(.)
+	_placement = osg::Matrix::scale( scale ) *
+		     osg::Matrix::rotate( _rotation.inverse() ) *
+		     osg::Matrix::translate( _center );
+    }
+
+    // 3D texture coordinates are derived from the placed vertices
+    for ( int idx=0; _texture && idx<_texture->nrDataLayers(); idx++ )
+    {
+	const int id = _texture->getDataLayerID( idx );
+	const int unit = _texture->getDataLayerTextureUnit( id );
+	const osg::Matrixf* trans = _texture->getDataLayerVertex2TextureTransform( id );
+	if ( unit<0 || !trans || _texture->getTextureUnitNrDims(unit)!=3 )
+	    continue;
+
+	char uniformName[20];
+	snprintf( uniformName, 20, "vertextrans%d", unit );
+	const osg::Matrixf vertexTrans = osg::Matrixf(_placement) * (*trans);
+
+	// Setting dirties the uniform, so every frame would re-upload it
+	osg::Uniform* uniform = _placementStateSet->getUniform( uniformName );
+	osg::Matrixf curTrans;
+	if ( uniform && uniform->get(curTrans) && curTrans==vertexTrans )
+	    continue;
+
+	if ( !uniform )
+	    uniform = _placementStateSet->getOrCreateUniform( uniformName, osg::Uniform::FLOAT_MAT4 );
+
+	uniform->set( vertexTrans );
+    }
+
+    setUpdateVar( _needsPlacementUpdate, false );
+}
+
+
+bool TexturePlaneNode::isTilingWidth( const osg::Vec3& width ) const
+{
+    // Pending tiling may be for another width
+    if ( !_localGeometries || _tilingJob )
+	return false;
+
+    for ( int dim=0; dim<3; dim++ )
+    {
+	if ( (width[dim]<0.0f) != (_tilingWidth[dim]<0.0f) ||
+	     (width[dim]==0.0f) != (_tilingWidth[dim]==0.0f) )
+	    return false;
+    }
+
+    const float ratio = getTexelSizeRatio();
+    return fabs(ratio-_tilingTexelSizeRatio) <= 1e-6*fabs(_tilingTexelSizeRatio);
+}
+
+
+int TexturePlaneNode::getNrTilingUpdates() const
+{ return _nrTilingUpdates; }
+
+
+int TexturePlaneNode::getNrGeometryUpdates() const
+{ return _nrGeometryUpdates; }
+
+
+int TexturePlaneNode::getNrPlacementUpdates() const
+{ return _nrPlacementUpdates; }
+
+
+osg::Vec3 TexturePlaneNode::getLocalPlaneCoord( const osg::Vec2& relPos ) const
+{
+    osg::Vec3 coord( relPos.x(), relPos.y(), 0.0f );
+
+    if ( _swapTextureAxes )
+	coord = osg::Vec3( coord.y(), coord.x(), 0.0f );
+
+    const char thinDim = getThinDim();
+    if ( thinDim==0 )
+	coord = osg::Vec3( 0.0f, coord.x(), coord.y() );
+    else if ( thinDim==1 )
+	coord = osg::Vec3( coord.x(), 0.0f, coord.y() );
+
+    // Mirroring stays in the geometry to keep the winding of its normal
+    for ( int dim=0; dim<3; dim++ )
+    {
+	if ( _width[dim]<0.0f )
+	    coord[dim] = -coord[dim];
+    }
+
+    return coord;
+}
+
+
+osg::Vec3 TexturePlaneNode::getPlaneCoord( const osg::Vec2& relPos, const osg::Matrix& rotMat ) const
+{
+    osg::Vec3 coord( relPos.x(), relPos.y(), 0.0f );
+
+    if ( _swapTextureAxes )
+	coord = osg::Vec3( coord.y(), coord.x(), 0.0f );
+
+    const char thinDim = getThinDim();
+    if ( thinDim==0 )
+	coord = osg::Vec3( 0.0f, coord.x(), coord.y() );
+    else if ( thinDim==1 )
+	coord = osg::Vec3( coord.x(), 0.0f, coord.y() );
+
+    coord.x() *= _width.x();
+    coord.y() *= _width.y();
+    coord.z() *= _width.z();
+    return rotMat.preMult(coord) + _center;
+}
+
+
+/* Finds the part of the plane visible in the viewport, as well as the
+   highest screen resolution over that part. Only plane cells crossing the
+   viewport border are subdivided further. Plane parameters u and v run
+   from 0 to 1 along the texture axes. */
+
+class ViewRegionFinder
+{
+public:
+			ViewRegionFinder(const osg::Matrix& mvpw,
+					 const osg::Viewport& viewport,
+					 const osg::Vec3& corner,
+					 const osg::Vec3& uAxis,
+					 const osg::Vec3& vAxis)
+			    : _visible( false )
+			    , _pixelDensity( 0.0f, 0.0f )
+			    , _mvpw( mvpw )
+			    , _viewportMin( viewport.x(), viewport.y() )
+			    , _viewportMax( viewport.x()+viewport.width(),
+					    viewport.y()+viewport.height() )
+			    , _corner( corner )
+			    , _uAxis( uAxis )
+			    , _vAxis( vAxis )
+			{}
+
+    void		find(float u0,float v0,float u1,float v1,int depth=0);
+
+    bool		_visible;
+    osg::Vec2		_visibleMin;
+    osg::Vec2		_visibleMax;
+    osg::Vec2		_pixelDensity;	// Pixels per unit of u and v
+
+protected:
+
+    bool		project(float u,float v,osg::Vec2& windowPos) const;
+
+    const osg::Matrix	_mvpw;
+    const osg::Vec2	_viewportMin;
+    const osg::Vec2	_viewportMax;
+    const osg::Vec3	_corner;
+    const osg::Vec3	_uAxis;
+    const osg::Vec3	_vAxis;
+};
+
+
+bool ViewRegionFinder::project( float u, float v, osg::Vec2& windowPos ) const
+{
+    const osg::Vec3 pos = _corner + _uAxis*u + _vAxis*v;
+    const osg::Vec4 clipPos = osg::Vec4(pos.x(),pos.y(),pos.z(),1.0f) * _mvpw;
+
+    if ( clipPos.w()<=0.0f )	// Behind the eye
+	return false;
+
+    windowPos = osg::Vec2( clipPos.x()/clipPos.w(), clipPos.y()/clipPos.w() );
+    return true;
+}
+
+
+void ViewRegionFinder::find( float u0, float v0, float u1, float v1, int depth )
+{
+    const int minDepth = 2;	// Perspective varies resolution over plane
+    const int maxDepth = 8;
+
+    osg::Vec2 windowPos[4];
+    bool inFront = project( u0, v0, windowPos[0] );
+    inFront = project( u1, v0, windowPos[1] ) && inFront;
+    inFront = project( u1, v1, windowPos[2] ) && inFront;
+    inFront = project( u0, v1, windowPos[3] ) && inFront;
+
+    bool inside = inFront;
+    if ( inFront )
+    {
+	osg::Vec2 minPos = windowPos[0];
+	osg::Vec2 maxPos = windowPos[0];
+	for ( int idx=1; idx<4; idx++ )
+	{
+	    for ( int dim=0; dim<=1; dim++ )
+	    {
+		if ( windowPos[idx][dim]<minPos[dim] )
+		    minPos[dim] = windowPos[idx][dim];
+		if ( windowPos[idx][dim]>maxPos[dim] )
+		    maxPos[dim] = windowPos[idx][dim];
+	    }
+	}
+
+	for ( int dim=0; dim<=1; dim++ )
+	{
+	    if ( maxPos[dim]<_viewportMin[dim] || minPos[dim]>_viewportMax[dim] )
+		return;
+
+	    if ( minPos[dim]<_viewportMin[dim] || maxPos[dim]>_viewportMax[dim] )
+		inside = false;
+	}
+    }
+
+    if ( depth<maxDepth && (!inside || depth<minDepth) )
+    {
+	const float uMid = 0.5f * (u0+u1);
+	const float vMid = 0.5f * (v0+v1);
+	find( u0, v0, uMid, vMid, depth+1 );
+	find( uMid, v0, u1, vMid, depth+1 );
+	find( u0, vMid, uMid, v1, depth+1 );
+	find( uMid, vMid, u1, v1, depth+1 );
+	return;
+    }
+
+    if ( !_visible || u0<_visibleMin.x() )
+	_visibleMin.x() = u0;
+    if ( !_visible || v0<_visibleMin.y() )
+	_visibleMin.y() = v0;
+    if ( !_visible || u1>_visibleMax.x() )
+	_visibleMax.x() = u1;
+    if ( !_visible || v1>_visibleMax.y() )
+	_visibleMax.y() = v1;
+
+    _visible = true;
+
+    if ( !inFront )
+	return;
+
+    const float uLength = std::max( (windowPos[1]-windowPos[0]).length(),
+				    (windowPos[2]-windowPos[3]).length() );
+    const float vLength = std::max( (windowPos[3]-windowPos[0]).length(),
+				    (windowPos[2]-windowPos[1]).length() );
+
+    if ( uLength/(u1-u0) > _pixelDensity.x() )
+	_pixelDensity.x() = uLength / (u1-u0);
+    if ( vLength/(v1-v0) > _pixelDensity.y() )
+	_pixelDensity.y() = vLength / (v1-v0);
+}
+
+
+void TexturePlaneNode::updateCompositeViewRegion( osgUtil::CullVisitor& cv )
+{
+    CameraView view;
+    view._frameNr = cv.getFrameStamp() ? cv.getFrameStamp()->getFrameNumber() : 0;
+
+    const osg::Viewport* viewport = cv.getViewport();
+    if ( viewport && _tilingOpposite!=_tilingOrigin )
+    {
+	osg::Matrix rotMat;
+	rotMat.makeRotate( _rotation );
+
+	const osg::Vec3 corner = getPlaneCoord( osg::Vec2(-0.5f,-0.5f), rotMat );
+	const osg::Vec3 uAxis = getPlaneCoord( osg::Vec2(0.5f,-0.5f), rotMat ) - corner;
+	const osg::Vec3 vAxis = getPlaneCoord( osg::Vec2(-0.5f,0.5f), rotMat ) - corner;
+
+	ViewRegionFinder finder( cv.getMVPW(), *viewport, corner, uAxis, vAxis );
+	finder.find( 0.0f, 0.0f, 1.0f, 1.0f );
+
+	if ( finder._visible && finder._pixelDensity.x()>0.0f && finder._pixelDensity.y()>0.0f )
+	{
+	    const osg::Vec2 tilingSize = _tilingOpposite - _tilingOrigin;
+	    view._viewOrigin.set( _tilingOrigin.x() + tilingSize.x()*finder._visibleMin.x(),
+				  _tilingOrigin.y() + tilingSize.y()*finder._visibleMin.y() );
+	    view._viewOpposite.set( _tilingOrigin.x() + tilingSize.x()*finder._visibleMax.x(),
+				    _tilingOrigin.y() + tilingSize.y()*finder._visibleMax.y() );
+	    view._viewNrPixels.set( finder._pixelDensity.x() * (finder._visibleMax.x()-finder._visibleMin.x()),
+				    finder._pixelDensity.y() * (finder._visibleMax.y()-finder._visibleMin.y()) );
+	}
+    }
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _cameraViewLock );
+
+    CameraViewMap::iterator it = _cameraViews.find( cv.getCurrentCamera() );
+    if ( it!=_cameraViews.end() && it->second._viewOrigin==view._viewOrigin &&
+	 it->second._viewOpposite==view._viewOpposite &&
+	 it->second._viewNrPixels==view._viewNrPixels )
+    {
+	it->second._frameNr = view._frameNr;
+	return;
+    }
+
+    // Applied by the next update traversal
+    _cameraViews[cv.getCurrentCamera()] = view;
+    _cameraViewsChanged = true;
+}
+
+
+// Composites the union of what all cameras see, at the finest resolution
+
+void TexturePlaneNode::applyCompositeViewRegions()
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _cameraViewLock );
+    if ( !_cameraViewsChanged )
+	return;
+
+    _cameraViewsChanged = false;
+
+    unsigned int lastFrameNr = 0;
+    for ( CameraViewMap::iterator it=_cameraViews.begin(); it!=_cameraViews.end(); it++ )
+    {
+	if ( it->second._frameNr>lastFrameNr )
+	    lastFrameNr = it->second._frameNr;
+    }
+
+    osg::Vec2 origin, opposite, density;
+    bool visible = false;
+
+    CameraViewMap::iterator it = _cameraViews.begin();
+    while ( it!=_cameraViews.end() )
+    {
+	const CameraView& view = it->second;
+
+	// Cameras that stopped drawing us are forgotten
+	if ( view._frameNr+1<lastFrameNr )
+	{
+	    _cameraViews.erase( it++ );
+	    continue;
+	}
+
+	it++;
+	if ( view._viewNrPixels.x()<=0.0f || view._viewNrPixels.y()<=0.0f )
+	    continue;
+
+	for ( int dim=0; dim<=1; dim++ )
+	{
+	    const float v0 = osg::minimum( view._viewOrigin[dim], view._viewOpposite[dim] );
+	    const float v1 = osg::maximum( view._viewOrigin[dim], view._viewOpposite[dim] );
+	    const float dens = v1>v0 ? view._viewNrPixels[dim]/(v1-v0) : 0.0f;
+
+	    if ( !visible || v0<origin[dim] )
+		origin[dim] = v0;
+	    if ( !visible || v1>opposite[dim] )
+		opposite[dim] = v1;
+	    if ( !visible || dens>density[dim] )
+		density[dim] = dens;
+	}
+
+	visible = true;
+    }
+
+    if ( !visible )
+	return;
+
+    const osg::Vec2 nrPixels( density.x()*(opposite.x()-origin.x()),
+			      density.y()*(opposite.y()-origin.y()) );
+    _texture->setCompositeViewRegion( origin, opposite, nrPixels );
+}
+
+
+#define LOD_SPLIT_RATIO		1.0f	// Screen pixels per texel
+#define LOD_MERGE_RATIO		0.5f	// Hysteresis against thrashing
+#define MAX_LOD_SPLITS_PER_JOB		16
+
+
+TexturePlaneNode::LODTile* TexturePlaneNode::createLODTile( int level, int sIdx, int tIdx )
+{
+    LODTile* tile = new LODTile( level, sIdx, tIdx );
+
+    const int step = 1 << level;
+    const int nrs = _sOrigins.size()-1;
+    const int nrt = _tOrigins.size()-1;
+
+    const osg::Vec2f origin( _sOrigins[sIdx*step], _tOrigins[tIdx*step] );
+    const osg::Vec2f opposite( _sOrigins[osg::minimum((sIdx+1)*step,nrs)],
+			       _tOrigins[osg::minimum((tIdx+1)*step,nrt)] );
+
+    getTileCorners( origin, opposite, tile->_corners );
+    for ( int idx=0; idx<4; idx++ )
+	tile->_box.expandBy( tile->_corners[idx] );
+
+    tile->_nrTexels = (opposite-origin) / float(step);
+
+    if ( _texture->isCutoutEmpty(origin,opposite) )
+	return tile;
+
+    std::vector<LayeredTexture::TextureCoordData> tcData;
+    tile->_stateset = _texture->createCutoutStateSet( origin, opposite, tcData, 0, level );
+    createTileGeometries( tile->_corners, getNormal(), _nrQuadsPerBrickSide, tcData, tile->_geometries );
+    return tile;
+}
+
+
+void TexturePlaneNode::createLODChildren( const LODTile& tile, std::vector<osg::ref_ptr<LODTile> >& children )
+{
+    const int childStep = 1 << (tile._level-1);
+    const int nrs = _sOrigins.size()-1;
+    const int nrt = _tOrigins.size()-1;
+
+    for ( int sIdx=2*tile._sIdx; sIdx<=2*tile._sIdx+1; sIdx++ )
+    {
+	for ( int tIdx=2*tile._tIdx; tIdx<=2*tile._tIdx+1; tIdx++ )
+	{
+	    if ( sIdx*childStep<nrs && tIdx*childStep<nrt )
+		children.push_back( createLODTile(tile._level-1,sIdx,tIdx) );
+	}
+    }
+}
+
+
+bool TexturePlaneNode::LODTileKey::operator<( const LODTileKey& key ) const
+{
+    if ( _level!=key._level )
+	return _level<key._level;
+    if ( _sIdx!=key._sIdx )
+	return _sIdx<key._sIdx;
+
+    return _tIdx<key._tIdx;
+}
+
+
+// Applies what the cull traversals of all cameras asked for since last time
+
+void TexturePlaneNode::updateLODTiles()
+{
+    finishLODJobIfDone();
+
+    LODTileKeySet keeps, splits;
+
+    _cameraCullLock.lock();
+    const bool culled = _lodCulled;
+    _lodCulled = false;
+
+    CameraCullMap::const_iterator it = _cameraCulls.begin();
+    for ( ; culled && it!=_cameraCulls.end(); it++ )
+    {
+	keeps.insert( it->second._keepRequests.begin(), it->second._keepRequests.end() );
+	splits.insert( it->second._splitRequests.begin(), it->second._splitRequests.end() );
+    }
+    _cameraCullLock.unlock();
+
+    if ( !culled )
+	return;
+
+    // Splits asked for while a job is running will be asked for again
+    std::vector<osg::ref_ptr<LODTile> > toSplit;
+    for ( unsigned int idx=0; idx<_lodTiles.size(); idx++ )
+	updateLODTile( *_lodTiles[idx], keeps, splits, _lodJob ? 0 : &toSplit );
+
+    if ( toSplit.empty() )
+	return;
+
+    _lodJob = new LODSplitJob( *this, toSplit );
+    _lodJob->start();
+}
+
+
+void TexturePlaneNode::updateLODTile( LODTile& tile, const LODTileKeySet& keeps, const LODTileKeySet& splits, std::vector<osg::ref_ptr<LODTile> >* toSplit )
+{
+    if ( tile.isSplit() )
+    {
+	// Tiles not kept by any camera are invisible or too coarse
+	if ( keeps.count(tile.getKey()) )
+	{
+	    for ( unsigned int idx=0; idx<tile._children.size(); idx++ )
+		updateLODTile( *tile._children[idx], keeps, splits, toSplit );
+	}
+	else
+	{
+	    tile._children.clear();
+	    _nrTileMerges++;
+	}
+    }
+    else if ( toSplit && toSplit->size()<MAX_LOD_SPLITS_PER_JOB && splits.count(tile.getKey()) )
+	toSplit->push_back( &tile );
+}
+
+
+void TexturePlaneNode::finishLODJobIfDone()
+{
+    if ( !_lodJob )
+	return;
+
+    // Interrupted jobs may have read changing layer data
+    if ( _lodJob->isCancelled() )
+    {
+	cancelLODJob();	// Its splits will be requested again
+	return;
+    }
+
+    if ( !_lodJob->isDone() )
+	return;
+
+    LODSplitJob* job = _lodJob;
+    _lodJob = 0;
+    job->finish();
+
+    // Parents dropped by a merge meanwhile are out of the tree anyway
+    for ( unsigned int idx=0; idx<job->_parents.size(); idx++ )
+    {
+	LODTile& parent = *job->_parents[idx];
+	if ( parent.isSplit() || job->_children[idx].empty() )
+	    continue;
+
+	parent._children.swap( job->_children[idx] );
+	_nrTileSplits++;
+    }
+
+    delete job;
+}
+
+
+void TexturePlaneNode::cancelLODJob()
+{
+    if ( !_lodJob )
+	return;
+
+    LODSplitJob* job = _lodJob;
+    _lodJob = 0;
+    delete job;
+}
+
+
+void TexturePlaneNode::interruptLODJob()
+{
+    // Like interruptTilingJob(), the job is deleted by the update traversal
+    if ( _lodJob )
+	_lodJob->cancel();
+}
+
+
+void TexturePlaneNode::clearLODRequests()
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _cameraCullLock );
+
+    CameraCullMap::iterator it = _cameraCulls.begin();
+    for ( ; it!=_cameraCulls.end(); it++ )
+    {
+	it->second._keepRequests.clear();
+	it->second._splitRequests.clear();
+    }
+
+    _lodCulled = false;
+}
+
+
+void TexturePlaneNode::cullLODTile( osgUtil::CullVisitor& cv, LODTile& tile, bool doCull, CameraCull& cull )
+{
+    if ( doCull && cv.getCurrentCullingSet().isCulled(tile._box) )
+    {
+	cull._nrCulledTiles++;
+	return;
+    }
+
+    const float ratio = getLODTexelRatio( cv, tile );
+
+    if ( tile.isSplit() )
+    {
+	if ( ratio>=LOD_MERGE_RATIO )
+	{
+	    cull._keepRequests.insert( tile.getKey() );
+
+	    if ( doCull )
+		cv.getCurrentCullingSet().pushCurrentMask();
+
+	    for ( unsigned int idx=0; idx<tile._children.size(); idx++ )
+		cullLODTile( cv, *tile._children[idx], doCull, cull );
+
+	    if ( doCull )
+		cv.getCurrentCullingSet().popCurrentMask();
+
+	    return;
+	}
+
+	// Drawn coarse already, merged next update
+    }
+    else if ( ratio>LOD_SPLIT_RATIO && tile._level>0 && tile._stateset )
+	cull._splitRequests.insert( tile.getKey() );
+
+    if ( tile._stateset )
+	addTile( cv, tile._stateset.get(), &tile._geometries[0], tile._geometries.size() );
+}
+
+
+// Screen pixels per texel along the texture axis that is magnified most
+
+float TexturePlaneNode::getLODTexelRatio( osgUtil::CullVisitor& cv, const LODTile& tile ) const
+{
+    const osg::Matrix mvpw = cv.getMVPW();
+
+    osg::Vec2 windowPos[4];
+    int nrBehind = 0;
+    for ( int idx=0; idx<4; idx++ )
+    {
+	const osg::Vec3& pos = tile._corners[idx];
+	const osg::Vec4 clipPos = osg::Vec4(pos.x(),pos.y(),pos.z(),1.0f) * mvpw;
+	if ( clipPos.w()<=0.0f )
+	{
+	    nrBehind++;
+	    continue;
+	}
+
+	windowPos[idx] = osg::Vec2( clipPos.x()/clipPos.w(), clipPos.y()/clipPos.w() );
+    }
+
+    if ( nrBehind==4 )
+	return 0.0f;
+    if ( nrBehind )	// Tile passes the eye plane, so it is very near
+	return FLT_MAX;
+
+    const float sLength = osg::maximum( (windowPos[1]-windowPos[0]).length(),
+					(windowPos[2]-windowPos[3]).length() );
+    const float tLength = osg::maximum( (windowPos[3]-windowPos[0]).length(),
+					(windowPos[2]-windowPos[1]).length() );
+
+    const float sRatio = tile._nrTexels.x()>0.0f ? sLength/tile._nrTexels.x() : 0.0f;
+    const float tRatio = tile._nrTexels.y()>0.0f ? tLength/tile._nrTexels.y() : 0.0f;
+    return osg::maximum( sRatio, tRatio );
+}
+
+
+void TexturePlaneNode::setAdaptiveTiling( bool yn )
+{
+    if ( _adaptiveTiling==yn )
+	return;
+
+    _adaptiveTiling = yn;
+    setUpdateVar( _needsUpdate, true );
+}
+
+
+bool TexturePlaneNode::isAdaptiveTiling() const
+{ return _adaptiveTiling; }
+
+
+int TexturePlaneNode::getNrTileSplits() const
+{ return _nrTileSplits; }
+
+
+int TexturePlaneNode::getNrTileMerges() const
+{ return _nrTileMerges; }
+
+
+void TexturePlaneNode::setViewDependentComposite( bool yn )
+{
+    if ( _viewDependentComposite==yn )
+	return;
+
+    _viewDependentComposite = yn;
+    if ( !yn && _texture )
+	_texture->clearCompositeViewRegion();
+
+    _cameraViewLock.lock();
+    _cameraViews.clear();
+    _cameraViewsChanged = false;
+    _cameraViewLock.unlock();
+}
+
+
+bool TexturePlaneNode::isViewDependentComposite() const
+{ return _viewDependentComposite; }
+
+
+osg::BoundingSphere TexturePlaneNode::computeBound() const
+{ return _boundingGeometry->getBound(); }
+
+
+void TexturePlaneNode::setCenter( const osg::Vec3& center )
+{
+    _center = center;
+    _boundingGeometry->update();
+    setUpdateVar( isTilingLocal() ? _needsPlacementUpdate : _needsUpdate, true );
+}
+
+
+const osg::Vec3& TexturePlaneNode::getCenter() const
+{ return _center; }
+
+
+void TexturePlaneNode::setRotation( const osg::Quat& quaternion )
+{
+    _rotation = quaternion;
+    _boundingGeometry->update(); 
+    setUpdateVar( isTilingLocal() ? _needsPlacementUpdate : _needsUpdate, true );
+}
+
+
+const osg::Quat& TexturePlaneNode::getRotation() const
+{ return _rotation; }
+
+
+void TexturePlaneNode::setTextureBrickSize( short sz, bool strict )
+{
+    if ( sz > 0 )
+	_textureBrickSize = sz;
+
+    _isBrickSizeStrict = strict;
+}
+
+    
+short TexturePlaneNode::getTextureBrickSize() const
+{ return _textureBrickSize; }
+
+
+void TexturePlaneNode::setWidth( const osg::Vec3& width )
+{
+    _width = width;
+    _boundingGeometry->update();
+    setUpdateVar( isTilingWidth(width) ? _needsPlacementUpdate : _needsUpdate, true );
+}
+
+
+const osg::Vec3& TexturePlaneNode::getWidth() const
+{ return _width; }
+
+
+float TexturePlaneNode::getSense() const 
+{
+    float sense = _width.x()<0 ? -1.0f : 1.0f;
+    sense = _width.y()<0 ? -sense : sense;
+    sense = _width.z()<0 ? -sense : sense;
+    return _swapTextureAxes ? -sense :  sense;
+}
 
 
 void TexturePlaneNode::setLayeredTexture( LayeredTexture* lt )
 {
     if ( _texture )
+    {
 	_texture->removeCallback( _textureCallbackHandler );
+	if ( _viewDependentComposite )
+	    _texture->clearCompositeViewRegion();
+    }
 
     _texture = lt;
+    _tilingRetilingNr = -1;
+
+    _cameraViewLock.lock();
+    _cameraViews.clear();
+    _cameraViewsChanged = false;
+    _cameraViewLock.unlock();
 
     if ( _texture )
 	_texture->addCallback( _textureCallbackHandler );
@@ -598,7 +1990,14 @@ bool TexturePlaneNode::needsUpdate() const
     if ( _needsUpdate )
 	return true;
 
-    return _texture && _texture->needsRetiling();
+    if ( !_texture )
+	return false;
+
+    // Vertex offset (de)activation moves placement in or out of geometry
+    if ( isTilingLocal() == _texture->isDataLayerOK(_texture->getVertexOffsetLayerID()) )
+	return true;
+
+    return _texture->needsRetiling();
 }
 
 
@@ -0,0 +1,474 @@
+/* osgGeo - A collection of geoscientific extensions to OpenSceneGraph.
+Copyright 2011 dGB Beheer B.V.
+
+osgGeo is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+
+$Id$
+
+*/
+
+#include <osgGeo/ThreadGroup>
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Thread>
+#include <deque>
+#include <vector>
+
+
+namespace osgGeo
+{
+
+class ThreadPoolWorker : public OpenThreads::Thread
+{
+public:
+			ThreadPoolWorker(ThreadPool& pool,int generation)
+			    : _pool( pool )
+			    , _generation( generation )
+			{}
+
+    void		run()		{ _pool.runWorker( _generation ); }
+
+protected:
+    ThreadPool&		_pool;
+    const int		_generation;
+};
+
+
+/* Tasks of a TaskGroup that have not been started yet. The pool only queues
+   tickets referring to it, so that waiting threads can take the group's own
+   tasks without touching the tasks of others. Tickets whose task has been
+   taken already find the queue empty. */
+
+class TaskGroupQueue : public osg::Referenced
+{
+public:
+			TaskGroupQueue()
+			    : _nrPending( 0 )
+			{}
+
+    void		add(ThreadPoolTask&);
+    bool		executeOne();
+			//!Returns false if nothing was left to start
+    void		waitForPending();
+			//!Returns when no task is queued or running
+
+protected:
+
+    std::deque<ThreadPoolTask*>	_tasks;
+    int				_nrPending;
+    OpenThreads::Mutex		_lock;
+    OpenThreads::Condition	_cond;
+};
+
+
+void TaskGroupQueue::add( ThreadPoolTask& task )
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _lock );
+    _tasks.push_back( &task );
+    _nrPending++;
+}
+
+
+bool TaskGroupQueue::executeOne()
+{
+    _lock.lock();
+    if ( _tasks.empty() )
+    {
+	_lock.unlock();
+	return false;
+    }
+
+    ThreadPoolTask* task = _tasks.front();
+    _tasks.pop_front();
+    _lock.unlock();
+
+    task->execute();
+
+    _lock.lock();
+    _nrPending--;
+    if ( !_nrPending )
+	_cond.broadcast();
+    _lock.unlock();
+
+    return true;
+}
+
+
+void TaskGroupQueue::waitForPending()
+{
+    while ( executeOne() )
+	;
+
+    /* Nothing of ours left to start, so the remaining tasks are running on
+       other threads and will wake us up when finished. */
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _lock );
+    while ( _nrPending )
+	_cond.wait( &_lock );
+}
+
+
+static ThreadPool* threadPoolInst = 0;
+static OpenThreads::Mutex threadPoolInstLock;
+
+
+class ThreadPoolCleaner
+{
+public:
+			~ThreadPoolCleaner()
+			{
+			    delete threadPoolInst;
+			    threadPoolInst = 0;
+			}
+};
+
+static ThreadPoolCleaner threadPoolCleaner;
+
+
+ThreadPool& ThreadPool::instance()
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( threadPoolInstLock );
+    if ( !threadPoolInst )
+	threadPoolInst = new ThreadPool;
+
+    return *threadPoolInst;
+}
+
+
+ThreadPool::ThreadPool()
+    : _nrQueued( 0 )
+    , _generation( 0 )
+{
+    for ( unsigned int idx=0; idx<QueueSize; idx++ )
+    {
+	_queue[idx]._sequence.exchange( idx );
+	_queue[idx]._task = 0;
+	_queue[idx]._group = 0;
+    }
+
+    setNrWorkers( OpenThreads::GetNumberOfProcessors() );
+}
+
+
+ThreadPool::~ThreadPool()
+{
+    shutdown();
+}
+
+
+void ThreadPool::setNrWorkers( int nr )
+{
+    if ( nr<0 )
+	nr = 0;
+
+    std::vector<ThreadPoolWorker*> retired;
+
+    _workerLock.lock();
+
+    if ( nr<int(_workers.size()) )
+    {
+	/* Simplest is to replace all, as workers cannot be told apart. Old
+	   workers leave once the queue is empty. */
+	_queuedLock.lock();
+	_generation++;
+	_queuedCond.broadcast();
+	_queuedLock.unlock();
+
+	retired.swap( _workers );
+    }
+
+    while ( int(_workers.size())<nr )
+    {
+	ThreadPoolWorker* worker = new ThreadPoolWorker( *this, _generation );
+	worker->start();
+	_workers.push_back( worker );
+    }
+
+    _nrWorkers.exchange( _workers.size() );
+    _workerLock.unlock();
+
+    // Not locked, as retiring workers may still call nrWorkers() or submit(.)
+    for ( unsigned int idx=0; idx<retired.size(); idx++ )
+    {
+	retired[idx]->join();
+	delete retired[idx];
+    }
+
+    if ( !nr )
+    {
+	// Tasks may have slipped in while the last workers were leaving
+	while ( executeQueuedTask() )
+	    ;
+    }
+}
+
+
+int ThreadPool::nrWorkers() const
+{
+    return _nrWorkers;
+}
+
+
+void ThreadPool::shutdown()
+{
+    setNrWorkers( 0 );
+}
+
+
+bool ThreadPool::submit( ThreadPoolTask& task )
+{
+    return push( &task, 0 );
+}
+
+
+bool ThreadPool::push( ThreadPoolTask* task, TaskGroupQueue* group )
+{
+    if ( !nrWorkers() )
+	return false;
+
+    // Reservation bounds the queue without locking it
+    if ( ++_nrReserved > QueueSize )
+    {
+	--_nrReserved;
+	return false;
+    }
+
+    const unsigned int ticket = (++_pushTicket) - 1;
+    QueueSlot& slot = _queue[ticket%QueueSize];
+
+    // Slot may still be in use by a slow consumer of the previous round
+    while ( slot._sequence!=ticket )
+	OpenThreads::Thread::YieldCurrentThread();
+
+    if ( group )
+	group->ref();
+
+    slot._task = task;
+    slot._group = group;
+    slot._sequence.exchange( ticket+1 );
+
+    _queuedLock.lock();
+    _nrQueued++;
+    _queuedCond.signal();
+    _queuedLock.unlock();
+
+    return true;
+}
+
+
+bool ThreadPool::waitForTask( int generation )
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _queuedLock );
+
+    while ( generation>=0 && !_nrQueued && generation==_generation )
+	_queuedCond.wait( &_queuedLock );
+
+    if ( !_nrQueued )
+	return false;
+
+    _nrQueued--;
+    return true;
+}
+
+
+void ThreadPool::popAndExecute()
+{
+    // Only called after waitForTask(.) has claimed a queued task
+    const unsigned int ticket = (++_popTicket) - 1;
+    QueueSlot& slot = _queue[ticket%QueueSize];
+
+    // Producer of this ticket may still be filling the slot
+    while ( slot._sequence!=ticket+1 )
+	OpenThreads::Thread::YieldCurrentThread();
+
+    ThreadPoolTask* task = slot._task;
+    TaskGroupQueue* group = slot._group;
+    slot._sequence.exchange( ticket+QueueSize );
+    --_nrReserved;
+
+    if ( group )
+    {
+	group->executeOne();
+	group->unref();
+    }
+    else
+	task->execute();
+}
+
+
+bool ThreadPool::executeQueuedTask()
+{
+    if ( !waitForTask(-1) )
+	return false;
+
+    popAndExecute();
+    return true;
+}
+
+
+void ThreadPool::runWorker( int generation )
+{
+    while ( waitForTask(generation) )
+	popAndExecute();
+}
+
+
+//=============================================================================
+
+
+TaskGroup::TaskGroup()
+    : _queue( new TaskGroupQueue )
+{}
+
+
+TaskGroup::~TaskGroup()
+{
+    wait();
+}
+
+
+void TaskGroup::submit( ThreadPoolTask& task )
+{
+    _queue->add( task );
+
+    if ( !ThreadPool::instance().push(0,_queue.get()) )
+	_queue->executeOne();
+}
+
+
+void TaskGroup::wait()
+{
+    _queue->waitForPending();
+}
+
+
+//=============================================================================
+
+
+/* Chunks of a parallelFor(.) range divided into one share per thread. The
+   chunks of a share are claimed by an atomic counter, so that any thread
+   can steal from a share once its own share is finished. */
+
+class ParallelForJob
+{
+public:
+			ParallelForJob(size_t nrItems,ParallelForBody& body,
+				       size_t chunkSize,int nrShares)
+			    : _nrItems( nrItems )
+			    , _body( body )
+			    , _chunkSize( chunkSize )
+			    , _nrShares( nrShares )
+			    , _claimedChunks( new OpenThreads::Atomic[nrShares] )
+			{
+			    const size_t nrChunks = (nrItems+chunkSize-1) / chunkSize;
+			    for ( int idx=0; idx<=nrShares; idx++ )
+				_firstChunks.push_back( nrChunks*idx/nrShares );
+			}
+
+			~ParallelForJob()	{ delete [] _claimedChunks; }
+
+    void		work(int share);
+
+protected:
+
+    const size_t		_nrItems;
+    ParallelForBody&		_body;
+    const size_t		_chunkSize;
+    const int			_nrShares;
+    std::vector<size_t>		_firstChunks;
+    OpenThreads::Atomic*	_claimedChunks;
+};
+
+
+void ParallelForJob::work( int share )
+{
+    for ( int idx=0; idx<_nrShares; idx++ )
+    {
+	const int curShare = (share+idx) % _nrShares;
+	const size_t shareSize = _firstChunks[curShare+1]-_firstChunks[curShare];
+
+	while ( true )
+	{
+	    const size_t chunkIdx = (++_claimedChunks[curShare]) - 1;
+	    if ( chunkIdx>=shareSize )
+		break;
+
+	    const size_t start = (_firstChunks[curShare]+chunkIdx) * _chunkSize;
+	    const size_t stop = start+_chunkSize<_nrItems ? start+_chunkSize : _nrItems;
+	    _body.run( start, stop );
+	}
+    }
+}
+
+
+class ParallelForShare : public ThreadPoolTask
+{
+public:
+			ParallelForShare(ParallelForJob& job,int share)
+			    : _job( job )
+			    , _share( share )
+			{}
+
+    void		execute()		{ _job.work( _share ); }
+
+protected:
+    ParallelForJob&	_job;
+    int			_share;
+};
+
+
+void parallelFor( size_t nrItems, ParallelForBody& body, size_t minChunkSize, int maxNrThreads )
+{
+    if ( !nrItems )
+	return;
+
+    if ( minChunkSize<1 )
+	minChunkSize = 1;
+
+    int nrThreads = ThreadPool::instance().nrWorkers() + 1;
+    if ( maxNrThreads>0 && nrThreads>maxNrThreads )
+	nrThreads = maxNrThreads;
+
+    const size_t maxShares = (nrItems+minChunkSize-1) / minChunkSize;
+    if ( size_t(nrThreads)>maxShares )
+	nrThreads = int( maxShares );
+
+    if ( nrThreads<=1 )
+    {
+	body.run( 0, nrItems );
+	return;
+    }
+
+    // Around sixteen chunks per thread leaves enough work to be stolen
+    size_t chunkSize = nrItems / (16*nrThreads);
+    if ( chunkSize<minChunkSize )
+	chunkSize = minChunkSize;
+
+    ParallelForJob job( nrItems, body, chunkSize, nrThreads );
+
+    std::vector<ParallelForShare*> shares;
+    for ( int share=1; share<nrThreads; share++ )
+	shares.push_back( new ParallelForShare(job,share) );
+
+    TaskGroup group;
+    for ( unsigned int idx=0; idx<shares.size(); idx++ )
+	group.submit( *shares[idx] );
+
+    job.work( 0 );
+    group.wait();
+
+    for ( unsigned int idx=0; idx<shares.size(); idx++ )
+	delete shares[idx];
+}
+
+
+} //namespace osgGeo
@@ -0,0 +1,87 @@
+/* osgGeo - A collection of geoscientific extensions to OpenSceneGraph.
+Copyright 2011 dGB Beheer B.V.
+
+osgGeo is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+
+$Id$
+
+*/
+
+
+#include <osgGeo/TexturePlane>
+#include "TestSupport"
+
+
+/* Sampling changes and new layer images of the same layout must be applied
+   to the current tile textures, while a new layout or texture shift only
+   rebuilds what it invalidates. Runs without graphics context. */
+
+
+// Tile textures are updated with the setup StateSet, as done by the cull
+static void updateWithSetup( osgGeo::TexturePlaneNode& plane )
+{
+    update( plane );
+    plane.getLayeredTexture()->getSetupStateSet();
+    update( plane );
+}
+
+
+int main( int, char** )
+{
+    osg::ref_ptr<osgGeo::LayeredTexture> laytex = createTestTexture();
+    const int id = laytex->getDataLayerID( 0 );
+
+    osg::ref_ptr<osgGeo::TexturePlaneNode> plane = new osgGeo::TexturePlaneNode;
+    plane->setTextureBrickSize( 64, true );
+    plane->setLayeredTexture( laytex.get() );
+    plane->setWidth( osg::Vec3(200,0,100) );
+    updateWithSetup( *plane );
+
+    int nrRetilings = laytex->getNrRetilings();
+    int nrSamplingUpdates = laytex->getNrTileSamplingUpdates();
+    int nrImageRenewals = laytex->getNrTileImageRenewals();
+    int nrTilingUpdates = plane->getNrTilingUpdates();
+    int nrGeometryUpdates = plane->getNrGeometryUpdates();
+
+    int res = check( nrRetilings>0 && nrTilingUpdates>0, "Plane was not tiled" );
+
+    laytex->setDataLayerFilterType( id, osgGeo::Nearest );
+    updateWithSetup( *plane );
+    res += check( laytex->getNrTileSamplingUpdates()==nrSamplingUpdates+1, "Filter change did not update the tile sampling" );
+    res += check( laytex->getNrRetilings()==nrRetilings, "Filter change retiled the texture" );
+    res += check( plane->getNrTilingUpdates()==nrTilingUpdates, "Filter change rebuilt the tiles" );
+
+    laytex->setDataLayerImage( id, createTestImage(200,100,1,7) );
+    updateWithSetup( *plane );
+    res += check( laytex->getNrTileImageRenewals()==nrImageRenewals+1, "Image of the same layout did not renew the tile images" );
+    res += check( laytex->getNrRetilings()==nrRetilings, "Image of the same layout retiled the texture" );
+    res += check( plane->getNrTilingUpdates()==nrTilingUpdates, "Image of the same layout rebuilt the tiles" );
+
+    laytex->setDataLayerImage( id, createTestImage(300,100) );
+    updateWithSetup( *plane );
+    res += check( laytex->getNrRetilings()==nrRetilings+1, "Image of another layout did not retile the texture" );
+    res += check( plane->getNrTilingUpdates()==nrTilingUpdates+1, "Image of another layout did not rebuild the tiles" );
+    res += check( laytex->getNrTileImageRenewals()==nrImageRenewals+1, "Image of another layout renewed the tile images" );
+
+    nrRetilings = laytex->getNrRetilings();
+    nrTilingUpdates = plane->getNrTilingUpdates();
+
+    plane->setTextureShift( osg::Vec2(0.5f,0.5f) );
+    updateWithSetup( *plane );
+    res += check( plane->getNrGeometryUpdates()==nrGeometryUpdates+1, "Texture shift did not update the geometries only" );
+    res += check( plane->getNrTilingUpdates()==nrTilingUpdates, "Texture shift rebuilt the tiles" );
+    res += check( laytex->getNrRetilings()==nrRetilings, "Texture shift retiled the texture" );
+
+    return res;
+}
@@ -0,0 +1,79 @@
+/* osgGeo - A collection of geoscientific extensions to OpenSceneGraph.
+Copyright 2011 dGB Beheer B.V.
+
+osgGeo is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+
+$Id$
+
+*/
+
+
+#include "TestSupport"
+#include <osg/Texture2D>
+#include <osg/Version>
+#include <vector>
+
+
+/* Touching a sub-rectangle of a layer image must only re-upload the tiles
+   overlapping it, without retiling or dirtying the whole image. */
+
+
+static const osg::Image* getCutoutImage( const osgGeo::LayeredTexture& laytex, const osg::Vec2f& origin, const osg::Vec2f& opposite, osg::ref_ptr<osg::StateSet>& stateset )
+{
+    std::vector<osgGeo::LayeredTexture::TextureCoordData> tcData;
+    stateset = laytex.createCutoutStateSet( origin, opposite, tcData );
+    if ( !stateset || tcData.size()!=1 )
+	return 0;
+
+    const osg::Texture2D* texture = dynamic_cast<const osg::Texture2D*>( stateset->getTextureAttribute(tcData[0]._textureUnit,osg::StateAttribute::TEXTURE) );
+    return texture ? texture->getImage() : 0;
+}
+
+
+int main( int, char** )
+{
+#if OSG_MIN_VERSION_REQUIRED(3,1,0)
+    osg::ref_ptr<osg::Image> image = createTestImage( 200, 100 );
+    osg::ref_ptr<osgGeo::LayeredTexture> laytex = createTestTexture( image.get() );
+    const int id = laytex->getDataLayerID( 0 );
+    laytex->getSetupStateSet();
+    laytex->reInitTiling();
+
+    osg::ref_ptr<osg::StateSet> touchedStateSet, otherStateSet;
+    const osg::Image* touchedTile = getCutoutImage( *laytex, osg::Vec2f(0,0), osg::Vec2f(63,63), touchedStateSet );
+    const osg::Image* otherTile = getCutoutImage( *laytex, osg::Vec2f(128,0), osg::Vec2f(191,63), otherStateSet );
+
+    int res = check( touchedTile && otherTile && touchedTile!=otherTile, "Cut-outs have no tile images of their own" );
+    if ( res )
+	return res;
+
+    const unsigned int touchedCount = touchedTile->getModifiedCount();
+    const unsigned int otherCount = otherTile->getModifiedCount();
+    const unsigned int imageCount = image->getModifiedCount();
+    const int nrRetilings = laytex->getNrRetilings();
+
+    image->data()[10*200+10] = 0;
+    laytex->touchDataLayerImage( id, osgGeo::Vec2i(10,10), osgGeo::Vec2i(4,4) );
+    laytex->getSetupStateSet();
+
+    res += check( touchedTile->getModifiedCount()!=touchedCount, "Touched tile was not re-uploaded" );
+    res += check( otherTile->getModifiedCount()==otherCount, "Tile outside the touched region was re-uploaded" );
+    res += check( image->getModifiedCount()==imageCount, "Touch dirtied the whole layer image" );
+    res += check( laytex->getNrRetilings()==nrRetilings && !laytex->needsRetiling(), "Touch retiled the texture" );
+    return res;
+#else
+    // Tiles are copies without image stride, so all are updated
+    return 0;
+#endif
+}
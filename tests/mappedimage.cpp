@@ -0,0 +1,85 @@
+/* osgGeo - A collection of geoscientific extensions to OpenSceneGraph.
+Copyright 2011 dGB Beheer B.V.
+
+osgGeo is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+
+$Id$
+
+*/
+
+
+#include <osgGeo/MappedImage>
+#include "TestSupport"
+#include <cstdio>
+#include <iostream>
+
+
+/* A mapped raw file must show its samples after the header as image data,
+   while writes to the image never reach the file. */
+
+
+static bool hasFileData( const osg::Image& image, int nrPixels )
+{
+    for ( int idx=0; idx<nrPixels; idx++ )
+    {
+	if ( image.data()[idx]!=(unsigned char) (idx%251) )
+	    return false;
+    }
+
+    return true;
+}
+
+
+int main( int, char** )
+{
+    const int s = 6;
+    const int t = 5;
+    const int r = 4;
+    const int headerSize = 16;
+    const char* fileName = "test_mappedimage.raw";
+
+    FILE* fp = fopen( fileName, "wb" );
+    if ( !fp )
+    {
+	std::cerr << "Cannot write " << fileName << std::endl;
+	return 1;
+    }
+
+    for ( int idx=0; idx<headerSize; idx++ )
+	fputc( 255, fp );
+    for ( int idx=0; idx<s*t*r; idx++ )
+	fputc( idx%251, fp );
+    fclose( fp );
+
+    osg::ref_ptr<osgGeo::MappedImage> image = new osgGeo::MappedImage;
+    int res = check( image->open(fileName,headerSize,s,t,r,GL_LUMINANCE,GL_UNSIGNED_BYTE), "File was not mapped" );
+    if ( !res )
+    {
+	res += check( image->s()==s && image->t()==t && image->r()==r, "Mapped image has wrong dimensions" );
+	res += check( hasFileData(*image,s*t*r), "Mapped image does not show the file data" );
+
+	image->data()[0] = 7;
+	image->data()[s*t*r-1] = 7;
+	res += check( image->data()[0]==7, "Write to the mapped image was lost" );
+	image->close();
+	res += check( !image->isOpen(), "Mapped image was not closed" );
+
+	res += check( image->open(fileName,headerSize,s,t,r,GL_LUMINANCE,GL_UNSIGNED_BYTE), "File was not mapped again" );
+	res += check( hasFileData(*image,s*t*r), "Write to the mapped image reached the file" );
+	image->close();
+    }
+
+    remove( fileName );
+    return res;
+}
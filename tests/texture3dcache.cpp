@@ -0,0 +1,99 @@
+/* osgGeo - A collection of geoscientific extensions to OpenSceneGraph.
+Copyright 2011 dGB Beheer B.V.
+
+osgGeo is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+
+$Id$
+
+*/
+
+
+#include "TestSupport"
+#include <osg/Matrixf>
+#include <osg/observer_ptr>
+#include <vector>
+
+
+/* All cut-outs of 3D layers showing the same image must share one Texture3D,
+   also across layered textures, without keeping removed images alive. Runs
+   without graphics context. */
+
+
+static osgGeo::LayeredTexture* create3DTexture( osg::Image* image, const osg::Matrixf& vertex2Texture )
+{
+    osgGeo::LayeredTexture* laytex = createTestTexture( image );
+    laytex->setDataLayerVertex2TextureTransform( laytex->getDataLayerID(0), &vertex2Texture );
+
+    laytex->getSetupStateSet();
+    laytex->reInitTiling();
+    return laytex;
+}
+
+
+static const osg::StateAttribute* getCutoutTexture( const osgGeo::LayeredTexture& laytex, const osg::Vec2f& origin, const osg::Vec2f& opposite, osg::ref_ptr<osg::StateSet>& stateset )
+{
+    std::vector<osgGeo::LayeredTexture::TextureCoordData> tcData;
+    stateset = laytex.createCutoutStateSet( origin, opposite, tcData );
+    if ( !stateset || tcData.size()!=1 )
+	return 0;
+
+    return stateset->getTextureAttribute( tcData[0]._textureUnit, osg::StateAttribute::TEXTURE );
+}
+
+
+int main( int, char** )
+{
+    osg::ref_ptr<osg::Image> image = createTestImage( 8, 8, 8 );
+
+    const osg::Matrixf vertex2Texture = osg::Matrixf::scale( osg::Vec3f(0.125,0.125,0.125) );
+
+    const unsigned int nrCreatedBefore = osgGeo::LayeredTexture::getNrCreated3DTextures();
+
+    osg::ref_ptr<osgGeo::LayeredTexture> laytex1 = create3DTexture( image.get(), vertex2Texture );
+    osg::ref_ptr<osgGeo::LayeredTexture> laytex2 = create3DTexture( image.get(), vertex2Texture );
+
+    std::vector<osg::ref_ptr<osg::StateSet> > statesets( 4 );
+    const osg::StateAttribute* textures[4];
+    textures[0] = getCutoutTexture( *laytex1, osg::Vec2f(0,0), osg::Vec2f(3,3), statesets[0] );
+    textures[1] = getCutoutTexture( *laytex1, osg::Vec2f(4,4), osg::Vec2f(7,7), statesets[1] );
+    textures[2] = getCutoutTexture( *laytex2, osg::Vec2f(0,4), osg::Vec2f(3,7), statesets[2] );
+    textures[3] = getCutoutTexture( *laytex2, osg::Vec2f(4,0), osg::Vec2f(7,3), statesets[3] );
+
+    int res = 0;
+    for ( int idx=0; idx<4; idx++ )
+    {
+	if ( !textures[idx] || textures[idx]!=textures[0] )
+	{
+	    std::cerr << "Cut-out " << idx << " has no shared Texture3D" << std::endl;
+	    res = 1;
+	}
+    }
+
+    const unsigned int nrCreated = osgGeo::LayeredTexture::getNrCreated3DTextures() - nrCreatedBefore;
+    if ( nrCreated!=1 )
+    {
+	std::cerr << nrCreated << " Texture3D objects created instead of one" << std::endl;
+	res = 1;
+    }
+
+    const osg::observer_ptr<osg::Image> removedImage = image.get();
+    image = 0;
+    statesets.clear();
+    laytex1->removeDataLayer( laytex1->getDataLayerID(laytex1->nrDataLayers()-1) );
+    laytex2->removeDataLayer( laytex2->getDataLayerID(laytex2->nrDataLayers()-1) );
+
+    res += check( !removedImage.valid() && !osgGeo::LayeredTexture::getNrShared3DTextures(), "Removed image kept alive by the Texture3D cache" );
+
+    return res;
+}
@@ -0,0 +1,126 @@
+/* osgGeo - A collection of geoscientific extensions to OpenSceneGraph.
+Copyright 2011 dGB Beheer B.V.
+
+osgGeo is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+
+$Id$
+
+*/
+
+
+#include <osgGeo/TexturePlane>
+#include <osg/Camera>
+#include <osg/Version>
+#include <osg/Viewport>
+#include <osgUtil/CullVisitor>
+#include <osgUtil/RenderStage>
+#include <osgUtil/StateGraph>
+#include "TestSupport"
+
+
+/* Culls a tiled plane through a fixed orthographic frustum showing its left
+   half, and checks the tiles drawn against the view. Runs without graphics
+   context. */
+
+
+// Drawn tiles in eye coordinates, where x and y are world x and z
+
+static void collectDrawnBoxes( const osgUtil::StateGraph& sg, std::vector<osg::BoundingBox>& boxes )
+{
+    for ( unsigned int idx=0; idx<sg._leaves.size(); idx++ )
+    {
+	const osgUtil::RenderLeaf& leaf = *sg._leaves[idx];
+#if OSG_MIN_VERSION_REQUIRED(3,3,2)
+	const osg::BoundingBox bb = leaf._drawable->getBoundingBox();
+#else
+	const osg::BoundingBox bb = leaf._drawable->getBound();
+#endif
+	osg::BoundingBox eyeBox;
+	for ( int corner=0; corner<8; corner++ )
+	    eyeBox.expandBy( bb.corner(corner) * (*leaf._modelview) );
+
+	boxes.push_back( eyeBox );
+    }
+
+    osgUtil::StateGraph::ChildList::const_iterator it = sg._children.begin();
+    for ( ; it!=sg._children.end(); it++ )
+	collectDrawnBoxes( *it->second, boxes );
+}
+
+
+int main( int, char** )
+{
+    osg::ref_ptr<osgGeo::LayeredTexture> laytex = createTestTexture();
+    osg::ref_ptr<osgGeo::TexturePlaneNode> plane = new osgGeo::TexturePlaneNode;
+    plane->setTextureBrickSize( 64, true );
+    plane->setLayeredTexture( laytex.get() );
+    plane->setCenter( osg::Vec3(0,0,0) );
+    plane->setWidth( osg::Vec3(200,0,100) );
+
+    update( *plane );
+
+    const int nrTiles = plane->getNrTiles();
+
+    osg::ref_ptr<osg::Camera> camera = new osg::Camera;
+    osg::ref_ptr<osgUtil::StateGraph> stateGraph = new osgUtil::StateGraph;
+    osg::ref_ptr<osgUtil::RenderStage> renderStage = new osgUtil::RenderStage;
+    renderStage->setCamera( camera.get() );
+
+    osg::ref_ptr<osgUtil::CullVisitor> cv = new osgUtil::CullVisitor;
+    cv->reset();
+    cv->setStateGraph( stateGraph.get() );
+    cv->setRenderStage( renderStage.get() );
+
+    // Looking along +y at x in [-100,0], so the right half is culled
+    osg::ref_ptr<osg::Viewport> viewport = new osg::Viewport( 0, 0, 400, 400 );
+    osg::ref_ptr<osg::RefMatrix> projection = new osg::RefMatrix( osg::Matrix::ortho(-100,0,-50,50,1,1000) );
+    osg::ref_ptr<osg::RefMatrix> modelView = new osg::RefMatrix( osg::Matrix::lookAt(osg::Vec3(0,-100,0),osg::Vec3(0,0,0),osg::Vec3(0,0,1)) );
+
+    cv->pushViewport( viewport.get() );
+    cv->pushProjectionMatrix( projection.get() );
+    cv->pushModelViewMatrix( modelView.get(), osg::Transform::ABSOLUTE_RF );
+    plane->accept( *cv );
+    cv->popModelViewMatrix();
+    cv->popProjectionMatrix();
+    cv->popViewport();
+
+    std::vector<osg::BoundingBox> drawnBoxes;
+    collectDrawnBoxes( *stateGraph, drawnBoxes );
+
+    const int nrQuads = plane->getQuadsPerBrickSide() * plane->getQuadsPerBrickSide();
+    const int nrDrawnTiles = drawnBoxes.size() / nrQuads;
+    const int nrCulledTiles = plane->getNrCulledTiles( camera.get() );
+
+    int res = 0;
+    if ( nrCulledTiles<1 || nrDrawnTiles<1 || nrDrawnTiles+nrCulledTiles!=nrTiles )
+    {
+	std::cerr << nrDrawnTiles << " drawn and " << nrCulledTiles
+		  << " culled of " << nrTiles << " tiles" << std::endl;
+	res = 1;
+    }
+
+    res += check( plane->getNrCulledTiles()==nrCulledTiles, "Culled tiles not kept for the last camera" );
+
+    for ( unsigned int idx=0; idx<drawnBoxes.size(); idx++ )
+    {
+	if ( drawnBoxes[idx].xMin()>0.0f || drawnBoxes[idx].xMax()<-100.0f )
+	{
+	    std::cerr << "Tile outside the view was drawn" << std::endl;
+	    res = 1;
+	    break;
+	}
+    }
+
+    return res;
+}
@@ -0,0 +1,66 @@
+/* osgGeo - A collection of geoscientific extensions to OpenSceneGraph.
+Copyright 2011 dGB Beheer B.V.
+
+osgGeo is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>
+
+$Id$
+
+*/
+
+
+#include <osgGeo/TexturePlane>
+#include "TestSupport"
+
+
+/* Moving, rotating or scaling a plane with an unchanged tiling must only
+   update its placement, without new tiles or tile textures. Runs without
+   graphics context. */
+
+
+int main( int, char** )
+{
+    osg::ref_ptr<osgGeo::LayeredTexture> laytex = createTestTexture();
+    osg::ref_ptr<osgGeo::TexturePlaneNode> plane = new osgGeo::TexturePlaneNode;
+    plane->setTextureBrickSize( 64, true );
+    plane->setLayeredTexture( laytex.get() );
+    plane->setCenter( osg::Vec3(0,0,0) );
+    plane->setWidth( osg::Vec3(200,0,100) );
+    update( *plane );
+
+    const int nrTilingUpdates = plane->getNrTilingUpdates();
+    const int nrPlacementUpdates = plane->getNrPlacementUpdates();
+    const int nrRetilings = laytex->getNrRetilings();
+    const int nrTiles = plane->getNrTiles();
+
+    int res = check( nrTilingUpdates>0 && nrTiles>1, "Plane was not tiled" );
+
+    plane->setCenter( osg::Vec3(10,-5,3) );
+    update( *plane );
+    plane->setRotation( osg::Quat(0.3,osg::Vec3(0,0,1)) );
+    update( *plane );
+    plane->setWidth( osg::Vec3(400,0,200) );
+    update( *plane );
+
+    res += check( plane->getNrTilingUpdates()==nrTilingUpdates, "Transform changes rebuilt the tiles" );
+    res += check( laytex->getNrRetilings()==nrRetilings, "Transform changes retiled the texture" );
+    res += check( plane->getNrTiles()==nrTiles, "Transform changes changed the tiles" );
+    res += check( plane->getNrPlacementUpdates()==nrPlacementUpdates+3, "Transform changes were not applied as placement" );
+
+    // Another texel size ratio does need new tiles
+    plane->setWidth( osg::Vec3(400,0,100) );
+    update( *plane );
+    res += check( plane->getNrTilingUpdates()==nrTilingUpdates+1, "Texel size ratio change did not rebuild the tiles" );
+
+    return res;
+}